@@ -8,7 +8,24 @@ MRB_BEGIN_DECL
 #define E_MSGPACK_ERROR (mrb_class_get_under(mrb, mrb_module_get(mrb, "MessagePack"), "Error"))
 MRB_API mrb_value mrb_msgpack_pack(mrb_state *mrb, mrb_value object);
 MRB_API mrb_value mrb_msgpack_pack_argv(mrb_state *mrb, mrb_value *argv, mrb_int argv_len);
+MRB_API mrb_int mrb_msgpack_packed_size(mrb_state *mrb, mrb_value object);
 MRB_API mrb_value mrb_msgpack_unpack(mrb_state *mrb, mrb_value data);
+MRB_API mrb_value mrb_msgpack_codec_pack(mrb_state *mrb, mrb_value codec, mrb_value object);
+MRB_API mrb_value mrb_msgpack_codec_unpack(mrb_state *mrb, mrb_value codec, mrb_value data);
+
+MRB_API mrb_value mrb_msgpack_packer_new(mrb_state *mrb);
+MRB_API void mrb_msgpack_packer_write(mrb_state *mrb, mrb_value packer, mrb_value object);
+MRB_API mrb_value mrb_msgpack_packer_to_s(mrb_state *mrb, mrb_value packer);
+MRB_API void mrb_msgpack_packer_reset(mrb_state *mrb, mrb_value packer);
+MRB_API mrb_int mrb_msgpack_packer_bytesize(mrb_state *mrb, mrb_value packer);
+MRB_API mrb_int mrb_msgpack_packer_flush(mrb_state *mrb, mrb_value packer);
+
+MRB_API mrb_value mrb_msgpack_unpacker_new(mrb_state *mrb);
+MRB_API void mrb_msgpack_unpacker_feed(mrb_state *mrb, mrb_value unpacker, const char *data, size_t len);
+MRB_API mrb_bool mrb_msgpack_unpacker_next(mrb_state *mrb, mrb_value unpacker, mrb_value *object);
+MRB_API mrb_int mrb_msgpack_unpacker_buffer_size(mrb_state *mrb, mrb_value unpacker);
+
+MRB_API mrb_value mrb_msgpack_raw_value_new(mrb_state *mrb, mrb_value packed, mrb_bool validate);
 
 MRB_API mrb_value mrb_str_constantize(mrb_state *mrb, mrb_value str);
 MRB_API void mrb_msgpack_class_cache_clear(mrb_state *mrb);
@@ -10,4 +10,15 @@ module MessagePack
 
     nil
   end
+
+  # Compiles a packer for Hashes with the given keys, see Schema
+  def self.compile(schema, codec: nil)
+    Schema.new(schema, codec: codec)
+  end
+
+  class Codec
+    def compile(schema)
+      Schema.new(schema, codec: self)
+    end
+  end
 end
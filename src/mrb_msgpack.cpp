@@ -17,6 +17,7 @@
 #include <mruby/msgpack.h>
 #include <mruby/proc.h>
 #include <mruby/time.h>
+#include <mruby/error.h>
 
 MRB_BEGIN_DECL
 #include <mruby/internal.h>
@@ -29,9 +30,33 @@ MRB_END_DECL
 
 #include <string>
 #include <string_view>
+#include <unordered_map>
 #include <cstdint>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <thread>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <system_error>
 #include <mrbconf.h>
 
+#ifndef _WIN32
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#ifdef MRB_MSGPACK_USE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef MRB_MSGPACK_USE_ZSTD
+#include <zstd.h>
+#endif
+
 #ifndef MRB_STR_LENGTH_MAX
 # define MRB_STR_LENGTH_MAX 1048576
 #endif
@@ -80,12 +105,159 @@ compute_capacity(mrb_state *mrb, size_t stack_size, size_t buf_size)
   return capa;
 }
 
+/* A sink takes over the writer's output when the bytes should not end up
+ * in a fresh mruby String (e.g. a Packer's reusable buffer). */
+struct mrb_msgpack_sink {
+  virtual ~mrb_msgpack_sink() = default;
+  virtual void write(const char* buf, size_t buf_size) = 0;
+};
+
+struct mrb_msgpack_buffer_sink : mrb_msgpack_sink {
+  std::string buf;
+
+  void write(const char* p, size_t n) override {
+    buf.append(p, n);
+  }
+};
+
+/* Copies into fixed size chunks and hands them to writev(2) once
+ * high_water bytes are buffered, so a message never has to fit in memory. */
+struct mrb_msgpack_fd_sink : mrb_msgpack_sink {
+  static constexpr size_t CHUNK_SIZE         = 64 * 1024;
+  static constexpr size_t DEFAULT_HIGH_WATER = 4 * CHUNK_SIZE;
+
+  mrb_msgpack_fd_sink(mrb_state* mrb, int fd, size_t high_water)
+    : mrb(mrb), fd(fd), high_water(high_water ? high_water : DEFAULT_HIGH_WATER) {}
+
+  void write(const char* p, size_t n) override {
+    while (n > 0) {
+      if (used == 0 || chunks[used - 1].size() == CHUNK_SIZE) {
+        if (used == chunks.size()) {
+          chunks.emplace_back();
+          chunks.back().reserve(CHUNK_SIZE);
+        }
+        ++used;
+      }
+      std::string& chunk = chunks[used - 1];
+      size_t take = std::min(n, CHUNK_SIZE - chunk.size());
+      chunk.append(p, take);
+      buffered += take;
+      p += take;
+      n -= take;
+    }
+
+    if (buffered >= high_water && !hold) flush();
+  }
+
+  void flush() {
+#ifndef _WIN32
+    size_t first = 0, skip = 0;
+
+    while (first < used) {
+      struct iovec iov[64];
+      int iovcnt = 0;
+      for (size_t i = first; i < used && iovcnt < 64; ++i, ++iovcnt) {
+        size_t off = (i == first) ? skip : 0;
+        iov[iovcnt].iov_base = &chunks[i][off];
+        iov[iovcnt].iov_len  = chunks[i].size() - off;
+      }
+
+      ssize_t n = ::writev(fd, iov, iovcnt);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        int err = errno;
+        consume(first, skip);
+        errno = err;
+        mrb_sys_fail(mrb, "writev");
+      }
+      written += static_cast<size_t>(n);
+
+      size_t left = static_cast<size_t>(n);
+      while (first < used && left >= chunks[first].size() - skip) {
+        left -= chunks[first].size() - skip;
+        skip = 0;
+        ++first;
+      }
+      skip += left;
+    }
+#else
+    mrb_raise(mrb, E_NOTIMP_ERROR, "writev(2) is not available on this platform");
+#endif
+    for (size_t i = 0; i < used; ++i) chunks[i].clear();
+    used = 0;
+    buffered = 0;
+  }
+
+  void discard() {
+    for (size_t i = 0; i < used; ++i) chunks[i].clear();
+    used = 0;
+    buffered = 0;
+    hold = false;
+  }
+
+  /* keeps the first keep buffered bytes */
+  void truncate(size_t keep) {
+    size_t i = 0;
+    buffered = 0;
+    for (; i < used && buffered + chunks[i].size() <= keep; ++i) buffered += chunks[i].size();
+    if (i < used && buffered < keep) {
+      chunks[i].resize(keep - buffered);
+      buffered = keep;
+      ++i;
+    }
+    for (size_t j = i; j < used; ++j) chunks[j].clear();
+    used = i;
+  }
+
+  /* drops the first chunks and skip bytes of the next one, which the kernel
+   * has taken already, so a retry after a failed writev doesn't send them twice */
+  void consume(size_t first, size_t skip) {
+    for (size_t i = 0; i < first; ++i) chunks[i].clear();
+    if (first < used) chunks[first].erase(0, skip);
+    std::rotate(chunks.begin(), chunks.begin() + first, chunks.begin() + used);
+    used -= first;
+    buffered = 0;
+    for (size_t i = 0; i < used; ++i) buffered += chunks[i].size();
+  }
+
+  mrb_state* mrb;
+  int fd;
+  size_t high_water;
+  std::vector<std::string> chunks;
+  size_t used     = 0; /* chunks holding data */
+  size_t buffered = 0; /* bytes not yet written */
+  size_t written  = 0; /* bytes handed to the kernel */
+  bool hold = false;   /* no flushing in the middle of a Packer#write */
+};
+
+/* Counts instead of writing, used to size the output up front. */
+struct mrb_msgpack_size_sink : mrb_msgpack_sink {
+  size_t size = 0;
+
+  void write(const char*, size_t n) override {
+    size += n;
+  }
+};
+
 struct mrb_msgpack_sbo_writer {
   mrb_msgpack_sbo_writer(mrb_state* mrb)
     : mrb(mrb) {}
 
+  /* exact_size comes from a sizing pass, the result is allocated once */
+  mrb_msgpack_sbo_writer(mrb_state* mrb, size_t exact_size)
+    : mrb(mrb) {
+    if (exact_size > STACK_CAP) {
+      heap_str = mrb_str_new_capa(mrb, safe_size_to_mrb_int(mrb, exact_size));
+    }
+  }
+
+  mrb_msgpack_sbo_writer(mrb_state* mrb, mrb_msgpack_sink* sink)
+    : mrb(mrb), sink(sink) {}
+
   void write(const char* buf, size_t buf_size) {
-    if (likely(mrb_undef_p(heap_str) &&
+    if (sink) {
+      sink->write(buf, buf_size);
+    } else if (likely(mrb_undef_p(heap_str) &&
               buf_size <= STACK_CAP - stack_size)) {
 
       std::memcpy(stack_buf + stack_size, buf, buf_size);
@@ -110,6 +282,7 @@ struct mrb_msgpack_sbo_writer {
 
 private:
   mrb_state* mrb;
+  mrb_msgpack_sink* sink = nullptr;
 
   static constexpr size_t STACK_CAP = 8 * 1024;
   char   stack_buf[STACK_CAP];
@@ -118,1168 +291,4578 @@ private:
 };
 
 /* ------------------------------------------------------------------------
- * Forward declarations
+ * Framed compression
+ *
+ * With compress: the packed bytes are cut into blocks which are compressed
+ * one at a time as soon as they are full, each block becomes a frame:
+ *
+ *   "MZ" | algorithm (u8) | raw size (u32 BE) | stored size (u32 BE) | data
+ *
+ * A block that doesn't get smaller is stored as it is. Frames don't care
+ * where a message starts or ends, their raw blocks one after another are
+ * the plain msgpack stream.
  * ------------------------------------------------------------------------ */
 
-struct mrb_msgpack_ctx {
-    void (*sym_packer)(mrb_state*, mrb_value, int8_t, msgpack::packer<mrb_msgpack_sbo_writer>&);
-    mrb_value (*sym_unpacker)(mrb_state*, const msgpack::object&);
-    int8_t ext_type;
-};
-MRB_CPP_DEFINE_TYPE(mrb_msgpack_ctx, mrb_msgpack_ctx);
-
-/* default symbol strategy type (used by ctx) */
-#ifndef MRB_MSGPACK_DEFAULT_SYMBOL_TYPE
-#define MRB_MSGPACK_DEFAULT_SYMBOL_TYPE 0
+#ifndef MRB_MSGPACK_FRAME_BLOCK
+# define MRB_MSGPACK_FRAME_BLOCK (64 * 1024)
 #endif
 
-#define MRB_MSGPACK_CONTEXT(mrb) (mrb_cpp_get<mrb_msgpack_ctx>(mrb, mrb_gv_get(mrb, MRB_SYM(__msgpack__ctx))))
-
-
-static void mrb_msgpack_pack_value(mrb_state* mrb, mrb_value self, msgpack::packer<mrb_msgpack_sbo_writer>& pk);
-static void mrb_msgpack_pack_array_value(mrb_state* mrb, mrb_value self, msgpack::packer<mrb_msgpack_sbo_writer>& pk);
-static void mrb_msgpack_pack_hash_value(mrb_state* mrb, mrb_value self, msgpack::packer<mrb_msgpack_sbo_writer>& pk);
+#ifndef MRB_MSGPACK_ZSTD_LEVEL
+# define MRB_MSGPACK_ZSTD_LEVEL 3
+#endif
 
-static mrb_value mrb_unpack_msgpack_obj(mrb_state* mrb, const msgpack::object& obj);
-static mrb_value mrb_unpack_msgpack_obj_array(mrb_state* mrb, const msgpack::object& obj);
-static mrb_value mrb_unpack_msgpack_obj_map(mrb_state* mrb, const msgpack::object& obj);
+/* frames from a build with larger blocks can still be read */
+#define MRB_MSGPACK_FRAME_MAX (16 * 1024 * 1024)
 
-static inline void mrb_msgpack_pack_symbol_value_as_raw(mrb_state* mrb,
-                                                        mrb_value self,
-                                                        int8_t ext_type,
-                                                        msgpack::packer<mrb_msgpack_sbo_writer>& pk);
+enum mrb_msgpack_compression : uint8_t {
+  MRB_MSGPACK_STORED = 0,
+  MRB_MSGPACK_LZ4    = 1,
+  MRB_MSGPACK_ZSTD   = 2,
+};
 
-static mrb_value mrb_msgpack_sym_strategy(mrb_state *mrb, mrb_value self);
+struct mrb_msgpack_frame_header {
+  static constexpr size_t SIZE = 11;
 
-/* ------------------------------------------------------------------------
- * GV-backed registry and context helpers (no Ruby namespace pollution)
- * ------------------------------------------------------------------------ */
+  uint8_t  algorithm;
+  uint32_t raw_size;
+  uint32_t stored_size;
+};
 
-static mrb_value
-ensure_ext_registry(mrb_state *mrb)
+static inline void
+mrb_msgpack_frame_store_u32(char *p, uint32_t n)
 {
-  mrb_value registry = mrb_gv_get(mrb, MRB_SYM(__msgpack_ext_registry__));
-  if (likely(mrb_hash_p(registry))) return registry;
-
-  registry   = mrb_hash_new_capa(mrb, 2);
-  mrb_value packers    = mrb_hash_new_capa(mrb, 16);
-  mrb_value unpackers  = mrb_hash_new_capa(mrb, 16);
+  p[0] = static_cast<char>(n >> 24);
+  p[1] = static_cast<char>(n >> 16);
+  p[2] = static_cast<char>(n >> 8);
+  p[3] = static_cast<char>(n);
+}
 
-  mrb_hash_set(mrb, registry, mrb_symbol_value(MRB_SYM(packers)),   packers);
-  mrb_hash_set(mrb, registry, mrb_symbol_value(MRB_SYM(unpackers)), unpackers);
+static inline uint32_t
+mrb_msgpack_frame_load_u32(const char *p)
+{
+  return (static_cast<uint32_t>(static_cast<uint8_t>(p[0])) << 24) |
+         (static_cast<uint32_t>(static_cast<uint8_t>(p[1])) << 16) |
+         (static_cast<uint32_t>(static_cast<uint8_t>(p[2])) << 8)  |
+          static_cast<uint32_t>(static_cast<uint8_t>(p[3]));
+}
 
-  mrb_gv_set(mrb, MRB_SYM(__msgpack_ext_registry__), registry);
-  return registry;
+static mrb_msgpack_compression
+mrb_msgpack_compression_get(mrb_state *mrb, mrb_value name)
+{
+  if (mrb_symbol_p(name)) {
+    mrb_sym sym = mrb_symbol(name);
+    if (sym == MRB_SYM(lz4)) {
+#ifdef MRB_MSGPACK_USE_LZ4
+      return MRB_MSGPACK_LZ4;
+#else
+      mrb_raise(mrb, E_NOTIMP_ERROR, "msgpack was built without lz4");
+#endif
+    }
+    if (sym == MRB_SYM(zstd)) {
+#ifdef MRB_MSGPACK_USE_ZSTD
+      return MRB_MSGPACK_ZSTD;
+#else
+      mrb_raise(mrb, E_NOTIMP_ERROR, "msgpack was built without zstd");
+#endif
+    }
+  }
+  mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown compression %!v", name);
+  return MRB_MSGPACK_STORED;
 }
 
-static mrb_value
-msgpack_ctx_initialize(mrb_state *mrb, mrb_value self)
+/* compresses len bytes at src into frame, replacing what it held */
+static void
+mrb_msgpack_frame_compress(mrb_state *mrb, mrb_msgpack_compression algorithm,
+                           const char *src, size_t len, std::string &frame)
 {
-  auto ctx = mrb_cpp_new<mrb_msgpack_ctx>(mrb, self);
+  const size_t H = mrb_msgpack_frame_header::SIZE;
+  size_t bound = len;
+#ifdef MRB_MSGPACK_USE_LZ4
+  if (algorithm == MRB_MSGPACK_LZ4) bound = std::max(bound, static_cast<size_t>(LZ4_compressBound(static_cast<int>(len))));
+#endif
+#ifdef MRB_MSGPACK_USE_ZSTD
+  if (algorithm == MRB_MSGPACK_ZSTD) bound = std::max(bound, ZSTD_compressBound(len));
+#endif
+  frame.resize(H + bound);
+
+  size_t stored = 0;
+  switch (algorithm) {
+#ifdef MRB_MSGPACK_USE_LZ4
+    case MRB_MSGPACK_LZ4: {
+      int n = LZ4_compress_default(src, &frame[H], static_cast<int>(len), static_cast<int>(bound));
+      if (unlikely(n <= 0)) mrb_raise(mrb, E_MSGPACK_ERROR, "lz4 compression failed");
+      stored = static_cast<size_t>(n);
+    } break;
+#endif
+#ifdef MRB_MSGPACK_USE_ZSTD
+    case MRB_MSGPACK_ZSTD: {
+      size_t n = ZSTD_compress(&frame[H], bound, src, len, MRB_MSGPACK_ZSTD_LEVEL);
+      if (unlikely(ZSTD_isError(n))) {
+        mrb_raisef(mrb, E_MSGPACK_ERROR, "zstd compression failed: %S", mrb_str_new_cstr(mrb, ZSTD_getErrorName(n)));
+      }
+      stored = n;
+    } break;
+#endif
+    default:
+      break;
+  }
 
-  ctx->sym_packer   = mrb_msgpack_pack_symbol_value_as_raw;
-  ctx->sym_unpacker = nullptr;
-  ctx->ext_type     = (int8_t)MRB_MSGPACK_DEFAULT_SYMBOL_TYPE;
+  if (stored == 0 || stored >= len) {
+    algorithm = MRB_MSGPACK_STORED;
+    std::memcpy(&frame[H], src, len);
+    stored = len;
+  }
 
-  return self;
+  frame[0] = 'M';
+  frame[1] = 'Z';
+  frame[2] = static_cast<char>(algorithm);
+  mrb_msgpack_frame_store_u32(&frame[3], static_cast<uint32_t>(len));
+  mrb_msgpack_frame_store_u32(&frame[7], static_cast<uint32_t>(stored));
+  frame.resize(H + stored);
 }
 
-
-static mrb_value
-ensure_msgpack_ctx(mrb_state *mrb)
+/* Reads the header of the frame at the start of p, returns false as long
+ * as the frame isn't complete. */
+static bool
+mrb_msgpack_frame_header_at(mrb_state *mrb, const char *p, size_t len, mrb_msgpack_frame_header &h)
 {
-  mrb_value ctxv = mrb_gv_get(mrb, MRB_SYM(__msgpack__ctx));
-  if (likely(mrb_data_p(ctxv))) return ctxv;
-
-  struct RClass *ctx_class =
-      mrb_define_class_under_id(mrb, mrb_module_get_id(mrb, MRB_SYM(MessagePack)), MRB_SYM(__CTX), mrb->object_class);
+  if (len < 2) return false;
+  if (unlikely(p[0] != 'M' || p[1] != 'Z')) {
+    mrb_raise(mrb, E_MSGPACK_ERROR, "Can't unpack: not a compressed frame");
+  }
+  if (len < mrb_msgpack_frame_header::SIZE) return false;
 
-  MRB_SET_INSTANCE_TT(ctx_class, MRB_TT_DATA);
+  h.algorithm   = static_cast<uint8_t>(p[2]);
+  h.raw_size    = mrb_msgpack_frame_load_u32(p + 3);
+  h.stored_size = mrb_msgpack_frame_load_u32(p + 7);
 
-  mrb_define_method_id(
-      mrb, ctx_class, MRB_SYM(initialize),
-      msgpack_ctx_initialize,
-      MRB_ARGS_NONE());
-  mrb_value ctx_obj = mrb_obj_new(mrb, ctx_class, 0, NULL);
-  mrb_gv_set(mrb, MRB_SYM(__msgpack__ctx), ctx_obj);
+  if (unlikely(h.algorithm > MRB_MSGPACK_ZSTD)) {
+    mrb_raise(mrb, E_MSGPACK_ERROR, "Can't unpack: unknown frame compression");
+  }
+  if (unlikely(h.raw_size > MRB_MSGPACK_FRAME_MAX || h.stored_size > MRB_MSGPACK_FRAME_MAX ||
+               (h.algorithm == MRB_MSGPACK_STORED && h.stored_size != h.raw_size))) {
+    mrb_raise(mrb, E_MSGPACK_ERROR, "Can't unpack: invalid frame size");
+  }
 
-  return ctx_obj;
+  return len - mrb_msgpack_frame_header::SIZE >= h.stored_size;
 }
 
-static mrb_value
-ext_packers_hash(mrb_state *mrb)
+/* writes the h.raw_size bytes of the frame whose data starts at src to dst */
+static void
+mrb_msgpack_frame_decompress(mrb_state *mrb, const mrb_msgpack_frame_header &h, const char *src, char *dst)
 {
-  mrb_value registry = ensure_ext_registry(mrb);
-  mrb_value packers = mrb_hash_get(mrb, registry, mrb_symbol_value(MRB_SYM(packers)));
-  if (likely(mrb_hash_p(packers))) {
-    return packers;
-  } else {
-    mrb_raise(mrb, E_RUNTIME_ERROR, "ext packers is not a hash");
+  switch (h.algorithm) {
+    case MRB_MSGPACK_STORED:
+      std::memcpy(dst, src, h.raw_size);
+      return;
+    case MRB_MSGPACK_LZ4: {
+#ifdef MRB_MSGPACK_USE_LZ4
+      int n = LZ4_decompress_safe(src, dst, static_cast<int>(h.stored_size), static_cast<int>(h.raw_size));
+      if (unlikely(n < 0 || static_cast<uint32_t>(n) != h.raw_size)) {
+        mrb_raise(mrb, E_MSGPACK_ERROR, "Can't unpack: corrupt lz4 frame");
+      }
+      return;
+#else
+      mrb_raise(mrb, E_NOTIMP_ERROR, "msgpack was built without lz4");
+#endif
+    }
+    case MRB_MSGPACK_ZSTD: {
+#ifdef MRB_MSGPACK_USE_ZSTD
+      size_t n = ZSTD_decompress(dst, h.raw_size, src, h.stored_size);
+      if (unlikely(ZSTD_isError(n) || n != h.raw_size)) {
+        mrb_raise(mrb, E_MSGPACK_ERROR, "Can't unpack: corrupt zstd frame");
+      }
+      return;
+#else
+      mrb_raise(mrb, E_NOTIMP_ERROR, "msgpack was built without zstd");
+#endif
+    }
   }
 }
 
-static mrb_value
-ext_unpackers_hash(mrb_state *mrb)
-{
-  mrb_value registry = ensure_ext_registry(mrb);
-  mrb_value unpackers = mrb_hash_get(mrb, registry, mrb_symbol_value(MRB_SYM(unpackers)));
-  if (likely(mrb_hash_p(unpackers))) {
-    return unpackers;
-  } else {
-    mrb_raise(mrb, E_RUNTIME_ERROR, "ext unpackers is not a hash");
+/* Collects the writer's output into a block and hands every full block as
+ * a frame to the next sink, so no more than one block is held uncompressed. */
+struct mrb_msgpack_compress_sink : mrb_msgpack_sink {
+  mrb_msgpack_compress_sink(mrb_state* mrb, mrb_msgpack_compression algorithm, mrb_msgpack_sink* out)
+    : mrb(mrb), algorithm(algorithm), out(out) {
+    block.reserve(MRB_MSGPACK_FRAME_BLOCK);
   }
-}
 
-MRB_BEGIN_DECL
-MRB_API void
-mrb_msgpack_ensure(mrb_state *mrb)
-{
-  struct RClass *msgpack_mod = mrb_define_module_id(mrb, MRB_SYM(MessagePack));
+  void write(const char* p, size_t n) override {
+    while (n > 0) {
+      if (block.empty() && n >= MRB_MSGPACK_FRAME_BLOCK) {
+        /* a whole block is at hand, compress it from where it is */
+        emit(p, MRB_MSGPACK_FRAME_BLOCK);
+        p += MRB_MSGPACK_FRAME_BLOCK;
+        n -= MRB_MSGPACK_FRAME_BLOCK;
+        continue;
+      }
+      size_t take = std::min(n, MRB_MSGPACK_FRAME_BLOCK - block.size());
+      block.append(p, take);
+      p += take;
+      n -= take;
+      if (block.size() == MRB_MSGPACK_FRAME_BLOCK) finish();
+    }
+  }
 
-  mrb_define_class_under_id(mrb, msgpack_mod, MRB_SYM(Error), E_RUNTIME_ERROR);
-  ensure_ext_registry(mrb);
-  ensure_msgpack_ctx(mrb);
-}
+  /* turns what is buffered into a frame, even when the block isn't full */
+  void finish() {
+    if (block.empty()) return;
+    emit(block.data(), block.size());
+    block.clear();
+  }
 
-MRB_API void
-mrb_msgpack_register_pack_type_value(mrb_state *mrb, int8_t type, mrb_value klass, mrb_value proc)
-{
-  if (unlikely(type < 0)) mrb_raise(mrb, E_RANGE_ERROR, "ext type must bet between 0 and 127");
-  if (unlikely(mrb_type(proc) != MRB_TT_PROC)) mrb_raise(mrb, E_TYPE_ERROR, "packer must be a Proc");
+  mrb_state* mrb;
+  mrb_msgpack_compression algorithm;
+  mrb_msgpack_sink* out;
+  std::string block;
+  std::string frame;
 
-  mrb_value packers = ext_packers_hash(mrb);
-  mrb_value cfg = mrb_hash_new_capa(mrb, 2);
-  mrb_hash_set(mrb, cfg, mrb_symbol_value(MRB_SYM(type)),   mrb_fixnum_value(type));
-  mrb_hash_set(mrb, cfg, mrb_symbol_value(MRB_SYM(packer)), proc);
-  mrb_hash_set(mrb, packers, klass, cfg);
-}
+private:
+  void emit(const char* p, size_t n) {
+    mrb_msgpack_frame_compress(mrb, algorithm, p, n, frame);
+    out->write(frame.data(), frame.size());
+  }
+};
 
-MRB_API void
-mrb_msgpack_register_unpack_type_value(mrb_state *mrb, int8_t type, mrb_value proc)
-{
-  if (unlikely(type < 0)) mrb_raise(mrb, E_RANGE_ERROR, "ext type must bet between 0 and 127");
-  if (unlikely(mrb_type(proc) != MRB_TT_PROC)) mrb_raise(mrb, E_TYPE_ERROR, "unpacker must be a Proc");
+/* ------------------------------------------------------------------------
+ * Forward declarations
+ * ------------------------------------------------------------------------ */
 
-  mrb_value unpackers = ext_unpackers_hash(mrb);
-  mrb_hash_set(mrb, unpackers, mrb_fixnum_value(type), proc);
-}
+/* Open addressing table keyed by class pointer. Whoever fills it must keep
+ * the classes alive, a collected class could hand its address to a new one. */
+template <typename V>
+struct mrb_msgpack_class_table {
+  static constexpr size_t MAX_ENTRIES = 4096;
 
-MRB_API void
-mrb_msgpack_register_pack_type_cfunc(mrb_state *mrb,
-                                     int8_t type,
-                                     struct RClass *klass,
-                                     mrb_func_t cfunc,
-                                     mrb_int argc,
-                                     const mrb_value *argv)
-{
-  if (unlikely(klass == NULL)) mrb_raise(mrb, E_ARGUMENT_ERROR, "klass is NULL");
-  if (unlikely(cfunc == NULL)) mrb_raise(mrb, E_ARGUMENT_ERROR, "pack callback cannot be NULL");
+  struct slot {
+    struct RClass *klass;
+    V value;
+  };
 
-  struct RProc *rproc =
-      mrb_proc_new_cfunc_with_env(mrb, cfunc, argc, argv);
+  std::vector<slot> slots;
+  size_t count = 0;
 
-  mrb_value proc = mrb_obj_value(rproc);
+  static size_t hash(struct RClass *klass) {
+    return static_cast<size_t>((reinterpret_cast<uintptr_t>(klass) >> 4) * 0x9E3779B97F4A7C15ULL);
+  }
 
-  mrb_msgpack_register_pack_type_value(mrb, type, mrb_obj_value(klass), proc);
-}
+  V* find(struct RClass *klass) {
+    if (count == 0) return nullptr;
+    size_t mask = slots.size() - 1;
+    for (size_t i = hash(klass) & mask;; i = (i + 1) & mask) {
+      if (slots[i].klass == klass) return &slots[i].value;
+      if (slots[i].klass == nullptr) return nullptr;
+    }
+  }
 
-MRB_API void
-mrb_msgpack_register_unpack_type_cfunc(mrb_state *mrb,
-                                       int8_t type,
-                                       mrb_func_t cfunc,
-                                       mrb_int argc,
-                                       const mrb_value *argv)
-{
-  if (unlikely(cfunc == NULL)) mrb_raise(mrb, E_ARGUMENT_ERROR, "unpack callback cannot be NULL");
+  /* returns false when the table is full, callers clear it and retry */
+  bool insert(struct RClass *klass, const V& value) {
+    if (count >= MAX_ENTRIES) return false;
+    if ((count + 1) * 2 > slots.size()) grow();
+
+    size_t mask = slots.size() - 1;
+    size_t i = hash(klass) & mask;
+    while (slots[i].klass != nullptr && slots[i].klass != klass) i = (i + 1) & mask;
+    if (slots[i].klass == nullptr) ++count;
+    slots[i].klass = klass;
+    slots[i].value = value;
+    return true;
+  }
 
-  struct RProc *rproc =
-      mrb_proc_new_cfunc_with_env(mrb, cfunc, argc, argv);
+  void clear() {
+    slots.clear();
+    count = 0;
+  }
 
-  mrb_value proc = mrb_obj_value(rproc);
+private:
+  void grow() {
+    std::vector<slot> old;
+    old.swap(slots);
+    slots.assign(old.empty() ? 64 : old.size() * 2, slot{nullptr, V()});
+    count = 0;
+    for (const slot& s : old) {
+      if (s.klass) insert(s.klass, s.value);
+    }
+  }
+};
 
-  mrb_msgpack_register_unpack_type_value(mrb, type, proc);
+/* Fingerprint of a class's ancestor chain. Including or prepending a module
+ * links a new iclass into it, so a cached lookup made for another chain is
+ * noticed without hooking into the class hierarchy. */
+static inline uint64_t
+mrb_msgpack_ancestry(struct RClass *klass)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (struct RClass *c = klass; c; c = c->super) {
+    h = (h ^ static_cast<uint64_t>(reinterpret_cast<uintptr_t>(c))) * 0x100000001b3ULL;
+  }
+  return h;
 }
 
-MRB_END_DECL
-/* ------------------------------------------------------------------------
- * Primitive packers
- * ------------------------------------------------------------------------ */
+/* a class's resolved ext packer, index into ext_packers or -1 for none */
+struct mrb_msgpack_ext_cache_entry {
+  int32_t index;
+  uint64_t ancestry; /* the chain it was resolved for */
+};
 
-#define pack_integer_helper_(x, pk, self) pk.pack_int##x(static_cast<int##x##_t>(mrb_integer(self)))
-#define pack_integer_helper(x, pk, self)  pack_integer_helper_(x, pk, self)
-#define mrb_msgpack_pack_int(pk, self)    pack_integer_helper(MRB_INT_BIT, pk, self)
+/* a class's resolved conversion method, see mrb_msgpack_find_conversion */
+struct mrb_msgpack_conversion_cache_entry {
+  uint8_t conversion;
+  uint64_t ancestry; /* the chain it was resolved for */
+};
 
-static inline void
-mrb_msgpack_pack_integer_value(mrb_state *mrb, mrb_value self, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
-{
-  mrb_msgpack_pack_int(pk, self);
-}
+struct mrb_msgpack_ext_packer {
+    struct RClass *klass;
+    struct RProc *proc;
+    int8_t type;
+};
 
-#ifndef MRB_WITHOUT_FLOAT
-static inline void
-mrb_msgpack_pack_float_value(mrb_state *mrb, mrb_value self, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
-{
-#ifdef MRB_USE_FLOAT
-  pk.pack_float(mrb_float(self));
-#else
-  pk.pack_double(mrb_float(self));
-#endif
-}
-#endif
+#define MRB_MSGPACK_EXT_TYPES 128
+
+/* Direct mapped cache from short map keys to their Symbol, so a key seen
+ * before skips mrb_intern's hashing. mruby never frees symbols, entries
+ * stay valid for the lifetime of the mrb_state. */
+struct mrb_msgpack_sym_cache {
+  static constexpr size_t SLOTS   = 256;
+  static constexpr size_t MAX_KEY = 23;
+
+  struct entry {
+    mrb_sym sym;
+    uint32_t hash;
+    uint8_t len;
+    char bytes[MAX_KEY];
+  };
+  entry slots[SLOTS] = {};
+
+  mrb_sym intern(mrb_state *mrb, const char *ptr, size_t len) {
+    if (len > MAX_KEY) return mrb_intern(mrb, ptr, len);
+
+    uint32_t h = 2166136261u; /* FNV-1a */
+    for (size_t i = 0; i < len; ++i) {
+      h ^= static_cast<uint8_t>(ptr[i]);
+      h *= 16777619u;
+    }
 
-static inline void
-mrb_msgpack_pack_string_value(mrb_state *mrb, mrb_value self, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
-{
-  const char* ptr = RSTRING_PTR(self);
-  mrb_int len = RSTRING_LEN(self);
+    entry &e = slots[(h ^ (h >> 16)) & (SLOTS - 1)];
+    if (e.sym && e.hash == h && e.len == len && std::memcmp(e.bytes, ptr, len) == 0) {
+      return e.sym;
+    }
 
-  if (mrb_str_is_utf8(self)) {
-    pk.pack_str(static_cast<uint32_t>(len));
-    pk.pack_str_body(ptr, static_cast<size_t>(len));
-  } else {
-    pk.pack_bin(static_cast<uint32_t>(len));
-    pk.pack_bin_body(ptr, static_cast<size_t>(len));
+    mrb_sym sym = mrb_intern(mrb, ptr, len);
+    e.sym  = sym;
+    e.hash = h;
+    e.len  = static_cast<uint8_t>(len);
+    std::memcpy(e.bytes, ptr, len);
+    return sym;
   }
-}
+};
 
-/* ------------------------------------------------------------------------
- * Symbol packing strategies
- * ------------------------------------------------------------------------ */
+#ifndef MRB_MSGPACK_MEMO_BYTES
+# define MRB_MSGPACK_MEMO_BYTES (4 * 1024 * 1024)
+#endif
 
-static inline void
-mrb_msgpack_pack_symbol_value_as_int(mrb_state* mrb, mrb_value self, int8_t ext_type, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
-{
-  mrb_sym sym = mrb_symbol(self);
+/* shorter Strings, map keys among them, are cheaper to pack than to look up */
+#ifndef MRB_MSGPACK_MEMO_MIN_STRING
+# define MRB_MSGPACK_MEMO_MIN_STRING 1024
+#endif
 
-  pk.pack_ext(sizeof(sym), ext_type);
-  pk.pack_ext_body(reinterpret_cast<const char*>(&sym), sizeof(sym));
-}
+/* Packed bytes of frozen Hashes, Arrays and Strings, keyed by identity.
+ * mruby has no weak references, the objects are kept alive by the codec's
+ * memo_roots ivar. To still let go of them, a Data object nobody references
+ * is left behind as a canary: once the GC has swept it, every entry which
+ * wasn't used since then ages, entries idle for MAX_IDLE collections are dropped. */
+struct mrb_msgpack_memo {
+  static constexpr size_t  MAX_ENTRIES = 4096;
+  static constexpr uint8_t MAX_IDLE    = 2;
+  static constexpr size_t  OVERHEAD    = 64; /* charged per entry against max_bytes */
+
+  struct entry {
+    mrb_value object;
+    std::string bytes;
+    bool packable; /* false when something inside isn't frozen */
+    uint8_t idle;
+  };
+
+  std::unordered_map<struct RBasic*, entry> entries;
+  size_t max_bytes;
+  size_t bytes = 0;
+  struct RData *canary = nullptr;
+  bool collected = false; /* set by the canary's free function */
+
+  explicit mrb_msgpack_memo(size_t max_bytes) : max_bytes(max_bytes) {}
+
+  ~mrb_msgpack_memo() {
+    if (canary) canary->data = nullptr;
+  }
+};
 
-static inline void
-mrb_msgpack_pack_symbol_value_as_string(mrb_state* mrb, mrb_value self, int8_t ext_type, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+static void
+mrb_msgpack_memo_canary_free(mrb_state *mrb, void *p)
 {
-  mrb_sym sym = mrb_symbol(self);
+  if (!p) return;
+  auto *memo = static_cast<mrb_msgpack_memo*>(p);
+  memo->canary = nullptr;
+  memo->collected = true;
+}
 
-  mrb_int len;
+static const struct mrb_data_type mrb_msgpack_memo_canary_type = {
+  "MessagePack memo canary", mrb_msgpack_memo_canary_free
+};
+
+/* A class packed straight from its instance variables, see MessagePack.packable */
+struct mrb_msgpack_packable {
+  struct RClass *klass;
+  std::vector<mrb_sym> ivars;
+  std::vector<std::string> names; /* the ivars without their @, the keys of a map */
+  std::string keys;               /* the names packed one after the other */
+  std::vector<size_t> key_ends;
+  bool as_array;
+  int16_t type;                   /* ext type wrapping the fields, -1 for none */
+};
+
+/* Configuration of a MessagePack::Codec, the module level functions use the one
+ * stored in $__msgpack__ctx. The procs and classes referenced here are kept alive
+ * by Arrays in the owner's ext_packers, ext_unpackers, ext_cache_roots and
+ * conversion_roots ivars. */
+struct mrb_msgpack_ctx {
+    struct RData *owner;
+    mrb_msgpack_ctx *root;      /* the global codec, kept alive in the owner's root ivar */
+    uint32_t class_generation;  /* bumped on the root by mrb_msgpack_class_cache_clear */
+    uint32_t cache_generation;  /* root's class_generation when ext_cache was last reset */
+    uint32_t conversion_generation = 0; /* the same for conversions */
+    void (*sym_packer)(mrb_state*, mrb_value, int8_t, msgpack::packer<mrb_msgpack_sbo_writer>&);
+    mrb_value (*sym_unpacker)(mrb_state*, const char*, uint32_t);
+    int8_t ext_type;
+    struct RClass *time_class;
+    struct RProc *ext_unpackers[MRB_MSGPACK_EXT_TYPES] = {};
+    uint32_t ext_unpacker_count = 0;
+    std::vector<mrb_msgpack_ext_packer> ext_packers; /* registration order */
+    /* class -> index into ext_packers, -1 for classes without a packer;
+       seeded with the registered classes, resolved subclasses are added on use */
+    mrb_msgpack_class_table<mrb_msgpack_ext_cache_entry> ext_cache;
+    /* class -> the first conversion method its instances respond to */
+    mrb_msgpack_class_table<mrb_msgpack_conversion_cache_entry> conversions;
+    std::unique_ptr<mrb_msgpack_sym_cache> sym_cache; /* created on first symbolize_keys */
+    std::unique_ptr<mrb_msgpack_memo> memo; /* set with memoize: */
+    /* registrations are never freed, a replaced one may still be in use by a pack in progress */
+    std::vector<std::unique_ptr<mrb_msgpack_packable>> packables;
+    mrb_msgpack_class_table<const mrb_msgpack_packable*> packable_index;
+    const mrb_msgpack_packable *packable_types[MRB_MSGPACK_EXT_TYPES] = {};
+};
+MRB_CPP_DEFINE_TYPE(mrb_msgpack_ctx, mrb_msgpack_ctx);
+
+/* Frozen map key Strings shared by all maps of one unpack call. The Strings
+ * are kept alive by the roots Array, the table points into their bytes, which
+ * stay put because mruby's GC doesn't move objects. */
+struct mrb_msgpack_key_table {
+    static constexpr size_t MAX_KEYS = 4096;
+
+    std::unordered_map<std::string_view, mrb_value> keys;
+    mrb_value roots = mrb_nil_value();
+
+    void init(mrb_state *mrb) {
+      roots = mrb_ary_new(mrb);
+    }
+
+    mrb_value get(mrb_state *mrb, const char *ptr, size_t len) {
+      auto it = keys.find(std::string_view(ptr, len));
+      if (it != keys.end()) return it->second;
+
+      mrb_value str = mrb_str_new(mrb, ptr, len);
+      /* maps keyed by ids would grow this forever, later keys aren't shared */
+      if (unlikely(keys.size() >= MAX_KEYS)) return str;
+
+      mrb_obj_freeze(mrb, str);
+      mrb_ary_push(mrb, roots, str);
+      keys.emplace(std::string_view(RSTRING_PTR(str), RSTRING_LEN(str)), str);
+      return str;
+    }
+};
+
+/* Per call unpack settings, handed down the unpack recursion */
+struct mrb_msgpack_unpack_opts {
+    mrb_msgpack_ctx *ctx;
+    mrb_msgpack_sym_cache *sym_cache; /* set when STR map keys become Symbols */
+    mrb_msgpack_key_table *key_table; /* set when STR map keys are shared */
+    /* zero_copy: STR/BIN of at least zero_copy_min bytes become shared
+       substrings of src_str instead of copies */
+    const char *src = nullptr;
+    size_t src_len = 0;
+    size_t zero_copy_min = 0;
+    mrb_value src_str = mrb_nil_value();
+    unsigned threads = 0; /* native threads parsing the documents of a block unpack */
+};
+
+#ifndef MRB_MSGPACK_ZERO_COPY_MIN
+# define MRB_MSGPACK_ZERO_COPY_MIN 4096
+#endif
+
+/* default symbol strategy type (used by ctx) */
+#ifndef MRB_MSGPACK_DEFAULT_SYMBOL_TYPE
+#define MRB_MSGPACK_DEFAULT_SYMBOL_TYPE 0
+#endif
+
+#define MRB_MSGPACK_CONTEXT(mrb) (mrb_cpp_get<mrb_msgpack_ctx>(mrb, mrb_gv_get(mrb, MRB_SYM(__msgpack__ctx))))
+
+
+static void mrb_msgpack_pack_value(mrb_state* mrb, mrb_msgpack_ctx* ctx, mrb_value self, msgpack::packer<mrb_msgpack_sbo_writer>& pk);
+static void mrb_msgpack_pack_array_value(mrb_state* mrb, mrb_msgpack_ctx* ctx, mrb_value self, msgpack::packer<mrb_msgpack_sbo_writer>& pk);
+static void mrb_msgpack_pack_hash_value(mrb_state* mrb, mrb_msgpack_ctx* ctx, mrb_value self, msgpack::packer<mrb_msgpack_sbo_writer>& pk);
+static mrb_value mrb_msgpack_pack_compressed(mrb_state *mrb, mrb_msgpack_ctx *ctx, mrb_value object, mrb_msgpack_compression algorithm);
+static bool mrb_msgpack_pack_packable(mrb_state* mrb, mrb_msgpack_ctx* ctx, mrb_value obj, msgpack::packer<mrb_msgpack_sbo_writer>& pk);
+static mrb_value mrb_msgpack_unpack_packable(mrb_state *mrb, mrb_msgpack_ctx *ctx, const mrb_msgpack_packable *p, const char *body, uint32_t size);
+static void mrb_msgpack_ctx_set_packable(mrb_state *mrb, mrb_msgpack_ctx *ctx, std::unique_ptr<mrb_msgpack_packable> p);
+
+static mrb_value mrb_unpack_msgpack_obj(mrb_state* mrb, const mrb_msgpack_unpack_opts& opts, const msgpack::object& obj);
+static mrb_value mrb_unpack_msgpack_obj_array(mrb_state* mrb, const mrb_msgpack_unpack_opts& opts, const msgpack::object& obj);
+static mrb_value mrb_unpack_msgpack_obj_map(mrb_state* mrb, const mrb_msgpack_unpack_opts& opts, const msgpack::object& obj);
+static const char* mrb_msgpack_raw_skip(const char *buf, size_t len, size_t &off);
+static mrb_value mrb_msgpack_decode_at(mrb_state *mrb, const mrb_msgpack_unpack_opts& opts, const char *buf, size_t len, size_t off);
+
+static inline void mrb_msgpack_pack_symbol_value_as_raw(mrb_state* mrb,
+                                                        mrb_value self,
+                                                        int8_t ext_type,
+                                                        msgpack::packer<mrb_msgpack_sbo_writer>& pk);
+
+static mrb_value mrb_msgpack_sym_strategy(mrb_state *mrb, mrb_value self);
+static void mrb_msgpack_ctx_set_symbol_strategy(mrb_state *mrb, mrb_msgpack_ctx *ctx, mrb_sym which, mrb_int ext_type);
+static void mrb_msgpack_ctx_set_memo(mrb_state *mrb, mrb_msgpack_ctx *ctx, mrb_value memoize);
+
+/* ------------------------------------------------------------------------
+ * Codecs: the GV-backed default one and MessagePack::Codec instances,
+ * each with its own native ext registry (no Ruby namespace pollution)
+ * ------------------------------------------------------------------------ */
+
+static mrb_msgpack_ctx*
+mrb_msgpack_codec_get(mrb_state *mrb, mrb_value self)
+{
+  auto ctx = mrb_cpp_get<mrb_msgpack_ctx>(mrb, self);
+  if (unlikely(!ctx)) {
+    mrb_raise(mrb, E_MSGPACK_ERROR, "Codec is not initialized");
+  }
+  return ctx;
+}
+
+static void
+mrb_msgpack_ext_cache_reset(mrb_state *mrb, mrb_msgpack_ctx *ctx)
+{
+  ctx->ext_cache.clear();
+  for (size_t i = 0; i < ctx->ext_packers.size(); ++i) {
+    struct RClass *klass = ctx->ext_packers[i].klass;
+    ctx->ext_cache.insert(klass, mrb_msgpack_ext_cache_entry{ static_cast<int32_t>(i), mrb_msgpack_ancestry(klass) });
+  }
+  ctx->cache_generation = ctx->root->class_generation;
+  mrb_iv_set(mrb, mrb_obj_value(ctx->owner), MRB_SYM(ext_cache_roots), mrb_nil_value());
+}
+
+static void
+mrb_msgpack_ext_cache_store(mrb_state *mrb, mrb_msgpack_ctx *ctx, struct RClass *klass, int32_t index, uint64_t ancestry)
+{
+  bool refresh = ctx->ext_cache.find(klass) != nullptr; /* already rooted */
+  if (unlikely(!ctx->ext_cache.insert(klass, mrb_msgpack_ext_cache_entry{ index, ancestry }))) {
+    mrb_msgpack_ext_cache_reset(mrb, ctx);
+    ctx->ext_cache.insert(klass, mrb_msgpack_ext_cache_entry{ index, ancestry });
+    refresh = false;
+  }
+  if (refresh) return;
+
+  mrb_value self = mrb_obj_value(ctx->owner);
+  mrb_value roots = mrb_iv_get(mrb, self, MRB_SYM(ext_cache_roots));
+  if (!mrb_array_p(roots)) {
+    roots = mrb_ary_new(mrb);
+    mrb_iv_set(mrb, self, MRB_SYM(ext_cache_roots), roots);
+  }
+  mrb_ary_push(mrb, roots, mrb_obj_value(klass));
+}
+
+static void
+mrb_msgpack_ctx_set_packer(mrb_state *mrb, mrb_msgpack_ctx *ctx, int8_t type, struct RClass *klass, struct RProc *proc)
+{
+  mrb_value roots = mrb_iv_get(mrb, mrb_obj_value(ctx->owner), MRB_SYM(ext_packers));
+
+  size_t i = 0;
+  while (i < ctx->ext_packers.size() && ctx->ext_packers[i].klass != klass) ++i;
+  if (i == ctx->ext_packers.size()) {
+    ctx->ext_packers.push_back(mrb_msgpack_ext_packer{ klass, proc, type });
+  } else {
+    ctx->ext_packers[i].proc = proc;
+    ctx->ext_packers[i].type = type;
+  }
+
+  mrb_ary_set(mrb, roots, (mrb_int)(2 * i),     mrb_obj_value(klass));
+  mrb_ary_set(mrb, roots, (mrb_int)(2 * i + 1), mrb_obj_value(proc));
+
+  mrb_msgpack_ext_cache_reset(mrb, ctx);
+}
+
+static void
+mrb_msgpack_ctx_set_unpacker(mrb_state *mrb, mrb_msgpack_ctx *ctx, int8_t type, struct RProc *proc)
+{
+  mrb_ary_set(mrb, mrb_iv_get(mrb, mrb_obj_value(ctx->owner), MRB_SYM(ext_unpackers)), type, mrb_obj_value(proc));
+  if (!ctx->ext_unpackers[type]) ctx->ext_unpacker_count++;
+  ctx->ext_unpackers[type] = proc;
+}
+
+static void
+mrb_msgpack_codec_register_pack_type(mrb_state *mrb, mrb_msgpack_ctx *ctx, mrb_int type, mrb_value klass, mrb_value block)
+{
+  if (type < 0 || type > 127) {
+    mrb_raise(mrb, E_RANGE_ERROR, "ext type must bet between 0 and 127");
+  }
+  if (mrb_nil_p(block)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+  }
+  if (mrb_type(block) != MRB_TT_PROC) {
+    mrb_raise(mrb, E_TYPE_ERROR, "not a block");
+  }
+  if (unlikely(!mrb_class_p(klass) && mrb_type(klass) != MRB_TT_MODULE)) {
+    mrb_raise(mrb, E_TYPE_ERROR, "klass must be a Class or Module");
+  }
+
+  if (mrb_class_ptr(klass) == mrb->symbol_class) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR,
+              "cannot register ext packer for Symbols, use the new MessagePack.sym_strategy function.");
+  }
+
+  if (mrb_class_ptr(klass) == ctx->time_class) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "cannot register ext packer for Time, timestamp ext (-1) is reserved");
+  }
+
+  mrb_msgpack_ctx_set_packer(mrb, ctx, (int8_t)type, mrb_class_ptr(klass), mrb_proc_ptr(block));
+}
+
+static void
+mrb_msgpack_codec_register_unpack_type(mrb_state *mrb, mrb_msgpack_ctx *ctx, mrb_int type, mrb_value block)
+{
+  if (type < 0 || type > 127) {
+    mrb_raise(mrb, E_RANGE_ERROR, "ext type must bet between 0 and 127");
+  }
+  if (mrb_nil_p(block)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+  }
+  if (mrb_type(block) != MRB_TT_PROC) {
+    mrb_raise(mrb, E_TYPE_ERROR, "not a block");
+  }
+
+  // If the user is using an ext-based symbol strategy,
+  // forbid overriding the symbol ext type.
+  if (ctx->sym_unpacker != nullptr && type == ctx->ext_type) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR,
+      "cannot register ext unpacker for Symbols, use MessagePack.sym_strategy instead.");
+  }
+
+  if (ctx->packable_types[type]) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "ext type %d is used by MessagePack.packable", (int)type);
+  }
+
+  // Otherwise: safe to register
+  mrb_msgpack_ctx_set_unpacker(mrb, ctx, (int8_t)type, mrb_proc_ptr(block));
+}
+
+/* ext_types: { type => { class: Klass, pack: proc, unpack: proc } }, either proc may be left out */
+static void
+mrb_msgpack_codec_register_ext_types(mrb_state *mrb, mrb_msgpack_ctx *ctx, mrb_value ext_types)
+{
+  ext_types = mrb_ensure_hash_type(mrb, ext_types);
+  mrb_value types = mrb_hash_keys(mrb, ext_types);
+
+  for (mrb_int i = 0; i < RARRAY_LEN(types); ++i) {
+    mrb_value type = RARRAY_PTR(types)[i];
+    mrb_value cfg  = mrb_ensure_hash_type(mrb, mrb_hash_get(mrb, ext_types, type));
+    mrb_value pack   = mrb_hash_get(mrb, cfg, mrb_symbol_value(MRB_SYM(pack)));
+    mrb_value unpack = mrb_hash_get(mrb, cfg, mrb_symbol_value(MRB_SYM(unpack)));
+
+    if (!mrb_nil_p(pack)) {
+      mrb_msgpack_codec_register_pack_type(mrb, ctx, mrb_as_int(mrb, type),
+                                           mrb_hash_get(mrb, cfg, mrb_symbol_value(MRB_SYM(class))), pack);
+    }
+    if (!mrb_nil_p(unpack)) {
+      mrb_msgpack_codec_register_unpack_type(mrb, ctx, mrb_as_int(mrb, type), unpack);
+    }
+  }
+}
+
+static mrb_value
+msgpack_ctx_initialize(mrb_state *mrb, mrb_value self)
+{
+  mrb_sym kw_names[] = { MRB_SYM(sym_strategy), MRB_SYM(ext_types), MRB_SYM(memoize) };
+  mrb_value kw_values[3];
+  mrb_kwargs kwargs = { 3, 0, kw_names, kw_values, NULL };
+  mrb_get_args(mrb, ":", &kwargs);
+
+  auto ctx = mrb_cpp_new<mrb_msgpack_ctx>(mrb, self);
+
+  ctx->owner            = RDATA(self);
+  ctx->root             = ctx;
+  ctx->class_generation = 0;
+  ctx->cache_generation = 0;
+  ctx->sym_packer       = mrb_msgpack_pack_symbol_value_as_raw;
+  ctx->sym_unpacker     = nullptr;
+  ctx->ext_type         = (int8_t)MRB_MSGPACK_DEFAULT_SYMBOL_TYPE;
+  ctx->time_class       = mrb_class_defined_id(mrb, MRB_SYM(Time)) ? mrb_class_get_id(mrb, MRB_SYM(Time)) : nullptr;
+
+  mrb_value unpackers = mrb_ary_new_capa(mrb, MRB_MSGPACK_EXT_TYPES);
+  mrb_ary_set(mrb, unpackers, MRB_MSGPACK_EXT_TYPES - 1, mrb_nil_value());
+  mrb_iv_set(mrb, self, MRB_SYM(ext_unpackers), unpackers);
+  mrb_iv_set(mrb, self, MRB_SYM(ext_packers), mrb_ary_new(mrb));
+  mrb_iv_set(mrb, self, MRB_SYM(packables), mrb_ary_new(mrb));
+
+  /* A new codec starts out with the ext types registered globally at that point */
+  mrb_value rootv = mrb_gv_get(mrb, MRB_SYM(__msgpack__ctx));
+  mrb_msgpack_ctx *root = mrb_data_p(rootv) ? mrb_cpp_get<mrb_msgpack_ctx>(mrb, rootv) : nullptr;
+  if (root && root != ctx) {
+    ctx->root = root;
+    mrb_iv_set(mrb, self, MRB_SYM(root), rootv);
+
+    for (const auto& ext : root->ext_packers) {
+      mrb_msgpack_ctx_set_packer(mrb, ctx, ext.type, ext.klass, ext.proc);
+    }
+    for (int type = 0; type < MRB_MSGPACK_EXT_TYPES; ++type) {
+      if (root->ext_unpackers[type]) mrb_msgpack_ctx_set_unpacker(mrb, ctx, (int8_t)type, root->ext_unpackers[type]);
+    }
+    /* in registration order, so replacements end up the same */
+    for (const auto& p : root->packables) {
+      mrb_msgpack_ctx_set_packable(mrb, ctx, std::unique_ptr<mrb_msgpack_packable>(new mrb_msgpack_packable(*p)));
+    }
+  }
+  mrb_msgpack_ext_cache_reset(mrb, ctx);
+
+  if (!mrb_undef_p(kw_values[0])) {
+    mrb_value strategy = kw_values[0];
+    if (mrb_array_p(strategy) && RARRAY_LEN(strategy) == 2) {
+      mrb_msgpack_ctx_set_symbol_strategy(mrb, ctx,
+                                          mrb_obj_to_sym(mrb, RARRAY_PTR(strategy)[0]),
+                                          mrb_as_int(mrb, RARRAY_PTR(strategy)[1]));
+    } else {
+      mrb_msgpack_ctx_set_symbol_strategy(mrb, ctx, mrb_obj_to_sym(mrb, strategy), 0);
+    }
+  }
+  if (!mrb_undef_p(kw_values[1]) && !mrb_nil_p(kw_values[1])) {
+    mrb_msgpack_codec_register_ext_types(mrb, ctx, kw_values[1]);
+  }
+  if (!mrb_undef_p(kw_values[2])) {
+    mrb_msgpack_ctx_set_memo(mrb, ctx, kw_values[2]);
+  }
+
+  return self;
+}
+
+
+static mrb_value
+ensure_msgpack_ctx(mrb_state *mrb)
+{
+  mrb_value ctxv = mrb_gv_get(mrb, MRB_SYM(__msgpack__ctx));
+  if (likely(mrb_data_p(ctxv))) return ctxv;
+
+  struct RClass *codec_class =
+      mrb_define_class_under_id(mrb, mrb_define_module_id(mrb, MRB_SYM(MessagePack)), MRB_SYM(Codec), mrb->object_class);
+
+  MRB_SET_INSTANCE_TT(codec_class, MRB_TT_DATA);
+
+  mrb_define_method_id(
+      mrb, codec_class, MRB_SYM(initialize),
+      msgpack_ctx_initialize,
+      MRB_ARGS_KEY(3, 0));
+  mrb_value ctx_obj = mrb_obj_new(mrb, codec_class, 0, NULL);
+  mrb_gv_set(mrb, MRB_SYM(__msgpack__ctx), ctx_obj);
+
+  return ctx_obj;
+}
+
+MRB_BEGIN_DECL
+MRB_API void
+mrb_msgpack_ensure(mrb_state *mrb)
+{
+  struct RClass *msgpack_mod = mrb_define_module_id(mrb, MRB_SYM(MessagePack));
+
+  mrb_define_class_under_id(mrb, msgpack_mod, MRB_SYM(Error), E_RUNTIME_ERROR);
+  ensure_msgpack_ctx(mrb);
+}
+
+/* Every codec drops its per class caches on its next lookup. Changes to a
+ * class's ancestors and methods defined from Ruby are noticed on their own,
+ * this is for methods defined from C. */
+MRB_API void
+mrb_msgpack_class_cache_clear(mrb_state *mrb)
+{
+  mrb_value ctxv = mrb_gv_get(mrb, MRB_SYM(__msgpack__ctx));
+  if (unlikely(!mrb_data_p(ctxv))) return;
+
+  mrb_msgpack_codec_get(mrb, ctxv)->class_generation++;
+}
+
+MRB_API void
+mrb_msgpack_register_pack_type_value(mrb_state *mrb, int8_t type, mrb_value klass, mrb_value proc)
+{
+  if (unlikely(type < 0)) mrb_raise(mrb, E_RANGE_ERROR, "ext type must bet between 0 and 127");
+  if (unlikely(mrb_type(proc) != MRB_TT_PROC)) mrb_raise(mrb, E_TYPE_ERROR, "packer must be a Proc");
+  if (unlikely(!mrb_class_p(klass) && mrb_type(klass) != MRB_TT_MODULE)) mrb_raise(mrb, E_TYPE_ERROR, "klass must be a Class or Module");
+
+  mrb_msgpack_ctx_set_packer(mrb, mrb_msgpack_codec_get(mrb, ensure_msgpack_ctx(mrb)), type, mrb_class_ptr(klass), mrb_proc_ptr(proc));
+}
+
+MRB_API void
+mrb_msgpack_register_unpack_type_value(mrb_state *mrb, int8_t type, mrb_value proc)
+{
+  if (unlikely(type < 0)) mrb_raise(mrb, E_RANGE_ERROR, "ext type must bet between 0 and 127");
+  if (unlikely(mrb_type(proc) != MRB_TT_PROC)) mrb_raise(mrb, E_TYPE_ERROR, "unpacker must be a Proc");
+
+  mrb_msgpack_ctx_set_unpacker(mrb, mrb_msgpack_codec_get(mrb, ensure_msgpack_ctx(mrb)), type, mrb_proc_ptr(proc));
+}
+
+MRB_API void
+mrb_msgpack_register_pack_type_cfunc(mrb_state *mrb,
+                                     int8_t type,
+                                     struct RClass *klass,
+                                     mrb_func_t cfunc,
+                                     mrb_int argc,
+                                     const mrb_value *argv)
+{
+  if (unlikely(klass == NULL)) mrb_raise(mrb, E_ARGUMENT_ERROR, "klass is NULL");
+  if (unlikely(cfunc == NULL)) mrb_raise(mrb, E_ARGUMENT_ERROR, "pack callback cannot be NULL");
+
+  struct RProc *rproc =
+      mrb_proc_new_cfunc_with_env(mrb, cfunc, argc, argv);
+
+  mrb_value proc = mrb_obj_value(rproc);
+
+  mrb_msgpack_register_pack_type_value(mrb, type, mrb_obj_value(klass), proc);
+}
+
+MRB_API void
+mrb_msgpack_register_unpack_type_cfunc(mrb_state *mrb,
+                                       int8_t type,
+                                       mrb_func_t cfunc,
+                                       mrb_int argc,
+                                       const mrb_value *argv)
+{
+  if (unlikely(cfunc == NULL)) mrb_raise(mrb, E_ARGUMENT_ERROR, "unpack callback cannot be NULL");
+
+  struct RProc *rproc =
+      mrb_proc_new_cfunc_with_env(mrb, cfunc, argc, argv);
+
+  mrb_value proc = mrb_obj_value(rproc);
+
+  mrb_msgpack_register_unpack_type_value(mrb, type, proc);
+}
+
+MRB_END_DECL
+/* ------------------------------------------------------------------------
+ * Primitive packers
+ * ------------------------------------------------------------------------ */
+
+#define pack_integer_helper_(x, pk, self) pk.pack_int##x(static_cast<int##x##_t>(mrb_integer(self)))
+#define pack_integer_helper(x, pk, self)  pack_integer_helper_(x, pk, self)
+#define mrb_msgpack_pack_int(pk, self)    pack_integer_helper(MRB_INT_BIT, pk, self)
+
+static inline void
+mrb_msgpack_pack_integer_value(mrb_state *mrb, mrb_value self, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+{
+  mrb_msgpack_pack_int(pk, self);
+}
+
+#ifndef MRB_WITHOUT_FLOAT
+static inline void
+mrb_msgpack_pack_float_value(mrb_state *mrb, mrb_value self, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+{
+#ifdef MRB_USE_FLOAT
+  pk.pack_float(mrb_float(self));
+#else
+  pk.pack_double(mrb_float(self));
+#endif
+}
+#endif
+
+static inline void
+mrb_msgpack_pack_string_value(mrb_state *mrb, mrb_value self, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+{
+  const char* ptr = RSTRING_PTR(self);
+  mrb_int len = RSTRING_LEN(self);
+
+  if (mrb_str_is_utf8(self)) {
+    pk.pack_str(static_cast<uint32_t>(len));
+    pk.pack_str_body(ptr, static_cast<size_t>(len));
+  } else {
+    pk.pack_bin(static_cast<uint32_t>(len));
+    pk.pack_bin_body(ptr, static_cast<size_t>(len));
+  }
+}
+
+/* ------------------------------------------------------------------------
+ * Symbol packing strategies
+ * ------------------------------------------------------------------------ */
+
+static inline void
+mrb_msgpack_pack_symbol_value_as_int(mrb_state* mrb, mrb_value self, int8_t ext_type, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+{
+  mrb_sym sym = mrb_symbol(self);
+
+  pk.pack_ext(sizeof(sym), ext_type);
+  pk.pack_ext_body(reinterpret_cast<const char*>(&sym), sizeof(sym));
+}
+
+static inline void
+mrb_msgpack_pack_symbol_value_as_string(mrb_state* mrb, mrb_value self, int8_t ext_type, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+{
+  mrb_sym sym = mrb_symbol(self);
+
+  mrb_int len;
   const char* name = mrb_sym_name_len(mrb, sym, &len);
 
-  pk.pack_ext(static_cast<uint32_t>(len), ext_type);
-  pk.pack_ext_body(name, static_cast<size_t>(len));
+  pk.pack_ext(static_cast<uint32_t>(len), ext_type);
+  pk.pack_ext_body(name, static_cast<size_t>(len));
+}
+
+static inline void
+mrb_msgpack_pack_symbol_value_as_raw(mrb_state* mrb,
+                                     mrb_value self,
+                                     int8_t /*ext_type unused*/,
+                                     msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+{
+  mrb_sym sym = mrb_symbol(self);
+
+  mrb_int len;
+  const char* name = mrb_sym_name_len(mrb, sym, &len);
+
+  pk.pack_str(static_cast<uint32_t>(len));
+  pk.pack_str_body(name, static_cast<size_t>(len));
+}
+
+/* ------------------------------------------------------------------------
+ * Ext packer config lookup
+ * ------------------------------------------------------------------------ */
+
+static const mrb_msgpack_ext_packer*
+mrb_msgpack_find_ext_packer(mrb_state* mrb, mrb_msgpack_ctx* ctx, mrb_value obj)
+{
+  if (ctx->ext_packers.empty()) return nullptr;
+  if (unlikely(ctx->cache_generation != ctx->root->class_generation)) {
+    mrb_msgpack_ext_cache_reset(mrb, ctx);
+  }
+
+  struct RClass *klass = mrb_obj_class(mrb, obj);
+
+  /* a singleton class can extend modules the real class doesn't have */
+  bool cacheable = (mrb_class(mrb, obj) == klass);
+  uint64_t ancestry = 0;
+  if (likely(cacheable)) {
+    ancestry = mrb_msgpack_ancestry(klass);
+    const mrb_msgpack_ext_cache_entry *cached = ctx->ext_cache.find(klass);
+    if (cached && cached->ancestry == ancestry) {
+      return cached->index < 0 ? nullptr : &ctx->ext_packers[cached->index];
+    }
+  }
+
+  /* An exact registration wins, then a superclass or module match in registration order */
+  int32_t found = -1;
+  for (size_t i = 0; i < ctx->ext_packers.size(); ++i) {
+    if (ctx->ext_packers[i].klass == klass) {
+      found = static_cast<int32_t>(i);
+      break;
+    }
+  }
+  for (size_t i = 0; found < 0 && i < ctx->ext_packers.size(); ++i) {
+    if (mrb_obj_is_kind_of(mrb, obj, ctx->ext_packers[i].klass)) {
+      found = static_cast<int32_t>(i);
+    }
+  }
+
+  /* misses are cached too, most objects reaching here have no ext type */
+  if (likely(cacheable)) {
+    mrb_msgpack_ext_cache_store(mrb, ctx, klass, found, ancestry);
+  }
+
+  return found < 0 ? nullptr : &ctx->ext_packers[found];
+}
+
+static mrb_bool
+mrb_msgpack_pack_ext_value(mrb_state* mrb, mrb_msgpack_ctx* ctx, mrb_value obj, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+{
+  const mrb_msgpack_ext_packer *ext = mrb_msgpack_find_ext_packer(mrb, ctx, obj);
+  if (!ext) return FALSE;
+
+  mrb_int arena_index = mrb_gc_arena_save(mrb);
+  int8_t type = ext->type;
+
+  mrb_value packed = mrb_yield(mrb, mrb_obj_value(ext->proc), obj);
+  if (unlikely(!mrb_string_p(packed))) {
+    mrb_gc_arena_restore(mrb, arena_index);
+    mrb_raise(mrb, E_TYPE_ERROR, "no string returned by ext type packer");
+  }
+
+  const char* body = RSTRING_PTR(packed);
+  mrb_int len = RSTRING_LEN(packed);
+
+  pk.pack_ext(static_cast<uint32_t>(len), type);
+  pk.pack_ext_body(body, static_cast<size_t>(len));
+
+  mrb_gc_arena_restore(mrb, arena_index);
+  return TRUE;
+}
+
+/* ------------------------------------------------------------------------
+ * RawValue: bytes which are packed already
+ * ------------------------------------------------------------------------ */
+
+/* ptr points into the frozen String in the bytes ivar, which keeps it valid */
+struct mrb_msgpack_raw_value {
+  const char *ptr;
+  size_t len;
+};
+
+static const struct mrb_data_type mrb_msgpack_raw_value_type = {
+  "MessagePack::RawValue", mrb_free
+};
+
+/* the bytes have to be exactly one well formed object */
+static void
+mrb_msgpack_raw_value_validate(mrb_state *mrb, const mrb_msgpack_raw_value *raw)
+{
+  size_t off = 0;
+  const char *error = mrb_msgpack_raw_skip(raw->ptr, raw->len, off);
+  if (!error && off != raw->len) error = "extra bytes after the object";
+  if (unlikely(error)) {
+    mrb_raisef(mrb, E_MSGPACK_ERROR, "invalid RawValue: %S", mrb_str_new_cstr(mrb, error));
+  }
+}
+
+static mrb_value
+mrb_msgpack_raw_value_initialize(mrb_state *mrb, mrb_value self)
+{
+  mrb_value packed;
+  mrb_sym kw_names[] = { MRB_SYM(validate) };
+  mrb_value kw_values[1];
+  mrb_kwargs kwargs = { 1, 0, kw_names, kw_values, NULL };
+  mrb_get_args(mrb, "S:", &packed, &kwargs);
+
+  if (unlikely(static_cast<uint64_t>(RSTRING_LEN(packed)) > UINT32_MAX)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "RawValue too large");
+  }
+
+  /* a frozen shared copy, changing the original doesn't change the RawValue */
+  mrb_value bytes = mrb_obj_freeze(mrb, mrb_str_byte_subseq(mrb, packed, 0, RSTRING_LEN(packed)));
+  mrb_iv_set(mrb, self, MRB_SYM(bytes), bytes);
+
+  mrb_free(mrb, DATA_PTR(self));
+  auto *raw = static_cast<mrb_msgpack_raw_value*>(mrb_malloc(mrb, sizeof(mrb_msgpack_raw_value)));
+  raw->ptr = RSTRING_PTR(bytes);
+  raw->len = static_cast<size_t>(RSTRING_LEN(bytes));
+  mrb_data_init(self, raw, &mrb_msgpack_raw_value_type);
+
+  if (!mrb_undef_p(kw_values[0]) && mrb_test(kw_values[0])) {
+    mrb_msgpack_raw_value_validate(mrb, raw);
+  }
+
+  return self;
+}
+
+static mrb_value
+mrb_msgpack_raw_value_to_s(mrb_state *mrb, mrb_value self)
+{
+  return mrb_iv_get(mrb, self, MRB_SYM(bytes));
+}
+
+static mrb_value
+mrb_msgpack_raw_value_bytesize(mrb_state *mrb, mrb_value self)
+{
+  auto *raw = static_cast<mrb_msgpack_raw_value*>(mrb_data_get_ptr(mrb, self, &mrb_msgpack_raw_value_type));
+  return mrb_int_value(mrb, raw ? static_cast<mrb_int>(raw->len) : 0);
+}
+
+MRB_API mrb_value
+mrb_msgpack_raw_value_new(mrb_state *mrb, mrb_value packed, mrb_bool validate)
+{
+  struct RClass *raw_value_class =
+    mrb_class_get_under_id(mrb, mrb_module_get_id(mrb, MRB_SYM(MessagePack)), MRB_SYM(RawValue));
+  mrb_value raw = mrb_obj_new(mrb, raw_value_class, 1, &packed);
+  if (validate) {
+    mrb_msgpack_raw_value_validate(mrb, static_cast<mrb_msgpack_raw_value*>(DATA_PTR(raw)));
+  }
+  return raw;
+}
+
+/* ------------------------------------------------------------------------
+ * Memoized packing of frozen objects
+ * ------------------------------------------------------------------------ */
+
+/* Whether v packs to the same bytes for as long as it lives, freezing is
+ * shallow so everything inside has to be frozen as well. */
+static bool
+mrb_msgpack_memo_sealed_p(mrb_state *mrb, mrb_msgpack_memo *memo, mrb_value v, int depth)
+{
+  switch (mrb_type(v)) {
+    case MRB_TT_FALSE:
+    case MRB_TT_TRUE:
+    case MRB_TT_INTEGER:
+#ifndef MRB_WITHOUT_FLOAT
+    case MRB_TT_FLOAT:
+#endif
+    case MRB_TT_SYMBOL:
+      return true;
+
+    case MRB_TT_STRING:
+      return mrb_frozen_p(mrb_basic_ptr(v));
+
+    case MRB_TT_DATA:
+      return DATA_TYPE(v) == &mrb_msgpack_raw_value_type;
+
+    case MRB_TT_ARRAY:
+    case MRB_TT_HASH:
+      break;
+
+    default:
+      return false;
+  }
+
+  if (!mrb_frozen_p(mrb_basic_ptr(v)) || depth >= MSGPACK_DEPTH_LIMIT) return false;
+
+  auto it = memo->entries.find(mrb_basic_ptr(v));
+  if (it != memo->entries.end()) return it->second.packable;
+
+  if (mrb_array_p(v)) {
+    for (mrb_int i = 0; i < RARRAY_LEN(v); ++i) {
+      if (!mrb_msgpack_memo_sealed_p(mrb, memo, RARRAY_PTR(v)[i], depth + 1)) return false;
+    }
+    return true;
+  }
+
+  struct Ctx {
+    mrb_msgpack_memo *memo;
+    int depth;
+    bool sealed;
+  } c{ memo, depth + 1, true };
+
+  mrb_hash_foreach(mrb, mrb_hash_ptr(v),
+    [](mrb_state* mrb, mrb_value key, mrb_value val, void *p) -> int {
+      Ctx *c = static_cast<Ctx*>(p);
+      c->sealed = mrb_msgpack_memo_sealed_p(mrb, c->memo, key, c->depth) &&
+                  mrb_msgpack_memo_sealed_p(mrb, c->memo, val, c->depth);
+      return c->sealed ? 0 : 1;
+    },
+    &c
+  );
+  return c.sealed;
+}
+
+/* called once the canary is gone, a GC ran since the last look */
+static void
+mrb_msgpack_memo_age(mrb_state *mrb, mrb_msgpack_ctx *ctx)
+{
+  mrb_msgpack_memo *memo = ctx->memo.get();
+
+  for (auto it = memo->entries.begin(); it != memo->entries.end();) {
+    if (++it->second.idle > mrb_msgpack_memo::MAX_IDLE) {
+      memo->bytes -= it->second.bytes.size() + mrb_msgpack_memo::OVERHEAD;
+      it = memo->entries.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  mrb_value roots = mrb_ary_new_capa(mrb, (mrb_int)memo->entries.size());
+  for (const auto& e : memo->entries) mrb_ary_push(mrb, roots, e.second.object);
+  mrb_iv_set(mrb, mrb_obj_value(ctx->owner), MRB_SYM(memo_roots), roots);
+
+  memo->collected = false;
+  memo->canary = mrb_data_object_alloc(mrb, mrb->object_class, memo, &mrb_msgpack_memo_canary_type);
+}
+
+/* Packs a frozen Hash, Array or String from the memo, remembering its bytes on
+ * first sight. Returns false when self has to be packed the usual way. */
+static bool
+mrb_msgpack_memo_pack(mrb_state* mrb, mrb_msgpack_ctx* ctx, mrb_value self, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+{
+  if (!mrb_frozen_p(mrb_basic_ptr(self))) return false;
+
+  mrb_msgpack_memo *memo = ctx->memo.get();
+  if (unlikely(memo->collected)) mrb_msgpack_memo_age(mrb, ctx);
+
+  auto it = memo->entries.find(mrb_basic_ptr(self));
+  if (likely(it != memo->entries.end())) {
+    it->second.idle = 0;
+    if (!it->second.packable) return false;
+    pk.pack_bin_body(it->second.bytes.data(), static_cast<uint32_t>(it->second.bytes.size()));
+    return true;
+  }
+
+  if (memo->entries.size() >= mrb_msgpack_memo::MAX_ENTRIES) return false;
+
+  mrb_msgpack_memo::entry e{ self, std::string(), false, 0 };
+  if (mrb_msgpack_memo_sealed_p(mrb, memo, self, 0)) {
+    /* nested frozen objects end up in the memo on their own while packing this one */
+    mrb_msgpack_sbo_writer writer(mrb);
+    msgpack::packer<mrb_msgpack_sbo_writer> capture(writer);
+    switch (mrb_type(self)) {
+      case MRB_TT_HASH:  mrb_msgpack_pack_hash_value(mrb, ctx, self, capture); break;
+      case MRB_TT_ARRAY: mrb_msgpack_pack_array_value(mrb, ctx, self, capture); break;
+      default:           mrb_msgpack_pack_string_value(mrb, self, capture); break;
+    }
+    mrb_value packed = writer.result();
+    e.bytes.assign(RSTRING_PTR(packed), RSTRING_LEN(packed));
+    e.packable = e.bytes.size() <= UINT32_MAX;
+  }
+
+  if (e.packable) pk.pack_bin_body(e.bytes.data(), static_cast<uint32_t>(e.bytes.size()));
+  const bool packed = e.packable;
+
+  /* what doesn't fit the budget is remembered as not worth it, packing may
+     have aged the memo and filled it up meanwhile */
+  if (memo->bytes + e.bytes.size() + mrb_msgpack_memo::OVERHEAD > memo->max_bytes) {
+    e.bytes = std::string();
+    e.packable = false;
+  }
+  size_t charge = e.bytes.size() + mrb_msgpack_memo::OVERHEAD;
+  if (memo->bytes + charge <= memo->max_bytes && memo->entries.size() < mrb_msgpack_memo::MAX_ENTRIES) {
+    mrb_ary_push(mrb, mrb_iv_get(mrb, mrb_obj_value(ctx->owner), MRB_SYM(memo_roots)), self);
+    memo->bytes += charge;
+    memo->entries.emplace(mrb_basic_ptr(self), std::move(e));
+  }
+
+  return packed;
+}
+
+/* memoize: false/nil turns the memo off, true or a byte budget on */
+static void
+mrb_msgpack_ctx_set_memo(mrb_state *mrb, mrb_msgpack_ctx *ctx, mrb_value memoize)
+{
+  size_t max_bytes = 0;
+  if (mrb_true_p(memoize)) {
+    max_bytes = MRB_MSGPACK_MEMO_BYTES;
+  } else if (mrb_test(memoize)) {
+    mrb_int n = mrb_as_int(mrb, memoize);
+    if (unlikely(n <= 0)) mrb_raise(mrb, E_ARGUMENT_ERROR, "memoize budget must be positive");
+    max_bytes = static_cast<size_t>(n);
+  }
+
+  ctx->memo.reset();
+  mrb_iv_set(mrb, mrb_obj_value(ctx->owner), MRB_SYM(memo_roots), mrb_nil_value());
+  if (max_bytes == 0) return;
+
+  ctx->memo.reset(new mrb_msgpack_memo(max_bytes));
+  mrb_iv_set(mrb, mrb_obj_value(ctx->owner), MRB_SYM(memo_roots), mrb_ary_new(mrb));
+  ctx->memo->canary = mrb_data_object_alloc(mrb, mrb->object_class, ctx->memo.get(), &mrb_msgpack_memo_canary_type);
+}
+
+/* ------------------------------------------------------------------------
+ * Composite packers (array, hash)
+ * ------------------------------------------------------------------------ */
+
+/* Collects the output of a run of numbers, it's handed to the real writer in
+ * one piece instead of a write per element. */
+struct mrb_msgpack_chunk_writer {
+  static constexpr size_t CAPA = 1024;
+  static constexpr size_t MAX_NUMBER = 9; /* 0xcf/0xd3/0xcb and 8 bytes */
+
+  char buf[CAPA];
+  size_t size = 0;
+
+  void write(const char* p, size_t n) {
+    std::memcpy(buf + size, p, n);
+    size += n;
+  }
+};
+
+/* Packs the Integers and Floats of ary starting at i until something else
+ * shows up, returns the index of that element. Numbers never go through ext
+ * types or conversion methods, so no Ruby code can run in here. */
+static mrb_int
+mrb_msgpack_pack_numeric_run(mrb_state* mrb, mrb_value ary, mrb_int i, mrb_int n,
+                             msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+{
+  mrb_msgpack_chunk_writer chunk;
+  msgpack::packer<mrb_msgpack_chunk_writer> cpk(chunk);
+  const mrb_value* ptr = RARRAY_PTR(ary);
+  const mrb_int len = std::min(n, RARRAY_LEN(ary));
+
+  for (; i < len; ++i) {
+    mrb_value v = ptr[i];
+    if (mrb_integer_p(v)) {
+      mrb_msgpack_pack_int(cpk, v);
+    }
+#ifndef MRB_WITHOUT_FLOAT
+    else if (mrb_float_p(v)) {
+#ifdef MRB_USE_FLOAT
+      cpk.pack_float(mrb_float(v));
+#else
+      cpk.pack_double(mrb_float(v));
+#endif
+    }
+#endif
+    else {
+      break;
+    }
+
+    if (chunk.size > mrb_msgpack_chunk_writer::CAPA - mrb_msgpack_chunk_writer::MAX_NUMBER) {
+      pk.pack_bin_body(chunk.buf, static_cast<uint32_t>(chunk.size)); /* raw bytes, no header */
+      chunk.size = 0;
+    }
+  }
+
+  if (chunk.size) pk.pack_bin_body(chunk.buf, static_cast<uint32_t>(chunk.size));
+  return i;
+}
+
+static inline bool
+mrb_msgpack_numeric_p(mrb_value v)
+{
+#ifndef MRB_WITHOUT_FLOAT
+  return mrb_integer_p(v) || mrb_float_p(v);
+#else
+  return mrb_integer_p(v);
+#endif
+}
+
+static void
+mrb_msgpack_pack_array_value(mrb_state* mrb,
+                             mrb_msgpack_ctx* ctx,
+                             mrb_value self,
+                             msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+{
+  mrb_int n = RARRAY_LEN(self);
+  mrb_int arena_index = mrb_gc_arena_save(mrb);
+
+  pk.pack_array(static_cast<uint32_t>(n));
+
+  for (mrb_int i = 0; i < n;) {
+    /* packing an element can run Ruby code which shrinks the Array */
+    if (i < RARRAY_LEN(self) && mrb_msgpack_numeric_p(RARRAY_PTR(self)[i])) {
+      i = mrb_msgpack_pack_numeric_run(mrb, self, i, n, pk);
+      continue;
+    }
+    mrb_msgpack_pack_value(mrb, ctx,
+                           mrb_ary_ref(mrb, self, i),
+                           pk);
+    mrb_gc_arena_restore(mrb, arena_index);
+    ++i;
+  }
+}
+
+static void
+mrb_msgpack_pack_hash_value(mrb_state* mrb,
+                            mrb_msgpack_ctx* ctx,
+                            mrb_value self,
+                            msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+{
+  uint32_t n = static_cast<uint32_t>(mrb_hash_size(mrb, self));
+  pk.pack_map(n);
+
+  mrb_int arena_index = mrb_gc_arena_save(mrb);
+
+  struct Ctx {
+    msgpack::packer<mrb_msgpack_sbo_writer>* pk;
+    mrb_msgpack_ctx* codec;
+    mrb_int arena_index;
+  } foreach_ctx{ &pk, ctx, arena_index };
+
+  mrb_hash_foreach(mrb, mrb_hash_ptr(self),
+    [](mrb_state* mrb, mrb_value key, mrb_value val, void *p) -> int {
+      Ctx *c = static_cast<Ctx*>(p);
+      mrb_msgpack_pack_value(mrb, c->codec, key, *c->pk);
+      mrb_msgpack_pack_value(mrb, c->codec, val, *c->pk);
+
+      mrb_gc_arena_restore(mrb, c->arena_index);
+      return 0;
+    },
+    &foreach_ctx
+  );
+}
+
+static void
+mrb_msgpack_pack_time_ext(mrb_state* mrb, mrb_value time, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+{
+    int64_t sec, nsec;
+
+    /* mruby-time exports no accessors for its struct, only mrb_time_at,
+       so the seconds and nanoseconds have to come from its methods */
+    sec  = (int64_t)mrb_as_int(mrb, mrb_funcall_argv(mrb, time, MRB_SYM(to_i), 0, nullptr));
+    nsec = (int64_t)mrb_as_int(mrb, mrb_funcall_argv(mrb, time, MRB_SYM(nsec), 0, nullptr));
+
+    // 32‑bit format
+    if (nsec == 0 && sec >= 0 && sec < (1LL << 32)) {
+        char buf[4];
+        buf[0] = (sec >> 24) & 0xFF;
+        buf[1] = (sec >> 16) & 0xFF;
+        buf[2] = (sec >> 8)  & 0xFF;
+        buf[3] =  sec        & 0xFF;
+
+        pk.pack_ext(4, -1);
+        pk.pack_ext_body(buf, 4);
+        return;
+    }
+
+    // 64‑bit format
+    if (sec >= 0 && sec < (1LL << 34) && nsec >= 0 && nsec < 1000000000) {
+        uint64_t v = ((uint64_t)nsec << 34) | (uint64_t)sec;
+        char buf[8];
+        for (int i = 7; i >= 0; --i) { buf[i] = v & 0xFF; v >>= 8; }
+
+        pk.pack_ext(8, -1);
+        pk.pack_ext_body(buf, 8);
+        return;
+    }
+
+    // 96‑bit format
+    char buf[12];
+    buf[0] = (nsec >> 24) & 0xFF;
+    buf[1] = (nsec >> 16) & 0xFF;
+    buf[2] = (nsec >> 8)  & 0xFF;
+    buf[3] =  nsec        & 0xFF;
+
+    uint64_t s = (uint64_t)sec;
+    for (int i = 11; i >= 4; --i) { buf[i] = s & 0xFF; s >>= 8; }
+
+    pk.pack_ext(12, -1);
+    pk.pack_ext_body(buf, 12);
+}
+
+
+/* ------------------------------------------------------------------------
+ * Conversion method lookup: objects without an ext packer are packed as
+ * the first of to_hash, to_ary, to_int and to_str which they respond to,
+ * otherwise as their to_s. Which one that is gets cached per class, an entry
+ * is used while the class's ancestor chain is unchanged. Defining or removing
+ * one of these methods drops the caches through the method hooks below.
+ * ------------------------------------------------------------------------ */
+
+enum mrb_msgpack_conversion : uint8_t {
+  MRB_MSGPACK_TO_HASH,
+  MRB_MSGPACK_TO_ARY,
+  MRB_MSGPACK_TO_INT,
+  MRB_MSGPACK_TO_STR,
+  MRB_MSGPACK_TO_S,
+};
+
+static inline mrb_sym
+mrb_msgpack_conversion_method(uint8_t conversion)
+{
+  switch (conversion) {
+    case MRB_MSGPACK_TO_HASH: return MRB_SYM(to_hash);
+    case MRB_MSGPACK_TO_ARY:  return MRB_SYM(to_ary);
+    case MRB_MSGPACK_TO_INT:  return MRB_SYM(to_int);
+    case MRB_MSGPACK_TO_STR:  return MRB_SYM(to_str);
+    default:                  return MRB_SYM(to_s);
+  }
+}
+
+static inline enum mrb_vtype
+mrb_msgpack_conversion_type(uint8_t conversion)
+{
+  switch (conversion) {
+    case MRB_MSGPACK_TO_HASH: return MRB_TT_HASH;
+    case MRB_MSGPACK_TO_ARY:  return MRB_TT_ARRAY;
+    case MRB_MSGPACK_TO_INT:  return MRB_TT_INTEGER;
+    default:                  return MRB_TT_STRING;
+  }
+}
+
+static void
+mrb_msgpack_conversion_cache_reset(mrb_state *mrb, mrb_msgpack_ctx *ctx)
+{
+  ctx->conversions.clear();
+  ctx->conversion_generation = ctx->root->class_generation;
+  mrb_iv_set(mrb, mrb_obj_value(ctx->owner), MRB_SYM(conversion_roots), mrb_nil_value());
+}
+
+static uint8_t
+mrb_msgpack_find_conversion(mrb_state *mrb, mrb_msgpack_ctx *ctx, mrb_value obj)
+{
+  if (unlikely(ctx->conversion_generation != ctx->root->class_generation)) {
+    mrb_msgpack_conversion_cache_reset(mrb, ctx);
+  }
+
+  /* singleton methods are looked up every time */
+  struct RClass *klass = mrb_class(mrb, obj);
+  bool cacheable = (mrb_obj_class(mrb, obj) == klass);
+  uint64_t ancestry = 0;
+  bool refresh = false; /* a stale entry, its class is already rooted */
+  if (likely(cacheable)) {
+    ancestry = mrb_msgpack_ancestry(klass);
+    const mrb_msgpack_conversion_cache_entry *cached = ctx->conversions.find(klass);
+    if (cached && likely(cached->ancestry == ancestry)) return cached->conversion;
+    refresh = cached != nullptr;
+  }
+
+  uint8_t conversion = MRB_MSGPACK_TO_HASH;
+  while (conversion < MRB_MSGPACK_TO_S &&
+         !mrb_obj_respond_to(mrb, klass, mrb_msgpack_conversion_method(conversion))) {
+    ++conversion;
+  }
+
+  if (likely(cacheable)) {
+    const mrb_msgpack_conversion_cache_entry entry{ conversion, ancestry };
+    if (unlikely(!ctx->conversions.insert(klass, entry))) {
+      mrb_msgpack_conversion_cache_reset(mrb, ctx);
+      ctx->conversions.insert(klass, entry);
+      refresh = false;
+    }
+    if (refresh) return conversion;
+
+    mrb_value self = mrb_obj_value(ctx->owner);
+    mrb_value roots = mrb_iv_get(mrb, self, MRB_SYM(conversion_roots));
+    if (!mrb_array_p(roots)) {
+      roots = mrb_ary_new(mrb);
+      mrb_iv_set(mrb, self, MRB_SYM(conversion_roots), roots);
+    }
+    mrb_ary_push(mrb, roots, mrb_obj_value(klass));
+  }
+
+  return conversion;
+}
+
+/* The cached method is called straight away. Should it return nil the ones
+ * after it are tried the usual way, like mrb_type_convert_check would. */
+static void
+mrb_msgpack_pack_converted(mrb_state* mrb, mrb_msgpack_ctx* ctx, mrb_value self, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+{
+  const uint8_t first = mrb_msgpack_find_conversion(mrb, ctx, self);
+
+  for (uint8_t conversion = first; conversion < MRB_MSGPACK_TO_S; ++conversion) {
+    mrb_sym method = mrb_msgpack_conversion_method(conversion);
+    enum mrb_vtype type = mrb_msgpack_conversion_type(conversion);
+
+    mrb_value v = conversion == first ? mrb_funcall_argv(mrb, self, method, 0, NULL)
+                                      : mrb_type_convert_check(mrb, self, type, method);
+    if (mrb_nil_p(v)) continue;
+    if (unlikely(mrb_type(v) != type)) {
+      mrb_raisef(mrb, E_TYPE_ERROR, "can't convert %T (%T#%n gives %T)", self, self, method, v);
+    }
+
+    switch (type) {
+      case MRB_TT_HASH:    return mrb_msgpack_pack_hash_value(mrb, ctx, v, pk);
+      case MRB_TT_ARRAY:   return mrb_msgpack_pack_array_value(mrb, ctx, v, pk);
+      case MRB_TT_INTEGER: return mrb_msgpack_pack_integer_value(mrb, v, pk);
+      default:             return mrb_msgpack_pack_string_value(mrb, v, pk);
+    }
+  }
+
+  mrb_msgpack_pack_string_value(mrb, mrb_type_convert(mrb, self, MRB_TT_STRING, MRB_SYM(to_s)), pk);
+}
+
+/* ------------------------------------------------------------------------
+ * Core pack dispatcher
+ * ------------------------------------------------------------------------ */
+
+static void
+mrb_msgpack_pack_value(mrb_state* mrb,
+                       mrb_msgpack_ctx* ctx,
+                       mrb_value self,
+                       msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+{
+  switch (mrb_type(self)) {
+    case MRB_TT_FALSE:
+      if (mrb_nil_p(self)) pk.pack_nil();
+      else pk.pack_false();
+      break;
+
+    case MRB_TT_TRUE:
+      pk.pack_true();
+      break;
+
+#ifndef MRB_WITHOUT_FLOAT
+    case MRB_TT_FLOAT:
+      mrb_msgpack_pack_float_value(mrb, self, pk);
+      break;
+#endif
+
+    case MRB_TT_INTEGER:
+      mrb_msgpack_pack_integer_value(mrb, self, pk);
+      break;
+
+    case MRB_TT_HASH:
+      if (unlikely(ctx->memo) && mrb_msgpack_memo_pack(mrb, ctx, self, pk)) break;
+      mrb_msgpack_pack_hash_value(mrb, ctx, self, pk);
+      break;
+
+    case MRB_TT_ARRAY:
+      if (unlikely(ctx->memo) && mrb_msgpack_memo_pack(mrb, ctx, self, pk)) break;
+      mrb_msgpack_pack_array_value(mrb, ctx, self, pk);
+      break;
+
+    case MRB_TT_STRING:
+      if (unlikely(ctx->memo) && RSTRING_LEN(self) >= MRB_MSGPACK_MEMO_MIN_STRING &&
+          mrb_msgpack_memo_pack(mrb, ctx, self, pk)) break;
+      mrb_msgpack_pack_string_value(mrb, self, pk);
+      break;
+
+    case MRB_TT_SYMBOL:
+      ctx->sym_packer(mrb, self, ctx->ext_type, pk);
+      break;
+
+    case MRB_TT_DATA: {
+      if (DATA_TYPE(self) == &mrb_msgpack_raw_value_type) {
+        /* spliced in as is, the bytes can't change since they are frozen */
+        auto *raw = static_cast<const mrb_msgpack_raw_value*>(DATA_PTR(self));
+        if (unlikely(!raw)) mrb_raise(mrb, E_MSGPACK_ERROR, "RawValue is not initialized");
+        pk.pack_bin_body(raw->ptr, static_cast<uint32_t>(raw->len));
+        break;
+      }
+      if (ctx->time_class && mrb_obj_is_kind_of(mrb, self, ctx->time_class)) {
+        mrb_msgpack_pack_time_ext(mrb, self, pk);
+        break;
+      } else {
+        goto def;
+      }
+    }
+def:
+    default: {
+      if (unlikely(!ctx->packables.empty()) && mrb_msgpack_pack_packable(mrb, ctx, self, pk)) break;
+      if (mrb_msgpack_pack_ext_value(mrb, ctx, self, pk)) break;
+      mrb_msgpack_pack_converted(mrb, ctx, self, pk);
+      break;
+    }
+  }
+}
+
+/* ------------------------------------------------------------------------
+ * Ruby-visible pack wrappers
+ * ------------------------------------------------------------------------ */
+
+#define DEFINE_MSGPACK_PACKER(FUNC_NAME, PACK_FN)                              \
+static mrb_value                                                               \
+FUNC_NAME(mrb_state* mrb, mrb_value self) {                                    \
+  mrb_msgpack_sbo_writer writer(mrb);                                          \
+  using Packer = msgpack::packer<mrb_msgpack_sbo_writer>;                      \
+  Packer pk(writer);                                                           \
+  PACK_FN(mrb, self, pk);                                                      \
+  return writer.result();                                                      \
+}
+
+/* same, for packers which recurse and need the default codec */
+#define DEFINE_MSGPACK_CTX_PACKER(FUNC_NAME, PACK_FN)                          \
+static mrb_value                                                               \
+FUNC_NAME(mrb_state* mrb, mrb_value self) {                                    \
+  mrb_msgpack_ctx *ctx = MRB_MSGPACK_CONTEXT(mrb);                             \
+  mrb_msgpack_sbo_writer writer(mrb);                                          \
+  using Packer = msgpack::packer<mrb_msgpack_sbo_writer>;                      \
+  Packer pk(writer);                                                           \
+  PACK_FN(mrb, ctx, self, pk);                                                 \
+  return writer.result();                                                      \
+}
+
+/* to_msgpack entrypoints */
+DEFINE_MSGPACK_CTX_PACKER(mrb_msgpack_pack_object,  mrb_msgpack_pack_value)
+DEFINE_MSGPACK_PACKER(mrb_msgpack_pack_string,  mrb_msgpack_pack_string_value)
+DEFINE_MSGPACK_CTX_PACKER(mrb_msgpack_pack_array,   mrb_msgpack_pack_array_value)
+DEFINE_MSGPACK_CTX_PACKER(mrb_msgpack_pack_hash,    mrb_msgpack_pack_hash_value)
+DEFINE_MSGPACK_PACKER(mrb_msgpack_pack_integer, mrb_msgpack_pack_integer_value)
+#ifndef MRB_WITHOUT_FLOAT
+DEFINE_MSGPACK_PACKER(mrb_msgpack_pack_float,   mrb_msgpack_pack_float_value)
+#endif
+
+static inline void
+pack_true_fn(mrb_state*, mrb_value, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+{
+  pk.pack_true();
+}
+
+static inline void
+pack_false_fn(mrb_state*, mrb_value, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+{
+  pk.pack_false();
+}
+
+static inline void
+pack_nil_fn(mrb_state*, mrb_value, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+{
+  pk.pack_nil();
+}
+
+DEFINE_MSGPACK_PACKER(mrb_msgpack_pack_true,  pack_true_fn)
+DEFINE_MSGPACK_PACKER(mrb_msgpack_pack_false, pack_false_fn)
+DEFINE_MSGPACK_PACKER(mrb_msgpack_pack_nil,   pack_nil_fn)
+
+/* ------------------------------------------------------------------------
+ * Public C pack API
+ * ------------------------------------------------------------------------ */
+
+static mrb_value
+mrb_msgpack_pack_with(mrb_state *mrb, mrb_msgpack_ctx *ctx, mrb_value object)
+{
+  mrb_msgpack_sbo_writer writer(mrb);
+  msgpack::packer<mrb_msgpack_sbo_writer> pk(writer);
+
+  mrb_msgpack_pack_value(mrb, ctx, object, pk);
+
+  return writer.result();
+}
+
+/* Sizes what packs without running Ruby code: nil, booleans, numbers, Strings,
+ * Symbols, RawValues and Arrays and Hashes of those. Returns false on anything
+ * else, an ext packer or conversion method could return something different
+ * the second time it's called. */
+static bool
+mrb_msgpack_size_walk(mrb_state *mrb, mrb_msgpack_ctx *ctx, mrb_value v,
+                      msgpack::packer<mrb_msgpack_sbo_writer>& pk, int depth)
+{
+  if (unlikely(depth >= MSGPACK_DEPTH_LIMIT)) return false;
+
+  switch (mrb_type(v)) {
+    case MRB_TT_FALSE:
+      if (mrb_nil_p(v)) pk.pack_nil();
+      else pk.pack_false();
+      return true;
+
+    case MRB_TT_TRUE:
+      pk.pack_true();
+      return true;
+
+#ifndef MRB_WITHOUT_FLOAT
+    case MRB_TT_FLOAT:
+      mrb_msgpack_pack_float_value(mrb, v, pk);
+      return true;
+#endif
+
+    case MRB_TT_INTEGER:
+      mrb_msgpack_pack_integer_value(mrb, v, pk);
+      return true;
+
+    case MRB_TT_STRING:
+      /* memoized bytes are the same as packing it again */
+      mrb_msgpack_pack_string_value(mrb, v, pk);
+      return true;
+
+    case MRB_TT_SYMBOL:
+      ctx->sym_packer(mrb, v, ctx->ext_type, pk);
+      return true;
+
+    case MRB_TT_DATA:
+      if (DATA_TYPE(v) == &mrb_msgpack_raw_value_type && DATA_PTR(v)) {
+        auto *raw = static_cast<const mrb_msgpack_raw_value*>(DATA_PTR(v));
+        pk.pack_bin_body(raw->ptr, static_cast<uint32_t>(raw->len));
+        return true;
+      }
+      return false;
+
+    case MRB_TT_ARRAY:
+      pk.pack_array(static_cast<uint32_t>(RARRAY_LEN(v)));
+      for (mrb_int i = 0; i < RARRAY_LEN(v); ++i) {
+        if (!mrb_msgpack_size_walk(mrb, ctx, RARRAY_PTR(v)[i], pk, depth + 1)) return false;
+      }
+      return true;
+
+    case MRB_TT_HASH: {
+      pk.pack_map(static_cast<uint32_t>(mrb_hash_size(mrb, v)));
+
+      struct Ctx {
+        mrb_msgpack_ctx *codec;
+        msgpack::packer<mrb_msgpack_sbo_writer> *pk;
+        int depth;
+        bool sized;
+      } c{ ctx, &pk, depth + 1, true };
+
+      mrb_hash_foreach(mrb, mrb_hash_ptr(v),
+        [](mrb_state* mrb, mrb_value key, mrb_value val, void *p) -> int {
+          Ctx *c = static_cast<Ctx*>(p);
+          c->sized = mrb_msgpack_size_walk(mrb, c->codec, key, *c->pk, c->depth) &&
+                     mrb_msgpack_size_walk(mrb, c->codec, val, *c->pk, c->depth);
+          return c->sized ? 0 : 1;
+        },
+        &c
+      );
+      return c.sized;
+    }
+
+    default:
+      return false;
+  }
+}
+
+/* false when object reaches Ruby code, see mrb_msgpack_size_walk */
+static bool
+mrb_msgpack_exact_size(mrb_state *mrb, mrb_msgpack_ctx *ctx, mrb_value object, size_t& size)
+{
+  mrb_msgpack_size_sink sink;
+  mrb_msgpack_sbo_writer writer(mrb, &sink);
+  msgpack::packer<mrb_msgpack_sbo_writer> pk(writer);
+
+  if (!mrb_msgpack_size_walk(mrb, ctx, object, pk, 0)) return false;
+  size = sink.size;
+  return true;
+}
+
+static mrb_int
+mrb_msgpack_packed_size_with(mrb_state *mrb, mrb_msgpack_ctx *ctx, mrb_value object)
+{
+  size_t size;
+  if (mrb_msgpack_exact_size(mrb, ctx, object, size)) return safe_size_to_mrb_int(mrb, size);
+
+  /* the callbacks run once, only the bytes are counted */
+  mrb_msgpack_size_sink sink;
+  mrb_msgpack_sbo_writer writer(mrb, &sink);
+  msgpack::packer<mrb_msgpack_sbo_writer> pk(writer);
+
+  mrb_msgpack_pack_value(mrb, ctx, object, pk);
+
+  return safe_size_to_mrb_int(mrb, sink.size);
+}
+
+/* Objects which reach Ruby code are packed in a single pass into a growing buffer. */
+static mrb_value
+mrb_msgpack_pack_exact(mrb_state *mrb, mrb_msgpack_ctx *ctx, mrb_value object)
+{
+  size_t size;
+  if (!mrb_msgpack_exact_size(mrb, ctx, object, size)) return mrb_msgpack_pack_with(mrb, ctx, object);
+
+  mrb_msgpack_sbo_writer writer(mrb, size);
+  msgpack::packer<mrb_msgpack_sbo_writer> pk(writer);
+
+  mrb_msgpack_pack_value(mrb, ctx, object, pk);
+
+  return writer.result();
+}
+
+MRB_API mrb_value
+mrb_msgpack_pack(mrb_state *mrb, mrb_value object)
+{
+  return mrb_msgpack_pack_with(mrb, MRB_MSGPACK_CONTEXT(mrb), object);
+}
+
+MRB_API mrb_value
+mrb_msgpack_pack_argv(mrb_state *mrb, mrb_value *argv, mrb_int argv_len)
+{
+  mrb_msgpack_ctx *ctx = MRB_MSGPACK_CONTEXT(mrb);
+  mrb_msgpack_sbo_writer writer(mrb);
+  msgpack::packer<mrb_msgpack_sbo_writer> pk(writer);
+
+  pk.pack_array(static_cast<uint32_t>(argv_len));
+
+  for (mrb_int i = 0; i < argv_len; ++i) {
+    mrb_msgpack_pack_value(mrb, ctx, argv[i], pk);
+  }
+
+  return writer.result();
+}
+
+MRB_API mrb_int
+mrb_msgpack_packed_size(mrb_state *mrb, mrb_value object)
+{
+  return mrb_msgpack_packed_size_with(mrb, MRB_MSGPACK_CONTEXT(mrb), object);
+}
+
+MRB_API mrb_value
+mrb_msgpack_codec_pack(mrb_state *mrb, mrb_value codec, mrb_value object)
+{
+  return mrb_msgpack_pack_with(mrb, mrb_msgpack_codec_get(mrb, codec), object);
+}
+
+static mrb_value
+mrb_msgpack_pack_args(mrb_state *mrb, mrb_msgpack_ctx *ctx)
+{
+  mrb_value object;
+  mrb_sym kw_names[] = { MRB_SYM(exact), MRB_SYM(compress) };
+  mrb_value kw_values[2];
+  mrb_kwargs kwargs = { 2, 0, kw_names, kw_values, NULL };
+  mrb_get_args(mrb, "o:", &object, &kwargs);
+
+  if (!mrb_undef_p(kw_values[1]) && !mrb_nil_p(kw_values[1])) {
+    return mrb_msgpack_pack_compressed(mrb, ctx, object, mrb_msgpack_compression_get(mrb, kw_values[1]));
+  }
+  if (!mrb_undef_p(kw_values[0]) && mrb_test(kw_values[0])) {
+    return mrb_msgpack_pack_exact(mrb, ctx, object);
+  }
+  return mrb_msgpack_pack_with(mrb, ctx, object);
+}
+
+static mrb_value
+mrb_msgpack_pack_m(mrb_state *mrb, mrb_value self)
+{
+  return mrb_msgpack_pack_args(mrb, MRB_MSGPACK_CONTEXT(mrb));
+}
+
+static mrb_value
+mrb_msgpack_codec_pack_m(mrb_state *mrb, mrb_value self)
+{
+  return mrb_msgpack_pack_args(mrb, mrb_msgpack_codec_get(mrb, self));
+}
+
+static mrb_value
+mrb_msgpack_packed_size_m(mrb_state *mrb, mrb_value self)
+{
+  mrb_value object;
+  mrb_get_args(mrb, "o", &object);
+  return mrb_int_value(mrb, mrb_msgpack_packed_size(mrb, object));
+}
+
+static mrb_value
+mrb_msgpack_codec_packed_size_m(mrb_state *mrb, mrb_value self)
+{
+  mrb_value object;
+  mrb_get_args(mrb, "o", &object);
+  return mrb_int_value(mrb, mrb_msgpack_packed_size_with(mrb, mrb_msgpack_codec_get(mrb, self), object));
+}
+
+/* ------------------------------------------------------------------------
+ * Packer: reusable output buffer
+ * ------------------------------------------------------------------------ */
+
+struct mrb_msgpack_packer {
+  mrb_msgpack_buffer_sink sink;
+  std::unique_ptr<mrb_msgpack_fd_sink> stream; /* set when writing to a fd */
+  std::unique_ptr<mrb_msgpack_compress_sink> compressor; /* set with compress:, feeds sink or stream */
+  std::size_t committed = 0; /* bytes of completed writes */
+  std::size_t stream_mark = 0; /* bytes buffered in stream before the last write */
+  bool writing = false; /* still set after a compressed or streamed write raised */
+  mrb_msgpack_ctx *codec = nullptr; /* nullptr packs with the default codec */
+
+  /* a write that raised half way leaves garbage behind, drop it */
+  std::string& buf() {
+    if (unlikely(sink.buf.size() != committed)) sink.buf.resize(committed);
+    return sink.buf;
+  }
+
+  /* the same for a stream, a write doesn't flush before it completed */
+  mrb_msgpack_fd_sink* fd_sink() {
+    if (unlikely(writing && !compressor)) {
+      stream->truncate(stream_mark);
+      stream->hold = false;
+      writing = false;
+    }
+    return stream.get();
+  }
+};
+
+MRB_CPP_DEFINE_TYPE(mrb_msgpack_packer, mrb_msgpack_packer)
+
+static mrb_msgpack_packer*
+mrb_msgpack_packer_get(mrb_state *mrb, mrb_value self)
+{
+  auto* packer = mrb_cpp_get<mrb_msgpack_packer>(mrb, self);
+  if (unlikely(!packer)) {
+    mrb_raise(mrb, E_MSGPACK_ERROR, "Packer is not initialized");
+  }
+  return packer;
+}
+
+MRB_API mrb_value
+mrb_msgpack_packer_new(mrb_state *mrb)
+{
+  struct RClass *packer_class =
+    mrb_class_get_under_id(mrb, mrb_module_get_id(mrb, MRB_SYM(MessagePack)), MRB_SYM(Packer));
+  return mrb_obj_new(mrb, packer_class, 0, NULL);
+}
+
+MRB_API void
+mrb_msgpack_packer_write(mrb_state *mrb, mrb_value self, mrb_value object)
+{
+  mrb_msgpack_packer* packer = mrb_msgpack_packer_get(mrb, self);
+  mrb_msgpack_ctx* ctx = packer->codec ? packer->codec : MRB_MSGPACK_CONTEXT(mrb);
+
+  if (packer->compressor) {
+    /* frames of a write that raised can't be taken back */
+    if (unlikely(packer->writing)) {
+      mrb_raise(mrb, E_MSGPACK_ERROR, "Packer has to be reset after a failed write");
+    }
+    packer->writing = true;
+    mrb_msgpack_sbo_writer writer(mrb, packer->compressor.get());
+    msgpack::packer<mrb_msgpack_sbo_writer> pk(writer);
+    mrb_msgpack_pack_value(mrb, ctx, object, pk);
+    packer->writing = false;
+    packer->committed = packer->sink.buf.size();
+    return;
+  }
+
+  if (packer->stream) {
+    mrb_msgpack_fd_sink* stream = packer->fd_sink();
+    packer->stream_mark = stream->buffered;
+    packer->writing = true;
+    stream->hold = true;
+    mrb_msgpack_sbo_writer writer(mrb, stream);
+    msgpack::packer<mrb_msgpack_sbo_writer> pk(writer);
+    mrb_msgpack_pack_value(mrb, ctx, object, pk);
+    stream->hold = false;
+    packer->writing = false;
+    if (stream->buffered >= stream->high_water) stream->flush();
+    return;
+  }
+
+  packer->buf();
+
+  mrb_msgpack_sbo_writer writer(mrb, &packer->sink);
+  msgpack::packer<mrb_msgpack_sbo_writer> pk(writer);
+  mrb_msgpack_pack_value(mrb, ctx, object, pk);
+
+  packer->committed = packer->sink.buf.size();
+}
+
+MRB_API mrb_value
+mrb_msgpack_packer_to_s(mrb_state *mrb, mrb_value self)
+{
+  mrb_msgpack_packer* packer = mrb_msgpack_packer_get(mrb, self);
+  if (unlikely(packer->stream)) {
+    mrb_raise(mrb, E_MSGPACK_ERROR, "Packer writes to a file descriptor");
+  }
+  if (packer->compressor) {
+    if (unlikely(packer->writing)) {
+      mrb_raise(mrb, E_MSGPACK_ERROR, "Packer has to be reset after a failed write");
+    }
+    packer->compressor->finish(); /* later writes start a new frame */
+    packer->committed = packer->sink.buf.size();
+  }
+
+  const std::string& buf = packer->buf();
+  return mrb_str_new(mrb, buf.data(), buf.size());
+}
+
+MRB_API void
+mrb_msgpack_packer_reset(mrb_state *mrb, mrb_value self)
+{
+  mrb_msgpack_packer* packer = mrb_msgpack_packer_get(mrb, self);
+  if (packer->stream) packer->stream->discard();
+  if (packer->compressor) packer->compressor->block.clear();
+  packer->sink.buf.clear(); /* keeps the capacity */
+  packer->committed = 0;
+  packer->writing = false;
+}
+
+MRB_API mrb_int
+mrb_msgpack_packer_bytesize(mrb_state *mrb, mrb_value self)
+{
+  mrb_msgpack_packer* packer = mrb_msgpack_packer_get(mrb, self);
+  if (packer->stream) return safe_size_to_mrb_int(mrb, packer->fd_sink()->buffered);
+  return safe_size_to_mrb_int(mrb, packer->buf().size());
+}
+
+MRB_API mrb_int
+mrb_msgpack_packer_flush(mrb_state *mrb, mrb_value self)
+{
+  mrb_msgpack_packer* packer = mrb_msgpack_packer_get(mrb, self);
+  if (!packer->stream) return 0;
+  if (packer->compressor && !packer->writing) packer->compressor->finish();
+
+  mrb_msgpack_fd_sink* stream = packer->fd_sink();
+  size_t before = stream->written;
+  stream->flush();
+  return safe_size_to_mrb_int(mrb, stream->written - before);
+}
+
+static int
+mrb_msgpack_fileno(mrb_state *mrb, mrb_value io)
+{
+  mrb_int fd = mrb_integer(mrb_type_convert(mrb, io, MRB_TT_INTEGER, MRB_SYM(fileno)));
+  if (unlikely(fd < 0 || fd > INT_MAX)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid file descriptor");
+  }
+  return static_cast<int>(fd);
+}
+
+static size_t
+mrb_msgpack_high_water(mrb_state *mrb, mrb_value high_water)
+{
+  if (mrb_undef_p(high_water) || mrb_nil_p(high_water)) return 0;
+
+  mrb_int hw = mrb_as_int(mrb, high_water);
+  if (unlikely(hw <= 0)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "high_water must be positive");
+  }
+  return static_cast<size_t>(hw);
+}
+
+static mrb_value
+mrb_msgpack_packer_initialize(mrb_state *mrb, mrb_value self)
+{
+  mrb_value io = mrb_nil_value();
+  mrb_sym kw_names[] = { MRB_SYM(high_water), MRB_SYM(codec), MRB_SYM(compress) };
+  mrb_value kw_values[3];
+  mrb_kwargs kwargs = { 3, 0, kw_names, kw_values, NULL };
+  mrb_get_args(mrb, "|o:", &io, &kwargs);
+
+  auto* packer = mrb_cpp_new<mrb_msgpack_packer>(mrb, self);
+
+  if (!mrb_undef_p(kw_values[1]) && !mrb_nil_p(kw_values[1])) {
+    packer->codec = mrb_msgpack_codec_get(mrb, kw_values[1]);
+    mrb_iv_set(mrb, self, MRB_SYM(codec), kw_values[1]);
+  }
+
+  if (!mrb_nil_p(io)) {
+    int fd = mrb_msgpack_fileno(mrb, io);
+    size_t high_water = mrb_msgpack_high_water(mrb, kw_values[0]);
+    packer->stream.reset(new mrb_msgpack_fd_sink(mrb, fd, high_water));
+    mrb_iv_set(mrb, self, MRB_SYM(io), io); /* keeps the IO from being closed by the GC */
+  }
+
+  if (!mrb_undef_p(kw_values[2]) && !mrb_nil_p(kw_values[2])) {
+    mrb_msgpack_sink* out = packer->stream ? static_cast<mrb_msgpack_sink*>(packer->stream.get()) : &packer->sink;
+    mrb_msgpack_compression algorithm = mrb_msgpack_compression_get(mrb, kw_values[2]);
+    packer->compressor.reset(new mrb_msgpack_compress_sink(mrb, algorithm, out));
+  }
+
+  return self;
+}
+
+static mrb_value
+mrb_msgpack_packer_write_m(mrb_state *mrb, mrb_value self)
+{
+  mrb_value object;
+  mrb_get_args(mrb, "o", &object);
+  mrb_msgpack_packer_write(mrb, self, object);
+  return self;
+}
+
+static mrb_value
+mrb_msgpack_packer_to_s_m(mrb_state *mrb, mrb_value self)
+{
+  return mrb_msgpack_packer_to_s(mrb, self);
+}
+
+static mrb_value
+mrb_msgpack_packer_reset_m(mrb_state *mrb, mrb_value self)
+{
+  mrb_msgpack_packer_reset(mrb, self);
+  return self;
+}
+
+static mrb_value
+mrb_msgpack_packer_bytesize_m(mrb_state *mrb, mrb_value self)
+{
+  return mrb_int_value(mrb, mrb_msgpack_packer_bytesize(mrb, self));
+}
+
+static mrb_value
+mrb_msgpack_packer_flush_m(mrb_state *mrb, mrb_value self)
+{
+  mrb_msgpack_packer_flush(mrb, self);
+  return self;
+}
+
+static mrb_value
+mrb_msgpack_pack_to_m(mrb_state *mrb, mrb_value self)
+{
+  mrb_value io, object;
+  mrb_sym kw_names[] = { MRB_SYM(high_water), MRB_SYM(compress) };
+  mrb_value kw_values[2];
+  mrb_kwargs kwargs = { 2, 0, kw_names, kw_values, NULL };
+  mrb_get_args(mrb, "oo:", &io, &object, &kwargs);
+
+  /* everything that can raise is resolved before a sink is allocated */
+  int fd = mrb_msgpack_fileno(mrb, io);
+  size_t high_water = mrb_msgpack_high_water(mrb, kw_values[0]);
+  bool compress = !mrb_undef_p(kw_values[1]) && !mrb_nil_p(kw_values[1]);
+  mrb_msgpack_compression algorithm = compress ? mrb_msgpack_compression_get(mrb, kw_values[1]) : MRB_MSGPACK_STORED;
+
+  /* the sink lives in a Packer so the GC frees its chunks if packing raises */
+  mrb_value packer_obj = mrb_msgpack_packer_new(mrb);
+  auto* packer = mrb_msgpack_packer_get(mrb, packer_obj);
+  packer->stream.reset(new mrb_msgpack_fd_sink(mrb, fd, high_water));
+  if (compress) {
+    packer->compressor.reset(new mrb_msgpack_compress_sink(mrb, algorithm, packer->stream.get()));
+  }
+
+  mrb_msgpack_packer_write(mrb, packer_obj, object);
+  if (packer->compressor) packer->compressor->finish();
+  packer->stream->flush();
+
+  return mrb_int_value(mrb, safe_size_to_mrb_int(mrb, packer->stream->written));
+}
+
+static mrb_value
+mrb_msgpack_pack_compressed(mrb_state *mrb, mrb_msgpack_ctx *ctx, mrb_value object, mrb_msgpack_compression algorithm)
+{
+  /* like pack_to the buffers live in a Packer, the GC frees them if packing raises */
+  mrb_value packer_obj = mrb_msgpack_packer_new(mrb);
+  auto* packer = mrb_msgpack_packer_get(mrb, packer_obj);
+  packer->codec = ctx;
+  packer->compressor.reset(new mrb_msgpack_compress_sink(mrb, algorithm, &packer->sink));
+
+  mrb_msgpack_packer_write(mrb, packer_obj, object);
+  return mrb_msgpack_packer_to_s(mrb, packer_obj);
+}
+
+/* ------------------------------------------------------------------------
+ * Schema: packers compiled for records of a fixed shape
+ * ------------------------------------------------------------------------ */
+
+/* A field's hint names the type its values usually have, a value of that
+ * type skips the dispatch in mrb_msgpack_pack_value, any other falls back to it. */
+enum mrb_msgpack_schema_hint : uint8_t {
+  MRB_MSGPACK_HINT_ANY,
+  MRB_MSGPACK_HINT_INTEGER,
+  MRB_MSGPACK_HINT_FLOAT,
+  MRB_MSGPACK_HINT_STRING,
+  MRB_MSGPACK_HINT_ARRAY,
+  MRB_MSGPACK_HINT_HASH,
+};
+
+/* The keys are packed once when compiling, the key objects are kept alive
+ * by the keys ivar. */
+struct mrb_msgpack_schema {
+  struct field {
+    mrb_value key;
+    size_t off, len; /* of its packed bytes in keys */
+    mrb_msgpack_schema_hint hint;
+  };
+
+  std::vector<field> fields;
+  std::string keys;
+  mrb_msgpack_ctx *codec = nullptr; /* nullptr packs with the default codec */
+  /* the symbol strategy Symbol keys were packed with */
+  bool has_symbols = false;
+  void (*sym_packer)(mrb_state*, mrb_value, int8_t, msgpack::packer<mrb_msgpack_sbo_writer>&) = nullptr;
+  int8_t sym_ext_type = 0;
+};
+
+MRB_CPP_DEFINE_TYPE(mrb_msgpack_schema, mrb_msgpack_schema)
+
+static mrb_msgpack_schema*
+mrb_msgpack_schema_get(mrb_state *mrb, mrb_value self)
+{
+  auto* schema = mrb_cpp_get<mrb_msgpack_schema>(mrb, self);
+  if (unlikely(!schema)) {
+    mrb_raise(mrb, E_MSGPACK_ERROR, "Schema is not initialized");
+  }
+  return schema;
+}
+
+/* compares without hashing, keys of a schema are Strings, Symbols or Integers */
+static inline bool
+mrb_msgpack_schema_key_eq(mrb_value a, mrb_value b)
+{
+  if (mrb_type(a) != mrb_type(b)) return false;
+  switch (mrb_type(a)) {
+    case MRB_TT_STRING:
+      return RSTRING_LEN(a) == RSTRING_LEN(b) &&
+             std::memcmp(RSTRING_PTR(a), RSTRING_PTR(b), RSTRING_LEN(a)) == 0;
+    case MRB_TT_SYMBOL:
+      return mrb_symbol(a) == mrb_symbol(b);
+    case MRB_TT_INTEGER:
+      return mrb_integer(a) == mrb_integer(b);
+    default:
+      return false;
+  }
+}
+
+static void
+mrb_msgpack_schema_pack_field(mrb_state *mrb, mrb_msgpack_ctx *ctx, mrb_msgpack_schema_hint hint,
+                              mrb_value v, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+{
+  switch (hint) {
+    case MRB_MSGPACK_HINT_INTEGER:
+      if (mrb_integer_p(v)) return mrb_msgpack_pack_integer_value(mrb, v, pk);
+      break;
+#ifndef MRB_WITHOUT_FLOAT
+    case MRB_MSGPACK_HINT_FLOAT:
+      if (mrb_float_p(v)) return mrb_msgpack_pack_float_value(mrb, v, pk);
+      break;
+#endif
+    case MRB_MSGPACK_HINT_STRING:
+      if (mrb_string_p(v)) return mrb_msgpack_pack_string_value(mrb, v, pk);
+      break;
+    case MRB_MSGPACK_HINT_ARRAY:
+      if (mrb_array_p(v)) return mrb_msgpack_pack_array_value(mrb, ctx, v, pk);
+      break;
+    case MRB_MSGPACK_HINT_HASH:
+      if (mrb_hash_p(v)) return mrb_msgpack_pack_hash_value(mrb, ctx, v, pk);
+      break;
+    default:
+      break;
+  }
+  mrb_msgpack_pack_value(mrb, ctx, v, pk);
+}
+
+/* Records with exactly the schema's keys get the packed keys, in the
+ * schema's order. Anything else is packed as usual. */
+static void
+mrb_msgpack_schema_pack_record(mrb_state *mrb, const mrb_msgpack_schema *schema, mrb_msgpack_ctx *ctx,
+                               mrb_value record, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+{
+  const size_t n = schema->fields.size();
+  if (!mrb_hash_p(record) || static_cast<size_t>(mrb_hash_size(mrb, record)) != n) {
+    mrb_msgpack_pack_value(mrb, ctx, record, pk);
+    return;
+  }
+
+  struct Ctx {
+    const mrb_msgpack_schema *schema;
+    mrb_msgpack_ctx *codec;
+    msgpack::packer<mrb_msgpack_sbo_writer> *pk;
+    mrb_value record;
+    size_t i;
+    bool ordered;
+    mrb_int arena_index;
+  } c{ schema, ctx, &pk, record, 0, true, mrb_gc_arena_save(mrb) };
+
+  /* records built the same way keep their keys in the same order */
+  mrb_hash_foreach(mrb, mrb_hash_ptr(record),
+    [](mrb_state*, mrb_value key, mrb_value, void *p) -> int {
+      Ctx *c = static_cast<Ctx*>(p);
+      c->ordered = mrb_msgpack_schema_key_eq(c->schema->fields[c->i++].key, key);
+      return c->ordered ? 0 : 1;
+    },
+    &c
+  );
+
+  if (c.ordered) {
+    pk.pack_map(static_cast<uint32_t>(n));
+    c.i = 0;
+    mrb_hash_foreach(mrb, mrb_hash_ptr(record),
+      [](mrb_state* mrb, mrb_value key, mrb_value val, void *p) -> int {
+        Ctx *c = static_cast<Ctx*>(p);
+        /* packing a value can run Ruby code which changes the record,
+           from then on its keys don't have to line up with the fields anymore */
+        if (unlikely(c->i >= c->schema->fields.size())) return 1;
+        const auto& f = c->schema->fields[c->i++];
+        if (unlikely(!mrb_msgpack_schema_key_eq(f.key, key))) val = mrb_hash_get(mrb, c->record, f.key);
+        c->pk->pack_bin_body(c->schema->keys.data() + f.off, static_cast<uint32_t>(f.len));
+        mrb_msgpack_schema_pack_field(mrb, c->codec, f.hint, val, *c->pk);
+        mrb_gc_arena_restore(mrb, c->arena_index);
+        return 0;
+      },
+      &c
+    );
+    /* the header promised n pairs, fields of a record that shrank meanwhile are looked up */
+    for (; c.i < n; ++c.i) {
+      const auto& f = schema->fields[c.i];
+      pk.pack_bin_body(schema->keys.data() + f.off, static_cast<uint32_t>(f.len));
+      mrb_msgpack_schema_pack_field(mrb, ctx, f.hint, mrb_hash_get(mrb, record, f.key), pk);
+      mrb_gc_arena_restore(mrb, c.arena_index);
+    }
+    return;
+  }
+
+  for (const auto& f : schema->fields) {
+    if (!mrb_hash_key_p(mrb, record, f.key)) {
+      mrb_msgpack_pack_value(mrb, ctx, record, pk);
+      return;
+    }
+  }
+
+  pk.pack_map(static_cast<uint32_t>(n));
+  for (const auto& f : schema->fields) {
+    pk.pack_bin_body(schema->keys.data() + f.off, static_cast<uint32_t>(f.len));
+    mrb_msgpack_schema_pack_field(mrb, ctx, f.hint, mrb_hash_get(mrb, record, f.key), pk);
+    mrb_gc_arena_restore(mrb, c.arena_index);
+  }
+}
+
+static mrb_msgpack_schema_hint
+mrb_msgpack_schema_hint_get(mrb_state *mrb, mrb_value hint)
+{
+  if (mrb_nil_p(hint)) return MRB_MSGPACK_HINT_ANY;
+  if (mrb_symbol_p(hint)) {
+    switch (mrb_symbol(hint)) {
+      case MRB_SYM(any):     return MRB_MSGPACK_HINT_ANY;
+      case MRB_SYM(integer): return MRB_MSGPACK_HINT_INTEGER;
+      case MRB_SYM(float):   return MRB_MSGPACK_HINT_FLOAT;
+      case MRB_SYM(string):  return MRB_MSGPACK_HINT_STRING;
+      case MRB_SYM(array):   return MRB_MSGPACK_HINT_ARRAY;
+      case MRB_SYM(hash):    return MRB_MSGPACK_HINT_HASH;
+      default: break;
+    }
+  }
+  mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown type hint %!v", hint);
+  return MRB_MSGPACK_HINT_ANY;
+}
+
+/* packs the keys with the codec's current symbol strategy */
+static void
+mrb_msgpack_schema_pack_keys(mrb_state *mrb, mrb_msgpack_schema *schema, mrb_msgpack_ctx *ctx)
+{
+  std::string keys;
+  for (auto& f : schema->fields) {
+    mrb_msgpack_sbo_writer writer(mrb);
+    msgpack::packer<mrb_msgpack_sbo_writer> pk(writer);
+    mrb_msgpack_pack_value(mrb, ctx, f.key, pk);
+    mrb_value packed = writer.result();
+
+    f.off = keys.size();
+    f.len = static_cast<size_t>(RSTRING_LEN(packed));
+    keys.append(RSTRING_PTR(packed), f.len);
+  }
+  schema->keys.swap(keys);
+  schema->sym_packer   = ctx->sym_packer;
+  schema->sym_ext_type = ctx->ext_type;
+}
+
+/* the codec used to pack with, Symbol keys are packed again after its symbol strategy changed */
+static mrb_msgpack_ctx*
+mrb_msgpack_schema_codec(mrb_state *mrb, mrb_msgpack_schema *schema)
+{
+  mrb_msgpack_ctx *ctx = schema->codec ? schema->codec : MRB_MSGPACK_CONTEXT(mrb);
+  if (unlikely(schema->has_symbols &&
+               (schema->sym_packer != ctx->sym_packer || schema->sym_ext_type != ctx->ext_type))) {
+    mrb_msgpack_schema_pack_keys(mrb, schema, ctx);
+  }
+  return ctx;
+}
+
+/* fields: an Array of keys or a Hash of key => type hint */
+static void
+mrb_msgpack_schema_init(mrb_state *mrb, mrb_value self, mrb_value fields, mrb_value codec)
+{
+  mrb_value keys, hints = mrb_nil_value();
+  if (mrb_hash_p(fields)) {
+    keys  = mrb_hash_keys(mrb, fields);
+    hints = fields;
+  } else if (mrb_array_p(fields)) {
+    keys = mrb_ary_new_from_values(mrb, RARRAY_LEN(fields), RARRAY_PTR(fields));
+  } else {
+    mrb_raise(mrb, E_TYPE_ERROR, "schema must be an Array of keys or a Hash of key => type hint");
+  }
+  if (unlikely(RARRAY_LEN(keys) == 0)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "a schema needs at least one key");
+  }
+
+  auto* schema = mrb_cpp_new<mrb_msgpack_schema>(mrb, self);
+  if (!mrb_nil_p(codec)) {
+    schema->codec = mrb_msgpack_codec_get(mrb, codec);
+    mrb_iv_set(mrb, self, MRB_SYM(codec), codec);
+  }
+
+  for (mrb_int i = 0; i < RARRAY_LEN(keys); ++i) {
+    mrb_value key = RARRAY_PTR(keys)[i];
+    if (mrb_string_p(key)) {
+      key = mrb_obj_freeze(mrb, mrb_str_dup(mrb, key));
+      mrb_ary_set(mrb, keys, i, key);
+    } else if (unlikely(!mrb_symbol_p(key) && !mrb_integer_p(key))) {
+      mrb_raise(mrb, E_TYPE_ERROR, "schema keys must be Strings, Symbols or Integers");
+    }
+    for (const auto& f : schema->fields) {
+      if (unlikely(mrb_msgpack_schema_key_eq(f.key, key))) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR, "duplicate schema key %!v", key);
+      }
+    }
+
+    mrb_msgpack_schema::field f;
+    f.key  = key;
+    f.hint = mrb_nil_p(hints) ? MRB_MSGPACK_HINT_ANY
+                              : mrb_msgpack_schema_hint_get(mrb, mrb_hash_get(mrb, hints, RARRAY_PTR(keys)[i]));
+    schema->has_symbols = schema->has_symbols || mrb_symbol_p(key);
+    schema->fields.push_back(f);
+  }
+  mrb_iv_set(mrb, self, MRB_SYM(keys), mrb_obj_freeze(mrb, keys));
+  mrb_msgpack_schema_pack_keys(mrb, schema, schema->codec ? schema->codec : MRB_MSGPACK_CONTEXT(mrb));
+}
+
+static mrb_value
+mrb_msgpack_schema_initialize(mrb_state *mrb, mrb_value self)
+{
+  mrb_value fields;
+  mrb_sym kw_names[] = { MRB_SYM(codec) };
+  mrb_value kw_values[1];
+  mrb_kwargs kwargs = { 1, 0, kw_names, kw_values, NULL };
+  mrb_get_args(mrb, "o:", &fields, &kwargs);
+
+  mrb_msgpack_schema_init(mrb, self, fields, mrb_undef_p(kw_values[0]) ? mrb_nil_value() : kw_values[0]);
+  return self;
+}
+
+static mrb_value
+mrb_msgpack_schema_pack(mrb_state *mrb, mrb_value self)
+{
+  mrb_value record;
+  mrb_get_args(mrb, "o", &record);
+  mrb_msgpack_schema* schema = mrb_msgpack_schema_get(mrb, self);
+
+  mrb_msgpack_sbo_writer writer(mrb);
+  msgpack::packer<mrb_msgpack_sbo_writer> pk(writer);
+  mrb_msgpack_schema_pack_record(mrb, schema, mrb_msgpack_schema_codec(mrb, schema), record, pk);
+  return writer.result();
+}
+
+/* packs an Array of records */
+static mrb_value
+mrb_msgpack_schema_pack_array(mrb_state *mrb, mrb_value self)
+{
+  mrb_value records;
+  mrb_get_args(mrb, "A", &records);
+  mrb_msgpack_schema* schema = mrb_msgpack_schema_get(mrb, self);
+  mrb_msgpack_ctx *ctx = mrb_msgpack_schema_codec(mrb, schema);
+
+  mrb_msgpack_sbo_writer writer(mrb);
+  msgpack::packer<mrb_msgpack_sbo_writer> pk(writer);
+  mrb_int n = RARRAY_LEN(records);
+  pk.pack_array(static_cast<uint32_t>(n));
+  for (mrb_int i = 0; i < n; ++i) {
+    /* packing a record can run Ruby code which shrinks the Array */
+    mrb_msgpack_schema_pack_record(mrb, schema, ctx, mrb_ary_ref(mrb, records, i), pk);
+  }
+  return writer.result();
+}
+
+static mrb_value
+mrb_msgpack_schema_keys(mrb_state *mrb, mrb_value self)
+{
+  mrb_msgpack_schema_get(mrb, self);
+  return mrb_iv_get(mrb, self, MRB_SYM(keys));
+}
+
+/* ------------------------------------------------------------------------
+ * Packable classes: objects packed straight from their instance variables
+ * ------------------------------------------------------------------------ */
+
+static void
+mrb_msgpack_pack_packable_fields(mrb_state *mrb, mrb_msgpack_ctx *ctx, const mrb_msgpack_packable *p,
+                                 mrb_value obj, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+{
+  const size_t n = p->ivars.size();
+  if (p->as_array) {
+    pk.pack_array(static_cast<uint32_t>(n));
+  } else {
+    pk.pack_map(static_cast<uint32_t>(n));
+  }
+
+  mrb_int arena_index = mrb_gc_arena_save(mrb);
+  size_t key_start = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (!p->as_array) {
+      pk.pack_bin_body(p->keys.data() + key_start, static_cast<uint32_t>(p->key_ends[i] - key_start));
+    }
+    key_start = p->key_ends[i];
+    mrb_msgpack_pack_value(mrb, ctx, mrb_iv_get(mrb, obj, p->ivars[i]), pk);
+    mrb_gc_arena_restore(mrb, arena_index);
+  }
+}
+
+/* false when a field reaches Ruby code, see mrb_msgpack_size_walk */
+static bool
+mrb_msgpack_packable_fields_size(mrb_state *mrb, mrb_msgpack_ctx *ctx, const mrb_msgpack_packable *p,
+                                 mrb_value obj, size_t& size)
+{
+  mrb_msgpack_size_sink sink;
+  mrb_msgpack_sbo_writer writer(mrb, &sink);
+  msgpack::packer<mrb_msgpack_sbo_writer> pk(writer);
+
+  const size_t n = p->ivars.size();
+  if (p->as_array) {
+    pk.pack_array(static_cast<uint32_t>(n));
+  } else {
+    pk.pack_map(static_cast<uint32_t>(n));
+    sink.size += p->keys.size();
+  }
+  for (size_t i = 0; i < n; ++i) {
+    if (!mrb_msgpack_size_walk(mrb, ctx, mrb_iv_get(mrb, obj, p->ivars[i]), pk, 1)) return false;
+  }
+  size = sink.size;
+  return true;
+}
+
+/* Only instances of the registered class itself, subclasses may have ivars
+ * of their own and go through the ext packers as usual. */
+static bool
+mrb_msgpack_pack_packable(mrb_state* mrb, mrb_msgpack_ctx* ctx, mrb_value obj, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+{
+  const mrb_msgpack_packable *const *found = ctx->packable_index.find(mrb_obj_class(mrb, obj));
+  if (!found) return false;
+  const mrb_msgpack_packable *p = *found;
+
+  if (p->type < 0) {
+    mrb_msgpack_pack_packable_fields(mrb, ctx, p, obj, pk);
+    return true;
+  }
+
+  /* the ext header needs the size of the body up front */
+  size_t size;
+  if (likely(mrb_msgpack_packable_fields_size(mrb, ctx, p, obj, size))) {
+    pk.pack_ext(size, static_cast<int8_t>(p->type));
+    mrb_msgpack_pack_packable_fields(mrb, ctx, p, obj, pk);
+    return true;
+  }
+
+  /* a field runs Ruby code when packed, it's packed once into a buffer */
+  mrb_int arena_index = mrb_gc_arena_save(mrb);
+  mrb_msgpack_sbo_writer writer(mrb);
+  msgpack::packer<mrb_msgpack_sbo_writer> body(writer);
+  mrb_msgpack_pack_packable_fields(mrb, ctx, p, obj, body);
+  mrb_value packed = writer.result();
+
+  pk.pack_ext(static_cast<uint32_t>(RSTRING_LEN(packed)), static_cast<int8_t>(p->type));
+  pk.pack_ext_body(RSTRING_PTR(packed), static_cast<size_t>(RSTRING_LEN(packed)));
+  mrb_gc_arena_restore(mrb, arena_index);
+  return true;
+}
+
+static void
+mrb_msgpack_ctx_set_packable(mrb_state *mrb, mrb_msgpack_ctx *ctx, std::unique_ptr<mrb_msgpack_packable> p)
+{
+  const mrb_msgpack_packable *const *found = ctx->packable_index.find(p->klass);
+  const mrb_msgpack_packable *old = found ? *found : nullptr;
+
+  if (p->type >= 0) {
+    if (ctx->ext_unpackers[p->type]) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "ext type %d has an ext unpacker registered", (int)p->type);
+    }
+    if (ctx->sym_unpacker != nullptr && p->type == ctx->ext_type) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "ext type %d is used by the symbol strategy", (int)p->type);
+    }
+    const mrb_msgpack_packable *other = ctx->packable_types[p->type];
+    if (other && other != old) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "ext type %d is used by %!v",
+                 (int)p->type, mrb_obj_value(other->klass));
+    }
+  }
+  if (unlikely(!old && !ctx->packable_index.insert(p->klass, nullptr))) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "too many packable classes");
+  }
+
+  if (old && old->type >= 0) ctx->packable_types[old->type] = nullptr;
+  if (p->type >= 0) ctx->packable_types[p->type] = p.get();
+  ctx->packable_index.insert(p->klass, p.get());
+  mrb_ary_push(mrb, mrb_iv_get(mrb, mrb_obj_value(ctx->owner), MRB_SYM(packables)), mrb_obj_value(p->klass));
+  ctx->packables.push_back(std::move(p));
+}
+
+/* packable(klass, *ivars, as: :map, type: nil), the ivars may be given with or without their @ */
+static mrb_value
+mrb_msgpack_packable_in(mrb_state *mrb, mrb_msgpack_ctx *ctx)
+{
+  mrb_value klass;
+  const mrb_value *ivars;
+  mrb_int ivars_len;
+  mrb_sym kw_names[] = { MRB_SYM(as), MRB_SYM(type) };
+  mrb_value kw_values[2];
+  mrb_kwargs kwargs = { 2, 0, kw_names, kw_values, NULL };
+  mrb_get_args(mrb, "C*:", &klass, &ivars, &ivars_len, &kwargs);
+
+  /* "C" accepts Modules too, nothing is ever an instance of one */
+  if (unlikely(mrb_type(klass) != MRB_TT_CLASS)) {
+    mrb_raisef(mrb, E_TYPE_ERROR, "%!v is not a Class", klass);
+  }
+  if (unlikely(ivars_len == 0)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no instance variables given");
+  }
+
+  std::unique_ptr<mrb_msgpack_packable> p(new mrb_msgpack_packable());
+  p->klass    = mrb_class_ptr(klass);
+  p->as_array = false;
+  p->type     = -1;
+
+  if (!mrb_undef_p(kw_values[0]) && !mrb_nil_p(kw_values[0])) {
+    mrb_sym as = mrb_obj_to_sym(mrb, kw_values[0]);
+    if (as == MRB_SYM(array)) {
+      p->as_array = true;
+    } else if (as != MRB_SYM(map)) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "as: must be :map or :array, not %!v", kw_values[0]);
+    }
+  }
+  if (!mrb_undef_p(kw_values[1]) && !mrb_nil_p(kw_values[1])) {
+    mrb_int type = mrb_as_int(mrb, kw_values[1]);
+    if (type < 0 || type > 127) {
+      mrb_raise(mrb, E_RANGE_ERROR, "ext type must bet between 0 and 127");
+    }
+    /* only plain objects can be allocated when unpacking */
+    if (MRB_INSTANCE_TT(p->klass) != MRB_TT_OBJECT && MRB_INSTANCE_TT(p->klass) != 0) {
+      mrb_raisef(mrb, E_TYPE_ERROR, "cannot unpack instances of %!v", klass);
+    }
+    p->type = static_cast<int16_t>(type);
+  }
+
+  for (mrb_int i = 0; i < ivars_len; ++i) {
+    std::string field;
+    if (mrb_symbol_p(ivars[i])) {
+      mrb_int len;
+      const char *name = mrb_sym_name_len(mrb, mrb_symbol(ivars[i]), &len);
+      field.assign(name, static_cast<size_t>(len));
+    } else if (mrb_string_p(ivars[i])) {
+      field.assign(RSTRING_PTR(ivars[i]), static_cast<size_t>(RSTRING_LEN(ivars[i])));
+    } else {
+      mrb_raise(mrb, E_TYPE_ERROR, "instance variables must be given as Symbols or Strings");
+    }
+    if (!field.empty() && field[0] == '@') field.erase(0, 1);
+    if (unlikely(field.empty() || field[0] == '@')) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid instance variable name %!v", ivars[i]);
+    }
+    if (unlikely(std::find(p->names.begin(), p->names.end(), field) != p->names.end())) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "duplicate instance variable %!v", ivars[i]);
+    }
+
+    std::string ivar = "@" + field;
+    p->ivars.push_back(mrb_intern(mrb, ivar.data(), ivar.size()));
+
+    mrb_msgpack_sbo_writer writer(mrb);
+    msgpack::packer<mrb_msgpack_sbo_writer> pk(writer);
+    pk.pack_str(static_cast<uint32_t>(field.size()));
+    pk.pack_str_body(field.data(), static_cast<uint32_t>(field.size()));
+    mrb_value packed = writer.result();
+    p->keys.append(RSTRING_PTR(packed), static_cast<size_t>(RSTRING_LEN(packed)));
+    p->key_ends.push_back(p->keys.size());
+    p->names.push_back(std::move(field));
+  }
+
+  mrb_msgpack_ctx_set_packable(mrb, ctx, std::move(p));
+  return klass;
+}
+
+static mrb_value
+mrb_msgpack_packable_m(mrb_state *mrb, mrb_value self)
+{
+  return mrb_msgpack_packable_in(mrb, mrb_msgpack_codec_get(mrb, ensure_msgpack_ctx(mrb)));
+}
+
+static mrb_value
+mrb_msgpack_codec_packable_m(mrb_state *mrb, mrb_value self)
+{
+  mrb_msgpack_packable_in(mrb, mrb_msgpack_codec_get(mrb, self));
+  return self;
+}
+
+/* ------------------------------------------------------------------------
+ * Ext packer registration
+ * ------------------------------------------------------------------------ */
+
+static mrb_value
+mrb_msgpack_register_pack_type(mrb_state* mrb, mrb_value self)
+{
+  mrb_int type;
+  mrb_value mrb_class;
+  mrb_value block = mrb_nil_value();
+
+  mrb_get_args(mrb, "iC&", &type, &mrb_class, &block);
+
+  mrb_msgpack_codec_register_pack_type(mrb, mrb_msgpack_codec_get(mrb, ensure_msgpack_ctx(mrb)), type, mrb_class, block);
+
+  return mrb_nil_value();
+}
+
+static mrb_value
+mrb_msgpack_codec_register_pack_type_m(mrb_state* mrb, mrb_value self)
+{
+  mrb_int type;
+  mrb_value mrb_class;
+  mrb_value block = mrb_nil_value();
+
+  mrb_get_args(mrb, "iC&", &type, &mrb_class, &block);
+
+  mrb_msgpack_codec_register_pack_type(mrb, mrb_msgpack_codec_get(mrb, self), type, mrb_class, block);
+
+  return self;
+}
+
+static mrb_value
+mrb_msgpack_ext_packer_registered_in(mrb_state *mrb, mrb_msgpack_ctx *ctx)
+{
+  struct RClass *klass;
+  mrb_get_args(mrb, "c", &klass);
+
+  for (const auto& ext : ctx->ext_packers) {
+    if (ext.klass == klass) return mrb_true_value();
+  }
+  return mrb_false_value();
+}
+
+static mrb_value
+mrb_msgpack_ext_packer_registered(mrb_state *mrb, mrb_value self)
+{
+  return mrb_msgpack_ext_packer_registered_in(mrb, MRB_MSGPACK_CONTEXT(mrb));
+}
+
+static mrb_value
+mrb_msgpack_codec_ext_packer_registered(mrb_state *mrb, mrb_value self)
+{
+  return mrb_msgpack_ext_packer_registered_in(mrb, mrb_msgpack_codec_get(mrb, self));
+}
+
+/* ------------------------------------------------------------------------
+ * Symbol unpack strategies
+ * ------------------------------------------------------------------------ */
+
+static inline mrb_value
+mrb_msgpack_unpack_symbol_as_int(mrb_state* mrb, const char* body, uint32_t size)
+{
+  if (unlikely(size != sizeof(mrb_sym))) {
+    mrb_raise(mrb, E_MSGPACK_ERROR, "invalid symbol ext body size");
+  }
+
+  mrb_sym sym;
+  std::memcpy(&sym, body, sizeof(sym));
+  return mrb_symbol_value(sym);
+}
+
+static inline mrb_value
+mrb_msgpack_unpack_symbol_as_string(mrb_state* mrb, const char* body, uint32_t size)
+{
+  return mrb_symbol_value(
+    mrb_intern(mrb, body, (size_t)size)
+  );
+}
+
+static mrb_value
+mrb_msgpack_unpack_timestamp(mrb_state* mrb, const char* p, uint32_t size)
+{
+  switch (size) {
+    case 4: {
+      uint32_t sec =
+        ((uint32_t)(uint8_t)p[0] << 24) |
+        ((uint32_t)(uint8_t)p[1] << 16) |
+        ((uint32_t)(uint8_t)p[2] << 8)  |
+        ((uint32_t)(uint8_t)p[3]);
+      return mrb_time_at(mrb, (time_t)sec, 0, MRB_TIMEZONE_UTC);
+    }
+
+    case 8: {
+      uint64_t v = 0;
+      for (int i = 0; i < 8; ++i) v = (v << 8) | (uint8_t)p[i];
+
+      // top 30 bits = nanoseconds
+      uint32_t nsec = (v >> 34) & 0x3fffffff;  // mask top 30 bits
+      uint64_t sec  = v & 0x3ffffffff;          // mask lower 34 bits
+
+      return mrb_time_at(mrb, (time_t)sec, (time_t)(nsec / 1000), MRB_TIMEZONE_UTC);
+    }
+
+    case 12: {
+      uint32_t nsec =
+        ((uint32_t)(uint8_t)p[0] << 24) |
+        ((uint32_t)(uint8_t)p[1] << 16) |
+        ((uint32_t)(uint8_t)p[2] << 8)  |
+        ((uint32_t)(uint8_t)p[3]);
+
+      uint64_t sec = 0;
+      for (int i = 4; i < 12; ++i) sec = (sec << 8) | (uint8_t)p[i];
+
+      return mrb_time_at(mrb, (time_t)(int64_t)sec, (time_t)(nsec / 1000), MRB_TIMEZONE_UTC);
+    }
+
+    default:
+      mrb_raise(mrb, E_MSGPACK_ERROR, "invalid timestamp ext length");
+  }
+}
+
+
+/* ------------------------------------------------------------------------
+ * Core unpack dispatch
+ * ------------------------------------------------------------------------ */
+
+static mrb_value
+mrb_msgpack_unpack_ext(mrb_state* mrb, mrb_msgpack_ctx* ctx, int8_t ext_type, const char* body, uint32_t size)
+{
+  if (ext_type == -1) {
+    return mrb_msgpack_unpack_timestamp(mrb, body, size);
+  }
+  if (ctx->sym_unpacker != nullptr && ext_type == ctx->ext_type) {
+    return ctx->sym_unpacker(mrb, body, size);
+  }
+  if (ext_type >= 0 && ctx->packable_types[ext_type]) {
+    return mrb_msgpack_unpack_packable(mrb, ctx, ctx->packable_types[ext_type], body, size);
+  }
+  struct RProc *unpacker = ext_type >= 0 ? ctx->ext_unpackers[ext_type] : nullptr;
+
+  if (likely(unpacker != nullptr)) {
+    return mrb_yield(
+      mrb,
+      mrb_obj_value(unpacker),
+      mrb_str_new(mrb, body, size)
+    );
+  }
+  else {
+    mrb_raisef(mrb, E_MSGPACK_ERROR, "Cannot unpack ext type %d", ext_type);
+  }
+
+  return mrb_undef_value();
 }
 
-static inline void
-mrb_msgpack_pack_symbol_value_as_raw(mrb_state* mrb,
-                                     mrb_value self,
-                                     int8_t /*ext_type unused*/,
-                                     msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+static inline mrb_value
+mrb_msgpack_unpack_bytes(mrb_state* mrb, const mrb_msgpack_unpack_opts& opts, const char* ptr, uint32_t size)
 {
-  mrb_sym sym = mrb_symbol(self);
+  if (opts.src && size >= opts.zero_copy_min &&
+      ptr >= opts.src && static_cast<size_t>(ptr - opts.src) + size <= opts.src_len) {
+    return mrb_str_byte_subseq(mrb, opts.src_str, (mrb_int)(ptr - opts.src), (mrb_int)size);
+  }
+  return mrb_str_new(mrb, ptr, size);
+}
 
-  mrb_int len;
-  const char* name = mrb_sym_name_len(mrb, sym, &len);
+/* Appends to an Array created with mrb_ary_new_capa, skipping what
+ * mrb_ary_push checks for Arrays that could be shared or frozen. */
+static inline void
+mrb_msgpack_ary_append(mrb_state* mrb, mrb_value ary, mrb_value v)
+{
+  struct RArray* a = mrb_ary_ptr(ary);
+  mrb_int len = ARY_LEN(a);
+  if (unlikely(len >= ARY_CAPA(a))) {
+    mrb_ary_push(mrb, ary, v);
+    return;
+  }
+  ARY_PTR(a)[len] = v;
+  ARY_SET_LEN(a, len + 1);
+  if (!mrb_immediate_p(v)) mrb_field_write_barrier_value(mrb, (struct RBasic*)a, v);
+}
 
-  pk.pack_str(static_cast<uint32_t>(len));
-  pk.pack_str_body(name, static_cast<size_t>(len));
+static inline bool
+mrb_msgpack_numeric_type_p(msgpack::type::object_type type)
+{
+  return type == msgpack::type::POSITIVE_INTEGER || type == msgpack::type::NEGATIVE_INTEGER ||
+         type == msgpack::type::FLOAT32 || type == msgpack::type::FLOAT64;
 }
 
-/* ------------------------------------------------------------------------
- * Ext packer config lookup
- * ------------------------------------------------------------------------ */
+static inline mrb_value
+mrb_msgpack_unpack_number(mrb_state* mrb, const msgpack::object& obj)
+{
+  switch (obj.type) {
+    case msgpack::type::POSITIVE_INTEGER: return mrb_convert_number(mrb, obj.via.u64);
+    case msgpack::type::NEGATIVE_INTEGER: return mrb_convert_number(mrb, obj.via.i64);
+    default:                              return mrb_convert_number(mrb, obj.via.f64);
+  }
+}
 
 static mrb_value
-mrb_msgpack_get_ext_config(mrb_state* mrb, mrb_value obj)
+mrb_unpack_msgpack_obj(mrb_state* mrb, const mrb_msgpack_unpack_opts& opts, const msgpack::object& obj)
 {
-  mrb_value ext_packers = ext_packers_hash(mrb);
-  mrb_value obj_class = mrb_obj_value(mrb_obj_class(mrb, obj));
-  mrb_value ext_config = mrb_hash_get(mrb, ext_packers, obj_class);
+  switch (obj.type) {
+    case msgpack::type::NIL:
+      return mrb_nil_value();
+
+    case msgpack::type::BOOLEAN:
+      return mrb_bool_value(obj.via.boolean);
+
+    case msgpack::type::POSITIVE_INTEGER:
+      return mrb_convert_number(mrb, obj.via.u64);
+
+    case msgpack::type::NEGATIVE_INTEGER:
+      return mrb_convert_number(mrb, obj.via.i64);
+
+    case msgpack::type::FLOAT32:
+    case msgpack::type::FLOAT64:
+      return mrb_convert_number(mrb, obj.via.f64);
+
+    case msgpack::type::STR:
+      return mrb_msgpack_unpack_bytes(mrb, opts, obj.via.str.ptr, obj.via.str.size);
 
-  /* Fast path: exact class match */
-  if (mrb_hash_p(ext_config)) {
-    return ext_config;
+    case msgpack::type::BIN:
+      return mrb_msgpack_unpack_bytes(mrb, opts, obj.via.bin.ptr, obj.via.bin.size);
+
+    case msgpack::type::ARRAY:
+      return mrb_unpack_msgpack_obj_array(mrb, opts, obj);
+
+    case msgpack::type::MAP:
+      return mrb_unpack_msgpack_obj_map(mrb, opts, obj);
+
+    case msgpack::type::EXT:
+      return mrb_msgpack_unpack_ext(mrb, opts.ctx, obj.via.ext.type(), obj.via.ext.data(), obj.via.ext.size);
+
+    default:
+      mrb_raise(mrb, E_MSGPACK_ERROR, "Cannot unpack unknown msgpack type");
   }
 
-  struct Ctx {
-    mrb_value obj;
-    mrb_value found;
-  } ctx = { obj, mrb_nil_value() };
-
-  /* Search for a superclass match */
-  mrb_hash_foreach(mrb, mrb_hash_ptr(ext_packers),
-    [](mrb_state* mrb, mrb_value key, mrb_value val, void* data) -> int {
-      auto* c = (Ctx*)data;
-      struct RClass* klass = mrb_class_ptr(key);
-
-      if (mrb_obj_is_kind_of(mrb, c->obj, klass)) {
-        c->found = val;
-        return 1; /* stop */
-      }
+  return mrb_undef_value();
+}
 
-      return 0; /* continue */
-    },
-    &ctx
-  );
+static mrb_value
+mrb_unpack_msgpack_obj_array(mrb_state* mrb, const mrb_msgpack_unpack_opts& opts, const msgpack::object& obj)
+{
+  if (obj.via.array.size == 0) return mrb_ary_new(mrb);
+
+  const msgpack::object* elements = obj.via.array.ptr;
+  const uint32_t n = obj.via.array.size;
+  mrb_value ary = mrb_ary_new_capa(mrb, n);
+  mrb_int arena_index = mrb_gc_arena_save(mrb);
 
-  /* No match found */
-  if (mrb_nil_p(ctx.found)) {
-    return ctx.found;
+  uint32_t numeric = 0;
+  while (numeric < n && mrb_msgpack_numeric_type_p(elements[numeric].type)) ++numeric;
+
+  if (numeric == n) {
+    for (uint32_t i = 0; i < n; i++) {
+      mrb_value v = mrb_msgpack_unpack_number(mrb, elements[i]);
+      mrb_msgpack_ary_append(mrb, ary, v);
+      /* only Bignums and boxed Floats took an arena slot */
+      if (!mrb_immediate_p(v)) mrb_gc_arena_restore(mrb, arena_index);
+    }
+    return ary;
   }
 
-  /* Now safe to cache under concrete class */
-  mrb_hash_set(mrb, ext_packers, obj_class, ctx.found);
+  for (uint32_t i = 0; i < n; i++) {
+    mrb_msgpack_ary_append(mrb, ary, mrb_unpack_msgpack_obj(mrb, opts, elements[i]));
+    mrb_gc_arena_restore(mrb, arena_index);
+  }
 
-  return ctx.found;
+  return ary;
 }
 
-static mrb_bool
-mrb_msgpack_pack_ext_value(mrb_state* mrb, mrb_value obj, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+static mrb_value
+mrb_unpack_msgpack_obj_map(mrb_state* mrb, const mrb_msgpack_unpack_opts& opts, const msgpack::object& obj)
 {
+  if (obj.via.map.size == 0) return mrb_hash_new(mrb);
+
+  mrb_value hash = mrb_hash_new_capa(mrb, obj.via.map.size);
   mrb_int arena_index = mrb_gc_arena_save(mrb);
 
-  mrb_value ext_config = mrb_msgpack_get_ext_config(mrb, obj);
-  if (!mrb_hash_p(ext_config)) {
+  for (uint32_t i = 0; i < obj.via.map.size; i++) {
+    const msgpack::object& k = obj.via.map.ptr[i].key;
+    mrb_value key;
+    if (opts.sym_cache && k.type == msgpack::type::STR) {
+      key = mrb_symbol_value(opts.sym_cache->intern(mrb, k.via.str.ptr, k.via.str.size));
+    } else if (opts.key_table && k.type == msgpack::type::STR) {
+      key = opts.key_table->get(mrb, k.via.str.ptr, k.via.str.size);
+    } else {
+      key = mrb_unpack_msgpack_obj(mrb, opts, k);
+    }
+    mrb_value val = mrb_unpack_msgpack_obj(mrb, opts, obj.via.map.ptr[i].val);
+    mrb_hash_set(mrb, hash, key, val);
     mrb_gc_arena_restore(mrb, arena_index);
-    return FALSE;
   }
 
-  mrb_value packer = mrb_hash_get(mrb, ext_config, mrb_symbol_value(MRB_SYM(packer)));
-  if (unlikely(mrb_type(packer) != MRB_TT_PROC)) {
-    mrb_gc_arena_restore(mrb, arena_index);
-    mrb_raise(mrb, E_TYPE_ERROR, "malformed packer");
+  return hash;
+}
+
+/* ------------------------------------------------------------------------
+ * Direct decoder: builds the mruby values while msgpack-c parses, instead of
+ * materializing a msgpack::object tree in a zone and walking that afterwards
+ * ------------------------------------------------------------------------ */
+
+class mrb_msgpack_decoder : public msgpack::null_visitor {
+public:
+  mrb_msgpack_decoder(mrb_state *mrb, const mrb_msgpack_unpack_opts& opts)
+    : mrb(mrb), opts(opts), roots(mrb_ary_new(mrb)), arena(mrb_gc_arena_save(mrb)) {}
+
+  enum status { DECODED, INSUFFICIENT, FAILED };
+
+  /* decodes the object at off and advances off past it, on FAILED error() tells why */
+  status decode(const char *buf, size_t len, size_t &off) {
+    frames.clear();
+    mrb_ary_clear(mrb, roots);
+    mrb_gc_arena_restore(mrb, arena);
+    result = mrb_nil_value();
+    insufficient = false;
+
+    if (msgpack::parse(buf, len, off, *this)) return DECODED;
+    if (insufficient) return INSUFFICIENT;
+    if (!error_msg) error_msg = "parse error";
+    return FAILED;
   }
 
-  mrb_value packed = mrb_yield(mrb, packer, obj);
-  if (unlikely(!mrb_string_p(packed))) {
-    mrb_gc_arena_restore(mrb, arena_index);
-    mrb_raise(mrb, E_TYPE_ERROR, "no string returned by ext type packer");
+  mrb_value value() const { return result; }
+  const char *error() const { return error_msg; }
+
+  bool visit_nil()                        { return add(mrb_nil_value()); }
+  bool visit_boolean(bool v)              { return add(mrb_bool_value(v)); }
+  bool visit_positive_integer(uint64_t v) { return add_number(mrb_convert_number(mrb, v)); }
+  bool visit_negative_integer(int64_t v)  { return add_number(mrb_convert_number(mrb, v)); }
+  bool visit_float32(float v)             { return add_number(mrb_convert_number(mrb, static_cast<double>(v))); }
+  bool visit_float64(double v)            { return add_number(mrb_convert_number(mrb, v)); }
+
+  bool visit_str(const char *v, uint32_t size) {
+    if (unlikely(size > MSGPACK_STR_LIMIT)) return fail("str size overflow");
+    if (!frames.empty() && frames.back().in_key) {
+      if (opts.sym_cache) return add(mrb_symbol_value(opts.sym_cache->intern(mrb, v, size)));
+      if (opts.key_table) return add(opts.key_table->get(mrb, v, size));
+    }
+    return add(mrb_msgpack_unpack_bytes(mrb, opts, v, size));
   }
 
-  mrb_value type = mrb_hash_get(mrb, ext_config, mrb_symbol_value(MRB_SYM(type)));
-  if (unlikely(!mrb_integer_p(type))) {
-    mrb_gc_arena_restore(mrb, arena_index);
-    mrb_raise(mrb, E_TYPE_ERROR, "malformed type");
+  bool visit_bin(const char *v, uint32_t size) {
+    if (unlikely(size > MSGPACK_BIN_LIMIT)) return fail("bin size overflow");
+    return add(mrb_msgpack_unpack_bytes(mrb, opts, v, size));
   }
 
-  const char* body = RSTRING_PTR(packed);
-  mrb_int len = RSTRING_LEN(packed);
-  mrb_int t = mrb_integer(type);
+  /* v starts with the ext type, size includes it */
+  bool visit_ext(const char *v, uint32_t size) {
+    if (unlikely(size - 1 > MSGPACK_EXT_LIMIT)) return fail("ext size overflow");
+    return add(mrb_msgpack_unpack_ext(mrb, opts.ctx, static_cast<int8_t>(v[0]), v + 1, size - 1));
+  }
 
-  pk.pack_ext(static_cast<uint32_t>(len), static_cast<int8_t>(t));
-  pk.pack_ext_body(body, static_cast<size_t>(len));
+  bool start_array(uint32_t n) {
+    if (unlikely(n > MSGPACK_ARY_LIMIT)) return fail("array size overflow");
+    if (unlikely(frames.size() >= MSGPACK_DEPTH_LIMIT)) return fail("depth size overflow");
+    return push(mrb_ary_new_capa(mrb, n), false);
+  }
 
-  mrb_gc_arena_restore(mrb, arena_index);
-  return TRUE;
+  bool start_map(uint32_t n) {
+    if (unlikely(n > MSGPACK_MAP_LIMIT)) return fail("map size overflow");
+    if (unlikely(frames.size() >= MSGPACK_DEPTH_LIMIT)) return fail("depth size overflow");
+    return push(mrb_hash_new_capa(mrb, n), true);
+  }
+
+  bool start_map_key() { frames.back().in_key = true;  return true; }
+  bool end_map_key()   { frames.back().in_key = false; return true; }
+  bool end_array()     { return pop(); }
+  bool end_map()       { return pop(); }
+
+  void parse_error(size_t, size_t)        { if (!error_msg) error_msg = "parse error"; }
+  void insufficient_bytes(size_t, size_t) { insufficient = true; }
+
+private:
+  struct frame {
+    mrb_value container;
+    bool is_map;
+    bool in_key;
+    mrb_value key;
+  };
+
+  /* Open containers and pending map keys are kept alive by the roots Array,
+     everything else is attached to its container right away, so the arena
+     can be reset after every value. */
+  bool add(mrb_value v) {
+    if (frames.empty()) {
+      result = v;
+      mrb_gc_protect(mrb, v);
+      return true;
+    }
+
+    frame &f = frames.back();
+    if (!f.is_map) {
+      mrb_msgpack_ary_append(mrb, f.container, v);
+    } else if (f.in_key) {
+      f.key = v;
+      mrb_ary_push(mrb, roots, v);
+    } else {
+      mrb_hash_set(mrb, f.container, f.key, v);
+      mrb_ary_pop(mrb, roots);
+    }
+    mrb_gc_arena_restore(mrb, arena);
+    return true;
+  }
+
+  /* Numbers that are immediates go straight into an enclosing Array's
+     backing store, they need neither the arena nor a write barrier. */
+  bool add_number(mrb_value v) {
+    if (likely(mrb_immediate_p(v) && !frames.empty() && !frames.back().is_map)) {
+      struct RArray *a = mrb_ary_ptr(frames.back().container);
+      mrb_int len = ARY_LEN(a);
+      if (likely(len < ARY_CAPA(a))) {
+        ARY_PTR(a)[len] = v;
+        ARY_SET_LEN(a, len + 1);
+        return true;
+      }
+    }
+    return add(v);
+  }
+
+  bool push(mrb_value container, bool is_map) {
+    mrb_ary_push(mrb, roots, container);
+    frames.push_back(frame{ container, is_map, false, mrb_nil_value() });
+    mrb_gc_arena_restore(mrb, arena);
+    return true;
+  }
+
+  bool pop() {
+    frames.pop_back();
+    mrb_value container = mrb_ary_pop(mrb, roots);
+    mrb_gc_protect(mrb, container);
+    return add(container);
+  }
+
+  bool fail(const char *msg) {
+    error_msg = msg;
+    return false;
+  }
+
+  mrb_state *mrb;
+  const mrb_msgpack_unpack_opts& opts;
+  mrb_value roots;
+  int arena;
+  std::vector<frame> frames;
+  mrb_value result = mrb_nil_value();
+  const char *error_msg = nullptr;
+  bool insufficient = false;
+};
+
+/* Finds the end of the next object without building anything */
+struct mrb_msgpack_probe : msgpack::null_visitor {
+  bool insufficient = false;
+  void insufficient_bytes(size_t, size_t) { insufficient = true; }
+};
+
+/* ------------------------------------------------------------------------
+ * Public C unpack API
+ * ------------------------------------------------------------------------ */
+
+/* kw holds the symbolize_keys: and dedup_keys: arguments */
+static mrb_msgpack_unpack_opts
+mrb_msgpack_unpack_opts_new(mrb_state *mrb, mrb_msgpack_ctx *ctx, const mrb_value *kw, mrb_msgpack_key_table *key_table)
+{
+  mrb_msgpack_unpack_opts opts{ ctx, nullptr, nullptr };
+  if (!mrb_undef_p(kw[0]) && mrb_test(kw[0])) {
+    if (!ctx->sym_cache) ctx->sym_cache.reset(new mrb_msgpack_sym_cache());
+    opts.sym_cache = ctx->sym_cache.get();
+  }
+  if (!mrb_undef_p(kw[1]) && mrb_test(kw[1])) {
+    key_table->init(mrb);
+    opts.key_table = key_table;
+  }
+  return opts;
 }
 
 /* ------------------------------------------------------------------------
- * Composite packers (array, hash)
+ * Parallel unpacking of concatenated documents
+ *
+ * Native threads take turns finding where the next batch of documents ends
+ * with the byte level skip scan, then parse their batch into msgpack::object
+ * zones while the next one is scanned. The VM thread converts and yields the
+ * documents in order. Workers stay at most a window of batches ahead, so only
+ * that many zones are alive at once.
  * ------------------------------------------------------------------------ */
 
-static void
-mrb_msgpack_pack_array_value(mrb_state* mrb,
-                             mrb_value self,
-                             msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+#ifndef MRB_MSGPACK_MAX_THREADS
+# define MRB_MSGPACK_MAX_THREADS 256
+#endif
+
+/* documents are handed out in batches of about this many bytes */
+#ifndef MRB_MSGPACK_PARALLEL_BATCH
+# define MRB_MSGPACK_PARALLEL_BATCH (64 * 1024)
+#endif
+
+/* objects are converted before the buffer can go away, the zone can point into it */
+static bool
+mrb_msgpack_reference_buffer(msgpack::type::object_type, std::size_t, void*)
 {
-  mrb_int n = RARRAY_LEN(self);
-  mrb_int arena_index = mrb_gc_arena_save(mrb);
+  return true;
+}
 
-  pk.pack_array(static_cast<uint32_t>(n));
+struct mrb_msgpack_parallel_unpack {
+  /* A run of documents, found and parsed by the thread which claimed it */
+  struct batch {
+    std::vector<size_t> bounds; /* start of every document, then the end of the last one */
+    std::vector<msgpack::object_handle> objects;
+    std::vector<std::string> errors; /* per document, empty when it parsed */
+    const char *scan_error = nullptr; /* why the scan stopped early, nullptr at the end or an incomplete document */
+    bool ready = false;
+  };
+
+  const char *buf;
+  size_t len;
+  const mrb_msgpack_unpack_opts *opts;
+  mrb_value block;
+  unsigned threads;
+  std::deque<batch> batches; /* elements stay put while others are appended */
+
+  std::mutex mutex;
+  std::condition_variable ready_cv, space_cv;
+  size_t scan_off = 0;   /* where the next batch starts */
+  bool scanning = false; /* a thread is looking for the end of the last batch */
+  bool scan_done = false;
+  size_t consumed = 0;   /* batches converted by the VM thread */
+  size_t window = 0;     /* batches found ahead of the VM thread at most */
+  bool stop = false;
+  std::vector<std::thread> workers;
+
+  /* joins the workers however the unpack ends */
+  ~mrb_msgpack_parallel_unpack() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    space_cv.notify_all();
+    for (auto &worker : workers) worker.join();
+  }
 
-  for (mrb_int i = 0; i < n; ++i) {
-    mrb_msgpack_pack_value(mrb,
-                           mrb_ary_ref(mrb, self, i),
-                           pk);
-    mrb_gc_arena_restore(mrb, arena_index);
+  /* Called with the lock held and scanning claimed. Only finding where the
+     batch ends is sequential, the scan skips over strings without reading
+     them and the parsing runs unlocked afterwards, side by side with the
+     scans and parses of the other threads. */
+  batch& scan(std::unique_lock<std::mutex> &lock) {
+    batches.emplace_back();
+    batch &b = batches.back();
+    size_t off = scan_off;
+    lock.unlock();
+
+    b.bounds.push_back(off);
+    bool last = true;
+    while (off < len) {
+      size_t end = off;
+      if (const char *error = mrb_msgpack_raw_skip(buf, len, end)) {
+        /* an incomplete last document is left for the caller like in the sequential mode */
+        if (std::strcmp(error, "insufficient bytes") != 0) b.scan_error = error;
+        break;
+      }
+      off = end;
+      b.bounds.push_back(off);
+      if (off - b.bounds.front() >= MRB_MSGPACK_PARALLEL_BATCH && off < len) {
+        last = false;
+        break;
+      }
+    }
+    b.objects.resize(b.bounds.size() - 1);
+    b.errors.resize(b.bounds.size() - 1);
+
+    lock.lock();
+    scan_off = off;
+    scanning = false;
+    scan_done = last;
+    space_cv.notify_all();
+    ready_cv.notify_all();
+    lock.unlock();
+    return b;
+  }
+
+  void parse(batch &b) {
+    const msgpack::unpack_limit limit(MSGPACK_ARY_LIMIT, MSGPACK_MAP_LIMIT, MSGPACK_STR_LIMIT,
+                                      MSGPACK_BIN_LIMIT, MSGPACK_EXT_LIMIT, MSGPACK_DEPTH_LIMIT);
+    for (size_t i = 0; i < b.objects.size(); ++i) {
+      try {
+        size_t off = b.bounds[i];
+        msgpack::unpack(b.objects[i], buf, b.bounds[i + 1], off, &mrb_msgpack_reference_buffer, nullptr, limit);
+      }
+      catch (const std::exception &e) {
+        b.errors[i] = e.what();
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      b.ready = true;
+    }
+    ready_cv.notify_all();
+  }
+
+  void work() {
+    for (;;) {
+      std::unique_lock<std::mutex> lock(mutex);
+      space_cv.wait(lock, [this] {
+        return stop || scan_done || (!scanning && batches.size() < consumed + window);
+      });
+      if (stop || scan_done) return;
+      scanning = true;
+      parse(scan(lock));
+    }
+  }
+
+  /* Waits for batch k, finds and parses it on the calling thread when no
+     worker is about to. Returns nullptr once there are no more batches. */
+  batch* await(size_t k) {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      if (k < batches.size()) {
+        ready_cv.wait(lock, [this, k] { return batches[k].ready; });
+        return &batches[k];
+      }
+      if (scan_done) return nullptr;
+      if (!scanning) {
+        scanning = true;
+        batch &b = scan(lock);
+        parse(b);
+        return &b;
+      }
+      ready_cv.wait(lock, [this, k] { return k < batches.size() || scan_done || !scanning; });
+    }
   }
+};
+
+static mrb_value
+mrb_msgpack_parallel_unpack_body(mrb_state *mrb, mrb_value arg)
+{
+  auto *p = static_cast<mrb_msgpack_parallel_unpack*>(mrb_cptr(arg));
+  int arena_index = mrb_gc_arena_save(mrb);
+
+  /* the VM thread does whatever no worker picked up, a thread that can't be
+     started just leaves more of the work to it */
+  size_t spawn = std::min<size_t>(p->threads, p->len / MRB_MSGPACK_PARALLEL_BATCH + 1);
+  try {
+    for (size_t i = 0; i < spawn; ++i) p->workers.emplace_back(&mrb_msgpack_parallel_unpack::work, p);
+  }
+  catch (const std::system_error&) {
+  }
+
+  const char *scan_error = nullptr;
+  for (size_t k = 0;; ++k) {
+    mrb_msgpack_parallel_unpack::batch *b = p->await(k);
+    if (!b) break;
+
+    for (size_t i = 0; i < b->objects.size(); ++i) {
+      if (unlikely(!b->errors[i].empty())) {
+        mrb_raisef(mrb, E_MSGPACK_ERROR, "Can't unpack: %S",
+                   mrb_str_new(mrb, b->errors[i].data(), b->errors[i].size()));
+      }
+      mrb_value obj = mrb_unpack_msgpack_obj(mrb, *p->opts, b->objects[i].get());
+      b->objects[i] = msgpack::object_handle(); /* frees the zone */
+      mrb_yield(mrb, p->block, obj);
+      mrb_gc_arena_restore(mrb, arena_index);
+    }
+    scan_error = b->scan_error;
+
+    {
+      std::lock_guard<std::mutex> lock(p->mutex);
+      p->consumed = k + 1;
+    }
+    p->space_cv.notify_all();
+  }
+
+  if (unlikely(scan_error)) {
+    mrb_raisef(mrb, E_MSGPACK_ERROR, "Can't unpack: %S", mrb_str_new_cstr(mrb, scan_error));
+  }
+
+  return mrb_convert_number(mrb, (mrb_int)p->scan_off);
 }
 
-static void
-mrb_msgpack_pack_hash_value(mrb_state* mrb,
-                            mrb_value self,
-                            msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+/* runs however the body ends, the destructor joins the workers */
+static mrb_value
+mrb_msgpack_parallel_unpack_ensure(mrb_state *mrb, mrb_value arg)
 {
-  uint32_t n = static_cast<uint32_t>(mrb_hash_size(mrb, self));
-  pk.pack_map(n);
+  delete static_cast<mrb_msgpack_parallel_unpack*>(mrb_cptr(arg));
+  return mrb_nil_value();
+}
 
-  mrb_int arena_index = mrb_gc_arena_save(mrb);
+/* Yields every complete document of buf like the sequential block form,
+ * returns the offset of the first byte not unpacked. */
+static mrb_value
+mrb_msgpack_unpack_parallel(mrb_state *mrb, const mrb_msgpack_unpack_opts& opts, mrb_value block,
+                            const char *buf, size_t len, unsigned threads)
+{
+  std::unique_ptr<mrb_msgpack_parallel_unpack> state(new mrb_msgpack_parallel_unpack());
+  state->buf = buf;
+  state->len = len;
+  state->opts = &opts;
+  state->block = block;
+  state->threads = threads;
+  state->window = 2 * static_cast<size_t>(threads);
+
+  /* the workers are started by the body, once the ensure owns the state */
+  mrb_value arg = mrb_cptr_value(mrb, state.get());
+  state.release();
+  return mrb_ensure(mrb, mrb_msgpack_parallel_unpack_body, arg, mrb_msgpack_parallel_unpack_ensure, arg);
+}
 
-  struct Ctx {
-    msgpack::packer<mrb_msgpack_sbo_writer>* pk;
-    mrb_int arena_index;
-  } ctx{ &pk, arena_index };
+/* Unpacks the object starting at off of buf */
+static mrb_value
+mrb_msgpack_decode_at(mrb_state *mrb, const mrb_msgpack_unpack_opts& opts, const char *buf, size_t len, size_t off)
+{
+  const char *error = nullptr;
+  mrb_value result = mrb_nil_value();
+  {
+    mrb_msgpack_decoder decoder(mrb, opts);
+    switch (decoder.decode(buf, len, off)) {
+      case mrb_msgpack_decoder::DECODED:      result = decoder.value(); break;
+      case mrb_msgpack_decoder::INSUFFICIENT: error = "insufficient bytes"; break;
+      case mrb_msgpack_decoder::FAILED:       error = decoder.error(); break;
+    }
+  }
+
+  if (unlikely(error)) {
+    mrb_raisef(mrb, E_MSGPACK_ERROR, "Can't unpack: %S", mrb_str_new_cstr(mrb, error));
+  }
+
+  return result;
+}
+
+/* Unpacks one object, or with a block every complete object in data, yielding each.
+ * Returns the object, or with a block the offset of the first byte not unpacked. */
+static mrb_value
+mrb_msgpack_unpack_with(mrb_state *mrb, mrb_msgpack_unpack_opts& opts, mrb_value data, mrb_value block)
+{
+  data = mrb_str_to_str(mrb, data);
+
+  const bool streaming = mrb_type(block) == MRB_TT_PROC;
+  const char* buf = RSTRING_PTR(data);
+  std::size_t len = RSTRING_LEN(data);
+  std::size_t off = 0;
+
+  /* The decoder reads straight from data while ext unpackers or the block may
+     run Ruby code which modifies it. Decoding from a shared copy keeps the
+     bytes in place, sharing can realloc the buffer so it happens up front. */
+  if (opts.zero_copy_min || streaming || opts.ctx->ext_unpacker_count) {
+    opts.src_str = mrb_str_byte_subseq(mrb, data, 0, (mrb_int)len);
+    buf = RSTRING_PTR(opts.src_str);
+    if (opts.zero_copy_min) {
+      opts.src     = buf;
+      opts.src_len = len;
+    }
+  }
+
+  if (!streaming) {
+    return mrb_msgpack_decode_at(mrb, opts, buf, len, off);
+  }
+
+  if (opts.threads > 1) {
+    return mrb_msgpack_unpack_parallel(mrb, opts, block, buf, len, opts.threads);
+  }
+
+  const char *error = nullptr;
+  {
+    mrb_msgpack_decoder decoder(mrb, opts);
+
+    while (off < len) {
+      /* ext unpackers must not see a message that turns out to be incomplete */
+      if (opts.ctx->ext_unpacker_count) {
+        mrb_msgpack_probe probe;
+        size_t end = off;
+        if (!msgpack::parse(buf, len, end, probe) && probe.insufficient) break;
+      }
+
+      size_t next = off;
+      auto status = decoder.decode(buf, len, next);
+      if (status == mrb_msgpack_decoder::INSUFFICIENT) break;
+      if (status == mrb_msgpack_decoder::FAILED) {
+        error = decoder.error();
+        break;
+      }
+      off = next;
+      mrb_yield(mrb, block, decoder.value());
+    }
+  }
 
-  mrb_hash_foreach(mrb, mrb_hash_ptr(self),
-    [](mrb_state* mrb, mrb_value key, mrb_value val, void *p) -> int {
-      Ctx *c = static_cast<Ctx*>(p);
-      mrb_msgpack_pack_value(mrb, key, *c->pk);
-      mrb_msgpack_pack_value(mrb, val, *c->pk);
+  if (unlikely(error)) {
+    mrb_raisef(mrb, E_MSGPACK_ERROR, "Can't unpack: %S", mrb_str_new_cstr(mrb, error));
+  }
 
-      mrb_gc_arena_restore(mrb, c->arena_index);
-      return 0;
-    },
-    &ctx
-  );
+  return mrb_convert_number(mrb, (mrb_int)off);
 }
 
-static void
-mrb_msgpack_pack_time_ext(mrb_state* mrb, mrb_value time, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+/* Decompresses data, which has to consist of whole frames, into one String */
+static mrb_value
+mrb_msgpack_decompress(mrb_state *mrb, mrb_value data)
 {
-    // epoch seconds
-    mrb_int sec_i = mrb_integer(mrb_funcall_argv(mrb, time, MRB_SYM(to_i), 0, nullptr));
-    int64_t sec = (int64_t)sec_i;
+  data = mrb_str_to_str(mrb, data);
+  const size_t len = RSTRING_LEN(data);
+  mrb_msgpack_frame_header h;
+
+  /* sums up the raw sizes first, so the result is allocated once */
+  size_t total = 0;
+  for (size_t off = 0; off < len; off += mrb_msgpack_frame_header::SIZE + h.stored_size) {
+    if (unlikely(!mrb_msgpack_frame_header_at(mrb, RSTRING_PTR(data) + off, len - off, h))) {
+      mrb_raise(mrb, E_MSGPACK_ERROR, "Can't unpack: truncated frame");
+    }
+    total += h.raw_size;
+  }
 
-    // nanoseconds
-    mrb_int nsec_i = mrb_integer(mrb_funcall_argv(mrb, time, MRB_SYM(nsec), 0, nullptr));
-    int64_t nsec = (int64_t)nsec_i;
+  mrb_value out = mrb_str_new_capa(mrb, safe_size_to_mrb_int(mrb, total));
+  const char *src = RSTRING_PTR(data);
+  char *dst = RSTRING_PTR(out);
+  for (size_t off = 0; off < len; off += mrb_msgpack_frame_header::SIZE + h.stored_size) {
+    mrb_msgpack_frame_header_at(mrb, src + off, len - off, h);
+    mrb_msgpack_frame_decompress(mrb, h, src + off + mrb_msgpack_frame_header::SIZE, dst);
+    dst += h.raw_size;
+  }
+  mrb_str_resize(mrb, out, (mrb_int)total);
 
-    // 32‑bit format
-    if (nsec == 0 && sec >= 0 && sec < (1LL << 32)) {
-        char buf[4];
-        buf[0] = (sec >> 24) & 0xFF;
-        buf[1] = (sec >> 16) & 0xFF;
-        buf[2] = (sec >> 8)  & 0xFF;
-        buf[3] =  sec        & 0xFF;
+  return out;
+}
 
-        pk.pack_ext(4, -1);
-        pk.pack_ext_body(buf, 4);
-        return;
-    }
+MRB_API mrb_value
+mrb_msgpack_unpack(mrb_state *mrb, mrb_value data)
+{
+  mrb_msgpack_unpack_opts opts{ MRB_MSGPACK_CONTEXT(mrb), nullptr, nullptr };
+  return mrb_msgpack_unpack_with(mrb, opts, data, mrb_nil_value());
+}
 
-    // 64‑bit format
-    if (sec >= 0 && sec < (1LL << 34) && nsec >= 0 && nsec < 1000000000) {
-        uint64_t v = ((uint64_t)nsec << 34) | (uint64_t)sec;
-        char buf[8];
-        for (int i = 7; i >= 0; --i) { buf[i] = v & 0xFF; v >>= 8; }
+MRB_API mrb_value
+mrb_msgpack_codec_unpack(mrb_state *mrb, mrb_value codec, mrb_value data)
+{
+  mrb_msgpack_unpack_opts opts{ mrb_msgpack_codec_get(mrb, codec), nullptr, nullptr };
+  return mrb_msgpack_unpack_with(mrb, opts, data, mrb_nil_value());
+}
 
-        pk.pack_ext(8, -1);
-        pk.pack_ext_body(buf, 8);
-        return;
+static mrb_value
+mrb_msgpack_unpack_args(mrb_state* mrb, mrb_msgpack_ctx* ctx)
+{
+  mrb_value data, block = mrb_nil_value();
+  mrb_sym kw_names[] = { MRB_SYM(symbolize_keys), MRB_SYM(dedup_keys), MRB_SYM(zero_copy), MRB_SYM(threads),
+                         MRB_SYM(compressed) };
+  mrb_value kw_values[5];
+  mrb_kwargs kwargs = { 5, 0, kw_names, kw_values, NULL };
+  mrb_get_args(mrb, "o:&", &data, &kwargs, &block);
+
+  mrb_msgpack_key_table key_table;
+  mrb_msgpack_unpack_opts opts = mrb_msgpack_unpack_opts_new(mrb, ctx, kw_values, &key_table);
+
+  if (!mrb_undef_p(kw_values[2]) && mrb_test(kw_values[2])) {
+    mrb_int min = MRB_MSGPACK_ZERO_COPY_MIN;
+    if (!mrb_true_p(kw_values[2])) {
+      min = mrb_as_int(mrb, kw_values[2]);
+      if (unlikely(min < 1)) mrb_raise(mrb, E_ARGUMENT_ERROR, "zero_copy threshold must be positive");
     }
+    opts.zero_copy_min = static_cast<size_t>(min);
+  }
 
-    // 96‑bit format
-    char buf[12];
-    buf[0] = (nsec >> 24) & 0xFF;
-    buf[1] = (nsec >> 16) & 0xFF;
-    buf[2] = (nsec >> 8)  & 0xFF;
-    buf[3] =  nsec        & 0xFF;
+  if (!mrb_undef_p(kw_values[3]) && mrb_test(kw_values[3])) {
+    if (unlikely(mrb_nil_p(block))) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "threads: needs a block");
+    }
+    mrb_int threads;
+    if (mrb_true_p(kw_values[3])) {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    } else {
+      threads = mrb_as_int(mrb, kw_values[3]);
+      if (unlikely(threads < 1 || threads > MRB_MSGPACK_MAX_THREADS)) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR, "threads must be between 1 and %d", MRB_MSGPACK_MAX_THREADS);
+      }
+    }
+    opts.threads = static_cast<unsigned>(threads);
+  }
 
-    uint64_t s = (uint64_t)sec;
-    for (int i = 11; i >= 4; --i) { buf[i] = s & 0xFF; s >>= 8; }
+  if (!mrb_undef_p(kw_values[4]) && mrb_test(kw_values[4])) {
+    data = mrb_msgpack_decompress(mrb, data);
+  }
 
-    pk.pack_ext(12, -1);
-    pk.pack_ext_body(buf, 12);
+  return mrb_msgpack_unpack_with(mrb, opts, data, block);
+}
+
+static mrb_value
+mrb_msgpack_unpack_m(mrb_state* mrb, mrb_value self)
+{
+  return mrb_msgpack_unpack_args(mrb, MRB_MSGPACK_CONTEXT(mrb));
 }
 
+static mrb_value
+mrb_msgpack_codec_unpack_m(mrb_state* mrb, mrb_value self)
+{
+  return mrb_msgpack_unpack_args(mrb, mrb_msgpack_codec_get(mrb, self));
+}
 
 /* ------------------------------------------------------------------------
- * Core pack dispatcher
+ * Unpacker: incremental unpacking of a stream
  * ------------------------------------------------------------------------ */
 
-static void
-mrb_msgpack_pack_value(mrb_state* mrb,
-                       mrb_value self,
-                       msgpack::packer<mrb_msgpack_sbo_writer>& pk)
-{
-  switch (mrb_type(self)) {
-    case MRB_TT_FALSE:
-      if (mrb_nil_p(self)) pk.pack_nil();
-      else pk.pack_false();
-      break;
-
-    case MRB_TT_TRUE:
-      pk.pack_true();
-      break;
+/* msgpack::unpacker keeps the bytes fed so far in its own buffer together with
+   the state of a half parsed message, so every byte is parsed exactly once no
+   matter how a message is split up between feeds. */
+struct mrb_msgpack_unpacker {
+  msgpack::unpacker pac;
+  mrb_msgpack_ctx *codec = nullptr; /* nullptr unpacks with the default codec */
+  bool symbolize_keys = false;
+  bool compressed = false;
+  std::string frames; /* with compressed: a frame not fed completely yet */
+
+  mrb_msgpack_unpacker()
+    : pac(&mrb_msgpack_reference_buffer, nullptr,
+          MSGPACK_UNPACKER_INIT_BUFFER_SIZE,
+          msgpack::unpack_limit(MSGPACK_ARY_LIMIT, MSGPACK_MAP_LIMIT, MSGPACK_STR_LIMIT,
+                                MSGPACK_BIN_LIMIT, MSGPACK_EXT_LIMIT, MSGPACK_DEPTH_LIMIT)) {}
+};
 
-#ifndef MRB_WITHOUT_FLOAT
-    case MRB_TT_FLOAT:
-      mrb_msgpack_pack_float_value(mrb, self, pk);
-      break;
-#endif
+MRB_CPP_DEFINE_TYPE(mrb_msgpack_unpacker, mrb_msgpack_unpacker)
 
-    case MRB_TT_INTEGER:
-      mrb_msgpack_pack_integer_value(mrb, self, pk);
-      break;
+static mrb_msgpack_unpacker*
+mrb_msgpack_unpacker_get(mrb_state *mrb, mrb_value self)
+{
+  auto* unpacker = mrb_cpp_get<mrb_msgpack_unpacker>(mrb, self);
+  if (unlikely(!unpacker)) {
+    mrb_raise(mrb, E_MSGPACK_ERROR, "Unpacker is not initialized");
+  }
+  return unpacker;
+}
 
-    case MRB_TT_HASH:
-      mrb_msgpack_pack_hash_value(mrb, self, pk);
-      break;
+MRB_API mrb_value
+mrb_msgpack_unpacker_new(mrb_state *mrb)
+{
+  struct RClass *unpacker_class =
+    mrb_class_get_under_id(mrb, mrb_module_get_id(mrb, MRB_SYM(MessagePack)), MRB_SYM(Unpacker));
+  return mrb_obj_new(mrb, unpacker_class, 0, NULL);
+}
 
-    case MRB_TT_ARRAY:
-      mrb_msgpack_pack_array_value(mrb, self, pk);
-      break;
+static char*
+mrb_msgpack_unpacker_reserve(mrb_state *mrb, mrb_msgpack_unpacker *unpacker, size_t len)
+{
+  try {
+    unpacker->pac.reserve_buffer(len);
+  }
+  catch (const std::exception &e) {
+    mrb_raisef(mrb, E_MSGPACK_ERROR, "Can't feed: %S", mrb_str_new_cstr(mrb, e.what()));
+  }
+  return unpacker->pac.buffer();
+}
 
-    case MRB_TT_STRING:
-      mrb_msgpack_pack_string_value(mrb, self, pk);
-      break;
+/* decompresses every complete frame straight into the unpacker's buffer */
+static void
+mrb_msgpack_unpacker_feed_frames(mrb_state *mrb, mrb_msgpack_unpacker *unpacker, const char *data, size_t len)
+{
+  std::string& frames = unpacker->frames;
+  frames.append(data, len);
+
+  size_t off = 0;
+  mrb_msgpack_frame_header h;
+  while (mrb_msgpack_frame_header_at(mrb, frames.data() + off, frames.size() - off, h)) {
+    char *dst = mrb_msgpack_unpacker_reserve(mrb, unpacker, h.raw_size);
+    mrb_msgpack_frame_decompress(mrb, h, frames.data() + off + mrb_msgpack_frame_header::SIZE, dst);
+    unpacker->pac.buffer_consumed(h.raw_size);
+    off += mrb_msgpack_frame_header::SIZE + h.stored_size;
+  }
+  frames.erase(0, off);
+}
 
-    case MRB_TT_SYMBOL:  {
-      mrb_msgpack_ctx *ctx = MRB_MSGPACK_CONTEXT(mrb);
-      ctx->sym_packer(mrb, self, ctx->ext_type, pk);
-    }  break;
+MRB_API void
+mrb_msgpack_unpacker_feed(mrb_state *mrb, mrb_value self, const char *data, size_t len)
+{
+  mrb_msgpack_unpacker* unpacker = mrb_msgpack_unpacker_get(mrb, self);
+  if (unpacker->compressed) {
+    mrb_msgpack_unpacker_feed_frames(mrb, unpacker, data, len);
+    return;
+  }
 
-    case MRB_TT_DATA: {
-      struct RClass *time_class = mrb_class_get_id(mrb, MRB_SYM(Time));
-      if(mrb_obj_is_kind_of(mrb, self, time_class)) {
-        mrb_msgpack_pack_time_ext(mrb, self, pk);
-        break;
-      } else {
-        goto def;
-      }
-    }
-def:
-    default: {
-      if (mrb_msgpack_pack_ext_value(mrb, self, pk)) break;
+  std::memcpy(mrb_msgpack_unpacker_reserve(mrb, unpacker, len), data, len);
+  unpacker->pac.buffer_consumed(len);
+}
 
-      mrb_value v;
+MRB_API mrb_bool
+mrb_msgpack_unpacker_next(mrb_state *mrb, mrb_value self, mrb_value *object)
+{
+  mrb_msgpack_unpacker* unpacker = mrb_msgpack_unpacker_get(mrb, self);
+  msgpack::object_handle oh;
 
-      v = mrb_type_convert_check(mrb, self, MRB_TT_HASH, MRB_SYM(to_hash));
-      if (mrb_hash_p(v)) {
-        mrb_msgpack_pack_hash_value(mrb, v, pk);
-        break;
-      }
+  try {
+    if (!unpacker->pac.next(oh)) return FALSE;
+  }
+  catch (const std::exception &e) {
+    mrb_raisef(mrb, E_MSGPACK_ERROR, "Can't unpack: %S", mrb_str_new_cstr(mrb, e.what()));
+  }
 
-      v = mrb_type_convert_check(mrb, self, MRB_TT_ARRAY, MRB_SYM(to_ary));
-      if (mrb_array_p(v)) {
-        mrb_msgpack_pack_array_value(mrb, v, pk);
-        break;
-      }
+  mrb_msgpack_unpack_opts opts{ unpacker->codec ? unpacker->codec : MRB_MSGPACK_CONTEXT(mrb), nullptr, nullptr };
+  if (unpacker->symbolize_keys) {
+    if (!opts.ctx->sym_cache) opts.ctx->sym_cache.reset(new mrb_msgpack_sym_cache());
+    opts.sym_cache = opts.ctx->sym_cache.get();
+  }
 
-      v = mrb_type_convert_check(mrb, self, MRB_TT_INTEGER, MRB_SYM(to_int));
-      if (mrb_integer_p(v)) {
-        mrb_msgpack_pack_integer_value(mrb, v, pk);
-        break;
-      }
+  *object = mrb_unpack_msgpack_obj(mrb, opts, oh.get());
+  return TRUE;
+}
 
-      v = mrb_type_convert_check(mrb, self, MRB_TT_STRING, MRB_SYM(to_str));
-      if (mrb_string_p(v)) {
-        mrb_msgpack_pack_string_value(mrb, v, pk);
-        break;
-      }
+MRB_API mrb_int
+mrb_msgpack_unpacker_buffer_size(mrb_state *mrb, mrb_value self)
+{
+  /* the part of a message parsed so far plus the bytes after it */
+  mrb_msgpack_unpacker* unpacker = mrb_msgpack_unpacker_get(mrb, self);
+  return safe_size_to_mrb_int(mrb, unpacker->pac.message_size() + unpacker->frames.size());
+}
 
-      v = mrb_type_convert(mrb, self, MRB_TT_STRING, MRB_SYM(to_s));
-      mrb_msgpack_pack_string_value(mrb, v, pk);
-      break;
-    }
+static mrb_value
+mrb_msgpack_unpacker_initialize(mrb_state *mrb, mrb_value self)
+{
+  mrb_sym kw_names[] = { MRB_SYM(codec), MRB_SYM(symbolize_keys), MRB_SYM(compressed) };
+  mrb_value kw_values[3];
+  mrb_kwargs kwargs = { 3, 0, kw_names, kw_values, NULL };
+  mrb_get_args(mrb, ":", &kwargs);
+
+  mrb_msgpack_ctx* codec = nullptr;
+  if (!mrb_undef_p(kw_values[0]) && !mrb_nil_p(kw_values[0])) {
+    codec = mrb_msgpack_codec_get(mrb, kw_values[0]);
+    mrb_iv_set(mrb, self, MRB_SYM(codec), kw_values[0]);
   }
-}
 
-/* ------------------------------------------------------------------------
- * Ruby-visible pack wrappers
- * ------------------------------------------------------------------------ */
+  auto* unpacker = mrb_cpp_new<mrb_msgpack_unpacker>(mrb, self);
+  unpacker->codec = codec;
+  unpacker->symbolize_keys = !mrb_undef_p(kw_values[1]) && mrb_test(kw_values[1]);
+  unpacker->compressed = !mrb_undef_p(kw_values[2]) && mrb_test(kw_values[2]);
 
-#define DEFINE_MSGPACK_PACKER(FUNC_NAME, PACK_FN)                              \
-static mrb_value                                                               \
-FUNC_NAME(mrb_state* mrb, mrb_value self) {                                    \
-  mrb_msgpack_sbo_writer writer(mrb);                                          \
-  using Packer = msgpack::packer<mrb_msgpack_sbo_writer>;                      \
-  Packer pk(writer);                                                           \
-  PACK_FN(mrb, self, pk);                                                      \
-  return writer.result();                                                      \
+  return self;
 }
 
-/* to_msgpack entrypoints */
-DEFINE_MSGPACK_PACKER(mrb_msgpack_pack_object,  mrb_msgpack_pack_value)
-DEFINE_MSGPACK_PACKER(mrb_msgpack_pack_string,  mrb_msgpack_pack_string_value)
-DEFINE_MSGPACK_PACKER(mrb_msgpack_pack_array,   mrb_msgpack_pack_array_value)
-DEFINE_MSGPACK_PACKER(mrb_msgpack_pack_hash,    mrb_msgpack_pack_hash_value)
-DEFINE_MSGPACK_PACKER(mrb_msgpack_pack_integer, mrb_msgpack_pack_integer_value)
-#ifndef MRB_WITHOUT_FLOAT
-DEFINE_MSGPACK_PACKER(mrb_msgpack_pack_float,   mrb_msgpack_pack_float_value)
-#endif
-
-static inline void
-pack_true_fn(mrb_state*, mrb_value, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+static mrb_value
+mrb_msgpack_unpacker_feed_m(mrb_state *mrb, mrb_value self)
 {
-  pk.pack_true();
+  const char *data;
+  mrb_int len;
+  mrb_get_args(mrb, "s", &data, &len);
+  mrb_msgpack_unpacker_feed(mrb, self, data, static_cast<size_t>(len));
+  return self;
 }
 
-static inline void
-pack_false_fn(mrb_state*, mrb_value, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+static mrb_value
+mrb_msgpack_unpacker_each_m(mrb_state *mrb, mrb_value self)
 {
-  pk.pack_false();
+  mrb_value block;
+  mrb_get_args(mrb, "&!", &block);
+
+  int arena_index = mrb_gc_arena_save(mrb);
+  mrb_value object;
+  while (mrb_msgpack_unpacker_next(mrb, self, &object)) {
+    mrb_yield(mrb, block, object);
+    mrb_gc_arena_restore(mrb, arena_index);
+  }
+
+  return self;
 }
 
-static inline void
-pack_nil_fn(mrb_state*, mrb_value, msgpack::packer<mrb_msgpack_sbo_writer>& pk)
+static mrb_value
+mrb_msgpack_unpacker_buffer_size_m(mrb_state *mrb, mrb_value self)
 {
-  pk.pack_nil();
+  return mrb_int_value(mrb, mrb_msgpack_unpacker_buffer_size(mrb, self));
 }
 
-DEFINE_MSGPACK_PACKER(mrb_msgpack_pack_true,  pack_true_fn)
-DEFINE_MSGPACK_PACKER(mrb_msgpack_pack_false, pack_false_fn)
-DEFINE_MSGPACK_PACKER(mrb_msgpack_pack_nil,   pack_nil_fn)
+static mrb_value
+mrb_msgpack_unpacker_reset_m(mrb_state *mrb, mrb_value self)
+{
+  mrb_msgpack_unpacker* unpacker = mrb_msgpack_unpacker_get(mrb, self);
+  /* drops a half parsed message as well as the bytes not parsed yet */
+  unpacker->pac.reset();
+  unpacker->pac.remove_nonparsed_buffer();
+  unpacker->frames.clear();
+  return self;
+}
 
 /* ------------------------------------------------------------------------
- * Public C pack API
+ * Lazy unpacking / ObjectHandle
+ *
+ * A handle keeps the packed bytes and nothing else up front. Navigating reads
+ * just the headers on the way and skips everything else at the byte level,
+ * the offsets found while doing so are kept per container, so revisiting a
+ * part of the document doesn't scan it again.
  * ------------------------------------------------------------------------ */
 
-MRB_API mrb_value
-mrb_msgpack_pack(mrb_state *mrb, mrb_value object)
-{
-  mrb_msgpack_sbo_writer writer(mrb);
-  msgpack::packer<mrb_msgpack_sbo_writer> pk(writer);
+/* maps with at least this many entries get a hashed key index on first lookup */
+#define MRB_MSGPACK_MAP_INDEX_MIN 16
 
-  mrb_msgpack_pack_value(mrb, object, pk);
+struct mrb_msgpack_raw_header {
+  msgpack::type::object_type type;
+  uint32_t count;  /* elements of an array, pairs of a map */
+  size_t body;     /* offset of the payload or the first element */
+  size_t end;      /* offset after a scalar, same as body for containers */
+};
 
-  return writer.result();
+static inline uint32_t
+mrb_msgpack_load_be(const char *p, size_t width)
+{
+  uint32_t n = 0;
+  for (size_t i = 0; i < width; ++i) n = (n << 8) | static_cast<uint8_t>(p[i]);
+  return n;
 }
 
-MRB_API mrb_value
-mrb_msgpack_pack_argv(mrb_state *mrb, mrb_value *argv, mrb_int argv_len)
+/* reads the header of the object at off, returns why it couldn't or nullptr */
+static const char*
+mrb_msgpack_raw_header_at(const char *buf, size_t len, size_t off, mrb_msgpack_raw_header &h)
 {
-  mrb_msgpack_sbo_writer writer(mrb);
-  msgpack::packer<mrb_msgpack_sbo_writer> pk(writer);
+  if (unlikely(off >= len)) return "insufficient bytes";
+
+  const uint8_t b = static_cast<uint8_t>(buf[off]);
+  size_t p = off + 1;
+  size_t width = 0;    /* bytes of a length field */
+  size_t payload = 0;  /* bytes after the header */
+  h.count = 0;
+
+  if (b <= 0x7f)      { h.type = msgpack::type::POSITIVE_INTEGER; }
+  else if (b <= 0x8f) { h.type = msgpack::type::MAP;   h.count = b & 0x0f; }
+  else if (b <= 0x9f) { h.type = msgpack::type::ARRAY; h.count = b & 0x0f; }
+  else if (b <= 0xbf) { h.type = msgpack::type::STR;   payload = b & 0x1f; }
+  else if (b >= 0xe0) { h.type = msgpack::type::NEGATIVE_INTEGER; }
+  else switch (b) {
+    case 0xc0: h.type = msgpack::type::NIL; break;
+    case 0xc2:
+    case 0xc3: h.type = msgpack::type::BOOLEAN; break;
+    case 0xc4: h.type = msgpack::type::BIN; width = 1; break;
+    case 0xc5: h.type = msgpack::type::BIN; width = 2; break;
+    case 0xc6: h.type = msgpack::type::BIN; width = 4; break;
+    case 0xc7: h.type = msgpack::type::EXT; width = 1; payload = 1; break;
+    case 0xc8: h.type = msgpack::type::EXT; width = 2; payload = 1; break;
+    case 0xc9: h.type = msgpack::type::EXT; width = 4; payload = 1; break;
+    case 0xca: h.type = msgpack::type::FLOAT32; payload = 4; break;
+    case 0xcb: h.type = msgpack::type::FLOAT64; payload = 8; break;
+    case 0xcc: h.type = msgpack::type::POSITIVE_INTEGER; payload = 1; break;
+    case 0xcd: h.type = msgpack::type::POSITIVE_INTEGER; payload = 2; break;
+    case 0xce: h.type = msgpack::type::POSITIVE_INTEGER; payload = 4; break;
+    case 0xcf: h.type = msgpack::type::POSITIVE_INTEGER; payload = 8; break;
+    case 0xd0: h.type = msgpack::type::NEGATIVE_INTEGER; payload = 1; break;
+    case 0xd1: h.type = msgpack::type::NEGATIVE_INTEGER; payload = 2; break;
+    case 0xd2: h.type = msgpack::type::NEGATIVE_INTEGER; payload = 4; break;
+    case 0xd3: h.type = msgpack::type::NEGATIVE_INTEGER; payload = 8; break;
+    case 0xd4: h.type = msgpack::type::EXT; payload = 2;  break;
+    case 0xd5: h.type = msgpack::type::EXT; payload = 3;  break;
+    case 0xd6: h.type = msgpack::type::EXT; payload = 5;  break;
+    case 0xd7: h.type = msgpack::type::EXT; payload = 9;  break;
+    case 0xd8: h.type = msgpack::type::EXT; payload = 17; break;
+    case 0xd9: h.type = msgpack::type::STR; width = 1; break;
+    case 0xda: h.type = msgpack::type::STR; width = 2; break;
+    case 0xdb: h.type = msgpack::type::STR; width = 4; break;
+    case 0xdc: h.type = msgpack::type::ARRAY; width = 2; break;
+    case 0xdd: h.type = msgpack::type::ARRAY; width = 4; break;
+    case 0xde: h.type = msgpack::type::MAP; width = 2; break;
+    case 0xdf: h.type = msgpack::type::MAP; width = 4; break;
+    default: return "parse error"; /* 0xc1 is never used */
+  }
 
-  pk.pack_array(static_cast<uint32_t>(argv_len));
+  if (width) {
+    if (unlikely(len - p < width)) return "insufficient bytes";
+    uint32_t n = mrb_msgpack_load_be(buf + p, width);
+    p += width;
+    if (h.type == msgpack::type::ARRAY || h.type == msgpack::type::MAP) h.count = n;
+    else payload += n;
+  }
 
-  for (mrb_int i = 0; i < argv_len; ++i) {
-    mrb_msgpack_pack_value(mrb, argv[i], pk);
+  h.body = p;
+  if (h.type == msgpack::type::ARRAY || h.type == msgpack::type::MAP) {
+    h.end = p;
+    return nullptr;
   }
 
-  return writer.result();
+  if (unlikely(len - p < payload)) return "insufficient bytes";
+  h.end = p + payload;
+  return nullptr;
 }
 
-static mrb_value
-mrb_msgpack_pack_m(mrb_state *mrb, mrb_value self)
+/* advances off past the object starting there, without recursion */
+static const char*
+mrb_msgpack_raw_skip(const char *buf, size_t len, size_t &off)
 {
-  mrb_value object;
-  mrb_get_args(mrb, "o", &object);
-  return mrb_msgpack_pack(mrb, object);
+  uint64_t pending = 1;
+  while (pending) {
+    mrb_msgpack_raw_header h;
+    if (const char *error = mrb_msgpack_raw_header_at(buf, len, off, h)) return error;
+    --pending;
+    off = h.end;
+    if (h.type == msgpack::type::ARRAY)    pending += h.count;
+    else if (h.type == msgpack::type::MAP) pending += 2 * static_cast<uint64_t>(h.count);
+  }
+  return nullptr;
 }
 
-/* ------------------------------------------------------------------------
- * Ext packer registration
- * ------------------------------------------------------------------------ */
+/* what is known about a container the handle has looked into */
+struct mrb_msgpack_raw_container {
+  bool is_map;
+  uint32_t count;             /* elements, pairs for maps */
+  size_t next;                /* offset after the last recorded element */
+  std::vector<size_t> offsets; /* start of every element seen, keys and values alternate in maps */
+  std::unordered_map<std::string_view, uint32_t> keys; /* String key to pair, large maps only */
+  bool keys_indexed = false;
 
-static mrb_value
-mrb_msgpack_register_pack_type(mrb_state* mrb, mrb_value self)
-{
-  mrb_value ext_packers;
-  mrb_int type;
-  mrb_value mrb_class;
-  mrb_value block = mrb_nil_value();
-  mrb_value ext_config;
+  size_t size() const { return is_map ? 2 * static_cast<size_t>(count) : count; }
+};
 
-  mrb_get_args(mrb, "iC&", &type, &mrb_class, &block);
+/* Shared by a handle and every handle derived from it, the bytes are kept
+   alive by the data ivar of the handles. */
+struct mrb_msgpack_raw_index {
+  static constexpr size_t npos = SIZE_MAX;
 
-  if (type < 0 || type > 127) {
-    mrb_raise(mrb, E_RANGE_ERROR, "ext type must bet between 0 and 127");
+  const char *buf;
+  size_t len;
+  std::unordered_map<size_t, mrb_msgpack_raw_container> containers;
+
+  mrb_msgpack_raw_index(const char *buf, size_t len) : buf(buf), len(len) {}
+
+  [[noreturn]] static void raise(mrb_state *mrb, const char *error) {
+    mrb_raisef(mrb, E_MSGPACK_ERROR, "Can't unpack: %S", mrb_str_new_cstr(mrb, error));
   }
-  if (mrb_nil_p(block)) {
-    mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+
+  mrb_msgpack_raw_header header(mrb_state *mrb, size_t off) const {
+    mrb_msgpack_raw_header h;
+    if (const char *error = mrb_msgpack_raw_header_at(buf, len, off, h)) raise(mrb, error);
+    return h;
   }
-  if (mrb_type(block) != MRB_TT_PROC) {
-    mrb_raise(mrb, E_TYPE_ERROR, "not a block");
+
+  /* the container at off, nullptr for scalars */
+  mrb_msgpack_raw_container* container(mrb_state *mrb, size_t off) {
+    auto it = containers.find(off);
+    if (it != containers.end()) return &it->second;
+
+    mrb_msgpack_raw_header h = header(mrb, off);
+    if (h.type != msgpack::type::ARRAY && h.type != msgpack::type::MAP) return nullptr;
+
+    mrb_msgpack_raw_container &c = containers[off];
+    c.is_map = h.type == msgpack::type::MAP;
+    c.count = h.count;
+    c.next = h.body;
+    /* every element takes at least a byte, bogus counts can't reserve more than that */
+    c.offsets.reserve(std::min(c.size(), len - h.body));
+    return &c;
   }
 
-  if (mrb_class_ptr(mrb_class) == mrb->symbol_class) {
-    mrb_raise(mrb, E_ARGUMENT_ERROR,
-              "cannot register ext packer for Symbols, use the new MessagePack.sym_strategy function.");
+  /* offset of element i, scanning up to it the first time */
+  size_t element(mrb_state *mrb, mrb_msgpack_raw_container &c, size_t i) {
+    while (c.offsets.size() <= i) {
+      c.offsets.push_back(c.next);
+      if (const char *error = mrb_msgpack_raw_skip(buf, len, c.next)) raise(mrb, error);
+    }
+    return c.offsets[i];
+  }
+
+  std::string_view str_at(mrb_state *mrb, size_t off, bool &is_str) const {
+    mrb_msgpack_raw_header h = header(mrb, off);
+    is_str = h.type == msgpack::type::STR;
+    return std::string_view(buf + h.body, h.end - h.body);
   }
 
-  struct RClass *time_class = mrb_class_get_id(mrb, MRB_SYM(Time));
-  if (mrb_class_ptr(mrb_class) == time_class) {
-    mrb_raise(mrb, E_ARGUMENT_ERROR, "cannot register ext packer for Time, timestamp ext (-1) is reserved");
+  /* offset of the value of the first String key equal to key, npos when there is none */
+  size_t find_key(mrb_state *mrb, mrb_msgpack_raw_container &c, std::string_view key) {
+    bool is_str;
+
+    if (c.count < MRB_MSGPACK_MAP_INDEX_MIN) {
+      for (uint32_t i = 0; i < c.count; ++i) {
+        std::string_view k = str_at(mrb, element(mrb, c, 2 * static_cast<size_t>(i)), is_str);
+        if (is_str && k == key) return element(mrb, c, 2 * static_cast<size_t>(i) + 1);
+      }
+      return npos;
+    }
+
+    if (!c.keys_indexed) {
+      element(mrb, c, c.size() - 1);
+      c.keys.reserve(c.count);
+      for (uint32_t i = 0; i < c.count; ++i) {
+        std::string_view k = str_at(mrb, c.offsets[2 * static_cast<size_t>(i)], is_str);
+        /* emplace keeps the first of duplicate keys, like the linear scan */
+        if (is_str) c.keys.emplace(k, i);
+      }
+      c.keys_indexed = true;
+    }
+
+    auto found = c.keys.find(key);
+    return found == c.keys.end() ? npos : c.offsets[2 * static_cast<size_t>(found->second) + 1];
   }
+};
 
-  ext_packers = ext_packers_hash(mrb);
-  ext_config = mrb_hash_new_capa(mrb, 2);
+struct msgpack_object_handle {
+  std::shared_ptr<mrb_msgpack_raw_index> index;
+  size_t root = 0;
+};
 
-  mrb_hash_set(mrb, ext_config, mrb_symbol_value(MRB_SYM(type)),   mrb_fixnum_value(type));
-  mrb_hash_set(mrb, ext_config, mrb_symbol_value(MRB_SYM(packer)), block);
-  mrb_hash_set(mrb, ext_packers, mrb_class, ext_config);
+MRB_CPP_DEFINE_TYPE(msgpack_object_handle, msgpack_object_handle)
 
-  return mrb_nil_value();
+static msgpack_object_handle*
+mrb_msgpack_object_handle_get(mrb_state *mrb, mrb_value self)
+{
+  auto *handle = mrb_cpp_get<msgpack_object_handle>(mrb, self);
+  if (unlikely(!handle)) {
+    mrb_raise(mrb, E_MSGPACK_ERROR, "ObjectHandle is not initialized");
+  }
+  return handle;
 }
 
-
 static mrb_value
-mrb_msgpack_ext_packer_registered(mrb_state *mrb, mrb_value self)
+mrb_msgpack_object_handle_unpack(mrb_state *mrb, msgpack_object_handle *handle, const mrb_msgpack_unpack_opts& opts, size_t off)
 {
-  mrb_value mrb_class;
-  mrb_get_args(mrb, "C", &mrb_class);
-
-  return mrb_bool_value(
-    mrb_test(
-      mrb_hash_get(mrb,
-                   ext_packers_hash(mrb),
-                   mrb_class)
-    )
-  );
+  return mrb_msgpack_decode_at(mrb, opts, handle->index->buf, handle->index->len, off);
 }
 
-/* ------------------------------------------------------------------------
- * Symbol unpack strategies
- * ------------------------------------------------------------------------ */
-
-static inline mrb_value
-mrb_msgpack_unpack_symbol_as_int(mrb_state* mrb, const msgpack::object& obj)
+static mrb_value
+mrb_msgpack_object_handle_new(mrb_state *mrb, mrb_value self)
 {
-  if (unlikely(obj.via.ext.size != sizeof(mrb_sym))) {
-    mrb_raise(mrb, E_MSGPACK_ERROR, "invalid symbol ext body size");
-  }
+  mrb_value data;
+  mrb_get_args(mrb, "S", &data);
 
-  mrb_sym sym;
-  std::memcpy(&sym, obj.via.ext.data(), sizeof(sym));
-  return mrb_symbol_value(sym);
+  /* a private shared copy can't be modified behind the handle's back */
+  data = mrb_str_byte_subseq(mrb, data, 0, RSTRING_LEN(data));
+  mrb_iv_set(mrb, self, MRB_SYM(data), data);
+
+  auto *handle = mrb_cpp_new<msgpack_object_handle>(mrb, self);
+  handle->index = std::make_shared<mrb_msgpack_raw_index>(RSTRING_PTR(data), static_cast<size_t>(RSTRING_LEN(data)));
+  handle->index->header(mrb, 0);
+
+  return self;
 }
 
-static inline mrb_value
-mrb_msgpack_unpack_symbol_as_string(mrb_state* mrb, const msgpack::object& obj)
+static mrb_value
+mrb_msgpack_object_handle_value(mrb_state *mrb, mrb_value self)
 {
-  return mrb_symbol_value(
-    mrb_intern(mrb, obj.via.ext.data(), (size_t)obj.via.ext.size)
-  );
+  mrb_sym kw_names[] = { MRB_SYM(symbolize_keys), MRB_SYM(dedup_keys) };
+  mrb_value kw_values[2];
+  mrb_kwargs kwargs = { 2, 0, kw_names, kw_values, NULL };
+  mrb_get_args(mrb, ":", &kwargs);
+
+  msgpack_object_handle *handle = mrb_msgpack_object_handle_get(mrb, self);
+
+  mrb_msgpack_key_table key_table;
+  return mrb_msgpack_object_handle_unpack(mrb, handle, mrb_msgpack_unpack_opts_new(mrb, MRB_MSGPACK_CONTEXT(mrb), kw_values, &key_table), handle->root);
 }
 
 static mrb_value
-mrb_msgpack_unpack_timestamp(mrb_state* mrb, const msgpack::object& obj)
+mrb_msgpack_unpack_lazy_m(mrb_state *mrb, mrb_value self)
 {
-  const char* p = obj.via.ext.data();
-  uint32_t size = obj.via.ext.size;
-
-  switch (size) {
-    case 4: {
-      uint32_t sec =
-        ((uint32_t)(uint8_t)p[0] << 24) |
-        ((uint32_t)(uint8_t)p[1] << 16) |
-        ((uint32_t)(uint8_t)p[2] << 8)  |
-        ((uint32_t)(uint8_t)p[3]);
-      return mrb_time_at(mrb, (time_t)sec, 0, MRB_TIMEZONE_UTC);
-    }
+  mrb_value data;
+  mrb_get_args(mrb, "o", &data);
+  data = mrb_str_to_str(mrb, data);
 
-    case 8: {
-      uint64_t v = 0;
-      for (int i = 0; i < 8; ++i) v = (v << 8) | (uint8_t)p[i];
+  return mrb_obj_new(mrb,
+                     mrb_class_get_under_id(mrb, mrb_class_ptr(self), MRB_SYM(_ObjectHandle)),
+                     1, &data);
+}
 
-      // top 30 bits = nanoseconds
-      uint32_t nsec = (v >> 34) & 0x3fffffff;  // mask top 30 bits
-      uint64_t sec  = v & 0x3ffffffff;          // mask lower 34 bits
+/* ------------------------------------------------------------------------
+ * JSON Pointer navigation on ObjectHandle
+ * ------------------------------------------------------------------------ */
 
-      // nsec ist uint64_t aus 64-bit oder 32-bit Timestamp
-      mrb_int usec = (mrb_int)(nsec / 1000);  // Nanoseconds → Microseconds
+static void
+unescape_json_pointer(std::string_view in, std::string &out)
+{
+  out.clear();
+  out.reserve(in.size());
 
-      return mrb_time_at(mrb, (time_t)sec, usec, MRB_TIMEZONE_UTC);
+  for (size_t i = 0; i < in.size(); ++i) {
+    char c = in[i];
+    if (c == '~' && i + 1 < in.size()) {
+      char n = in[i + 1];
+      if (n == '0') { out.push_back('~'); ++i; continue; }
+      if (n == '1') { out.push_back('/'); ++i; continue; }
     }
+    out.push_back(c);
+  }
+}
 
-    case 12: {
-      uint32_t nsec =
-        ((uint32_t)(uint8_t)p[0] << 24) |
-        ((uint32_t)(uint8_t)p[1] << 16) |
-        ((uint32_t)(uint8_t)p[2] << 8)  |
-        ((uint32_t)(uint8_t)p[3]);
+static bool
+parse_array_index(std::string_view token, size_t &out_idx, std::string &errmsg)
+{
+  if (unlikely(token.empty())) {
+    errmsg = "Empty array index";
+    return false;
+  }
 
-      uint64_t sec = 0;
-      for (int i = 4; i < 12; ++i) sec = (sec << 8) | (uint8_t)p[i];
+  if (unlikely(token[0] == '-' || token[0] == '+')) {
+    errmsg = "Invalid array index: " + std::string(token);
+    return false;
+  }
 
-      return mrb_time_at(mrb, (time_t)sec, (time_t)(nsec / 1000), MRB_TIMEZONE_UTC); // divide by 1000 for microseconds
+  size_t idx = 0;
+  for (char c : token) {
+    if (unlikely(c < '0' || c > '9')) {
+      errmsg = "Invalid array index: " + std::string(token);
+      return false;
+    }
+    size_t digit = static_cast<size_t>(c - '0');
 
+    if (unlikely(idx > (std::numeric_limits<size_t>::max() - digit) / 10)) {
+      errmsg = "Array index overflow: " + std::string(token);
+      return false;
     }
 
-    default:
-      mrb_raise(mrb, E_MSGPACK_ERROR, "invalid timestamp ext length");
+    idx = idx * 10 + digit;
   }
+
+  out_idx = idx;
+  return true;
 }
 
+/* A JSON Pointer split into unescaped tokens, each token also parsed as an
+   array index up front since it isn't known yet what it will be applied to.
+   For pluck a token of just "*" selects every element of an Array or value
+   of a Map, everywhere else it's the literal key "*". */
+struct mrb_msgpack_pointer {
+  struct token {
+    std::string key;
+    size_t index = 0;
+    bool is_index = false;
+    bool wildcard = false;
+  };
+
+  std::string source;
+  std::vector<token> tokens;
+};
 
-/* ------------------------------------------------------------------------
- * Core unpack dispatch
- * ------------------------------------------------------------------------ */
+MRB_CPP_DEFINE_TYPE(mrb_msgpack_pointer, mrb_msgpack_pointer)
 
-static mrb_value
-mrb_unpack_msgpack_obj(mrb_state* mrb, const msgpack::object& obj)
+static void
+mrb_msgpack_pointer_parse(mrb_state *mrb, std::string_view pointer, mrb_msgpack_pointer &out)
 {
-  switch (obj.type) {
-    case msgpack::type::NIL:
-      return mrb_nil_value();
-
-    case msgpack::type::BOOLEAN:
-      return mrb_bool_value(obj.via.boolean);
-
-    case msgpack::type::POSITIVE_INTEGER:
-      return mrb_convert_number(mrb, obj.via.u64);
-
-    case msgpack::type::NEGATIVE_INTEGER:
-      return mrb_convert_number(mrb, obj.via.i64);
+  out.source.assign(pointer.data(), pointer.size());
+  out.tokens.clear();
 
-    case msgpack::type::FLOAT32:
-    case msgpack::type::FLOAT64:
-      return mrb_convert_number(mrb, obj.via.f64);
-
-    case msgpack::type::STR:
-      return mrb_str_new(mrb, obj.via.str.ptr, obj.via.str.size);
-
-    case msgpack::type::BIN:
-      return mrb_str_new(mrb, obj.via.bin.ptr, obj.via.bin.size);
+  if (pointer.empty() || pointer == "/") return;
 
-    case msgpack::type::ARRAY:
-      return mrb_unpack_msgpack_obj_array(mrb, obj);
+  if (unlikely(pointer.front() != '/')) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "JSON Pointer must start with '/'");
+  }
+  pointer.remove_prefix(1);
 
-    case msgpack::type::MAP:
-      return mrb_unpack_msgpack_obj_map(mrb, obj);
+  std::string errmsg;
+  while (!pointer.empty()) {
+    size_t pos = pointer.find('/');
+    std::string_view raw_token =
+      (pos == std::string_view::npos) ? pointer : pointer.substr(0, pos);
 
-    case msgpack::type::EXT: {
-      auto ext_type = obj.via.ext.type();
-      if (ext_type == -1) {
-        return mrb_msgpack_unpack_timestamp(mrb, obj);
-      }
-      mrb_msgpack_ctx* ctx = MRB_MSGPACK_CONTEXT(mrb);
-      if (ctx->sym_unpacker != nullptr && ext_type == ctx->ext_type) {
-        return ctx->sym_unpacker(mrb, obj);
-      }
-      mrb_value unpacker = mrb_hash_get(
-        mrb,
-        ext_unpackers_hash(mrb),
-        mrb_convert_number(mrb, ext_type)
-      );
+    out.tokens.emplace_back();
+    mrb_msgpack_pointer::token &tok = out.tokens.back();
+    unescape_json_pointer(raw_token, tok.key);
+    tok.is_index = parse_array_index(tok.key, tok.index, errmsg);
+    tok.wildcard = raw_token == "*";
 
-      if (likely(mrb_type(unpacker) == MRB_TT_PROC)) {
-        return mrb_yield(
-          mrb,
-          unpacker,
-          mrb_str_new(mrb, obj.via.ext.data(), obj.via.ext.size)
-        );
-      }
-      else {
-        mrb_raisef(mrb, E_MSGPACK_ERROR, "Cannot unpack ext type %d", ext_type);
-      }
+    if (pos == std::string_view::npos) {
+      break;
     }
-
-    default:
-      mrb_raise(mrb, E_MSGPACK_ERROR, "Cannot unpack unknown msgpack type");
+    pointer.remove_prefix(pos + 1);
   }
+}
 
-  return mrb_undef_value();
+/* a MessagePack::Pointer as is, anything else is parsed into scratch */
+static const mrb_msgpack_pointer*
+mrb_msgpack_pointer_from(mrb_state *mrb, mrb_value pointer, mrb_msgpack_pointer &scratch)
+{
+  const auto *compiled = mrb_cpp_get<mrb_msgpack_pointer>(mrb, pointer);
+  if (compiled) return compiled;
+
+  pointer = mrb_str_to_str(mrb, pointer);
+  mrb_msgpack_pointer_parse(mrb, std::string_view(RSTRING_PTR(pointer), RSTRING_LEN(pointer)), scratch);
+  return &scratch;
 }
 
 static mrb_value
-mrb_unpack_msgpack_obj_array(mrb_state* mrb, const msgpack::object& obj)
+mrb_msgpack_pointer_initialize(mrb_state *mrb, mrb_value self)
 {
-  if (obj.via.array.size == 0) return mrb_ary_new(mrb);
+  mrb_value str;
+  mrb_get_args(mrb, "S", &str);
 
-  mrb_value ary = mrb_ary_new_capa(mrb, obj.via.array.size);
-  mrb_int arena_index = mrb_gc_arena_save(mrb);
+  mrb_msgpack_pointer pointer;
+  mrb_msgpack_pointer_parse(mrb, std::string_view(RSTRING_PTR(str), RSTRING_LEN(str)), pointer);
 
-  for (uint32_t i = 0; i < obj.via.array.size; i++) {
-    mrb_ary_push(mrb, ary, mrb_unpack_msgpack_obj(mrb, obj.via.array.ptr[i]));
-    mrb_gc_arena_restore(mrb, arena_index);
-  }
+  auto *compiled = mrb_cpp_new<mrb_msgpack_pointer>(mrb, self);
+  *compiled = std::move(pointer);
 
-  return ary;
+  return self;
 }
 
 static mrb_value
-mrb_unpack_msgpack_obj_map(mrb_state* mrb, const msgpack::object& obj)
+mrb_msgpack_pointer_to_s(mrb_state *mrb, mrb_value self)
 {
-  if (obj.via.map.size == 0) return mrb_hash_new(mrb);
+  auto *pointer = mrb_cpp_get<mrb_msgpack_pointer>(mrb, self);
+  if (unlikely(!pointer)) {
+    mrb_raise(mrb, E_MSGPACK_ERROR, "Pointer is not initialized");
+  }
+  return mrb_str_new(mrb, pointer->source.data(), pointer->source.size());
+}
 
-  mrb_value hash = mrb_hash_new_capa(mrb, obj.via.map.size);
-  mrb_int arena_index = mrb_gc_arena_save(mrb);
+/* applies one pointer token to the object at current, raises when it doesn't lead anywhere */
+static size_t
+mrb_msgpack_object_handle_step(mrb_state *mrb, msgpack_object_handle *handle,
+                               size_t current, const mrb_msgpack_pointer::token &tok)
+{
+  mrb_msgpack_raw_index &index = *handle->index;
+  mrb_msgpack_raw_container *c = index.container(mrb, current);
 
-  for (uint32_t i = 0; i < obj.via.map.size; i++) {
-    mrb_value key = mrb_unpack_msgpack_obj(mrb, obj.via.map.ptr[i].key);
-    mrb_value val = mrb_unpack_msgpack_obj(mrb, obj.via.map.ptr[i].val);
-    mrb_hash_set(mrb, hash, key, val);
-    mrb_gc_arena_restore(mrb, arena_index);
+  if (unlikely(!c)) {
+    mrb_raise(mrb, E_TYPE_ERROR, "Cannot navigate into non-container");
   }
 
-  return hash;
-}
+  if (c->is_map) {
+    size_t found = index.find_key(mrb, *c, tok.key);
 
-/* ------------------------------------------------------------------------
- * Public C unpack API
- * ------------------------------------------------------------------------ */
+    if (unlikely(found == mrb_msgpack_raw_index::npos)) {
+      std::string msg = "Key not found: " + tok.key;
+      mrb_raise(mrb, E_KEY_ERROR, msg.c_str());
+    }
+    return found;
+  }
 
-MRB_API mrb_value
-mrb_msgpack_unpack(mrb_state *mrb, mrb_value data)
-{
-  data = mrb_str_to_str(mrb, data);
-  msgpack::unpack_limit limit(
-    MSGPACK_ARY_LIMIT,   // array
-    MSGPACK_MAP_LIMIT,   // map
-    MSGPACK_STR_LIMIT,   // str
-    MSGPACK_BIN_LIMIT,   // bin
-    MSGPACK_EXT_LIMIT,   // ext
-    MSGPACK_DEPTH_LIMIT  // depth
-  );
+  if (unlikely(!tok.is_index)) {
+    size_t idx;
+    std::string errmsg;
+    parse_array_index(tok.key, idx, errmsg);
+    mrb_raise(mrb, E_INDEX_ERROR, errmsg.c_str());
+  }
+
+  if (unlikely(tok.index >= c->count)) {
+    std::string msg = "Invalid array index: " + tok.key;
+    mrb_raise(mrb, E_INDEX_ERROR, msg.c_str());
+  }
 
-  msgpack::object_handle oh =
-    msgpack::unpack(RSTRING_PTR(data), RSTRING_LEN(data), nullptr, nullptr, limit);
-  return mrb_unpack_msgpack_obj(mrb, oh.get());
+  return index.element(mrb, *c, tok.index);
 }
 
-static mrb_value
-mrb_msgpack_unpack_m(mrb_state* mrb, mrb_value self)
+/* Applies tokens from t on to the object at current, fanning out at every
+   wildcard, and appends the offsets of everything selected to out. */
+static void
+mrb_msgpack_object_handle_collect(mrb_state *mrb, msgpack_object_handle *handle, size_t current,
+                                  const mrb_msgpack_pointer &pointer, size_t t, std::vector<size_t> &out)
 {
-  mrb_value data, block = mrb_nil_value();
-  mrb_get_args(mrb, "o&", &data, &block);
-  data = mrb_str_to_str(mrb, data);
-
-  const char* buf = RSTRING_PTR(data);
-  std::size_t len = RSTRING_LEN(data);
-  std::size_t off = 0;
-
-  msgpack::unpack_limit limit(
-    MSGPACK_ARY_LIMIT,   // array
-    MSGPACK_MAP_LIMIT,   // map
-    MSGPACK_STR_LIMIT,   // str
-    MSGPACK_BIN_LIMIT,   // bin
-    MSGPACK_EXT_LIMIT,   // ext
-    MSGPACK_DEPTH_LIMIT  // depth
-  );
+  for (; t < pointer.tokens.size(); ++t) {
+    if (!pointer.tokens[t].wildcard) {
+      current = mrb_msgpack_object_handle_step(mrb, handle, current, pointer.tokens[t]);
+      continue;
+    }
 
-  try {
-    if (mrb_type(block) == MRB_TT_PROC) {
-      while (off < len) {
-        try {
-          msgpack::object_handle oh = msgpack::unpack(buf, len, off, nullptr, nullptr, limit);
-          mrb_yield(mrb, block, mrb_unpack_msgpack_obj(mrb, oh.get()));
-        }
-        catch (const msgpack::insufficient_bytes&) {
-          break;
-        }
-      }
-      return mrb_convert_number(mrb, (mrb_int)off);
+    mrb_msgpack_raw_container *c = handle->index->container(mrb, current);
+    if (unlikely(!c)) {
+      mrb_raise(mrb, E_TYPE_ERROR, "Cannot navigate into non-container");
     }
-    else {
-      msgpack::object_handle oh = msgpack::unpack(buf, len, off, nullptr, nullptr, limit);
-      return mrb_unpack_msgpack_obj(mrb, oh.get());
+    const size_t n = c->size();
+    for (size_t i = c->is_map ? 1 : 0; i < n; i += c->is_map ? 2 : 1) {
+      mrb_msgpack_object_handle_collect(mrb, handle, handle->index->element(mrb, *c, i), pointer, t + 1, out);
     }
-  }
-  catch (const std::exception &e) {
-    mrb_raisef(mrb, E_MSGPACK_ERROR,
-               "Can't unpack: %S", mrb_str_new_cstr(mrb, e.what()));
+    return;
   }
 
-  return mrb_undef_value();
+  out.push_back(current);
 }
 
-/* ------------------------------------------------------------------------
- * Lazy unpacking / ObjectHandle
- * ------------------------------------------------------------------------ */
-
-struct msgpack_object_handle {
-  msgpack::object_handle oh;
-  std::size_t off;
-
-  msgpack_object_handle()
-    : oh(msgpack::object_handle()), off(0) {}
-};
+/* unpacks everything a wildcard pointer selects, starting at the object at off */
+static mrb_value
+mrb_msgpack_object_handle_pluck_from(mrb_state *mrb, msgpack_object_handle *handle, size_t off,
+                                     const mrb_msgpack_pointer &pointer, size_t t)
+{
+  std::vector<size_t> targets;
+  mrb_msgpack_object_handle_collect(mrb, handle, off, pointer, t, targets);
+
+  mrb_msgpack_unpack_opts opts{ MRB_MSGPACK_CONTEXT(mrb), nullptr, nullptr };
+  mrb_value result = mrb_ary_new_capa(mrb, static_cast<mrb_int>(targets.size()));
+  int arena_index = mrb_gc_arena_save(mrb);
+  for (size_t target : targets) {
+    mrb_ary_push(mrb, result, mrb_msgpack_object_handle_unpack(mrb, handle, opts, target));
+    mrb_gc_arena_restore(mrb, arena_index);
+  }
 
-MRB_CPP_DEFINE_TYPE(msgpack_object_handle, msgpack_object_handle)
+  return result;
+}
 
+/* like at_pointer, but always returns an Array of everything selected */
 static mrb_value
-mrb_msgpack_object_handle_new(mrb_state *mrb, mrb_value self)
+mrb_msgpack_object_handle_pluck(mrb_state *mrb, mrb_value self)
 {
-  mrb_value data;
-  mrb_get_args(mrb, "S", &data);
+  mrb_value arg;
+  mrb_get_args(mrb, "o", &arg);
 
-  mrb_cpp_new<msgpack_object_handle>(mrb, self);
-  mrb_iv_set(mrb, self, MRB_SYM(data), data);
+  msgpack_object_handle *handle = mrb_msgpack_object_handle_get(mrb, self);
 
-  return self;
+  mrb_msgpack_pointer scratch;
+  const mrb_msgpack_pointer *pointer = mrb_msgpack_pointer_from(mrb, arg, scratch);
+
+  return mrb_msgpack_object_handle_pluck_from(mrb, handle, handle->root, *pointer, 0);
 }
 
 static mrb_value
-mrb_msgpack_object_handle_value(mrb_state *mrb, mrb_value self)
+mrb_msgpack_object_handle_at_pointer(mrb_state *mrb, mrb_value self)
 {
-  auto* handle = mrb_cpp_get<msgpack_object_handle>(mrb, self);
-  if (unlikely(!handle)) {
-    mrb_raise(mrb, E_MSGPACK_ERROR, "ObjectHandle is not initialized");
-    return mrb_undef_value();
+  mrb_value arg;
+  mrb_get_args(mrb, "o", &arg);
+
+  msgpack_object_handle *handle = mrb_msgpack_object_handle_get(mrb, self);
+
+  mrb_msgpack_pointer scratch;
+  const mrb_msgpack_pointer *pointer = mrb_msgpack_pointer_from(mrb, arg, scratch);
+
+  size_t current = handle->root;
+  for (const auto &tok : pointer->tokens) {
+    current = mrb_msgpack_object_handle_step(mrb, handle, current, tok);
   }
 
-  return mrb_unpack_msgpack_obj(mrb, handle->oh.get());
+  return mrb_msgpack_object_handle_unpack(mrb, handle, mrb_msgpack_unpack_opts{ MRB_MSGPACK_CONTEXT(mrb), nullptr, nullptr }, current);
 }
 
+/* Resolves every pointer of an Array, pointers sharing a prefix walk it once:
+   each distinct prefix becomes a node of a trie holding the offset it leads to. */
 static mrb_value
-mrb_msgpack_unpack_lazy_m(mrb_state *mrb, mrb_value self)
+mrb_msgpack_object_handle_at_pointers(mrb_state *mrb, mrb_value self)
 {
-  mrb_value data;
-  mrb_get_args(mrb, "o", &data);
-  data = mrb_str_to_str(mrb, data);
-
-  try {
-    mrb_value object_handle =
-      mrb_obj_new(mrb,
-                  mrb_class_get_under_id(mrb, mrb_class_ptr(self), MRB_SYM(_ObjectHandle)),
-                  1, &data);
-
-    auto* handle = mrb_cpp_get<msgpack_object_handle>(mrb, object_handle);
-    if (unlikely(!handle)) {
-      mrb_raise(mrb, E_MSGPACK_ERROR, "ObjectHandle is not initialized");
-      return mrb_undef_value();
-    }
-    msgpack::unpack_limit limit(
-      MSGPACK_ARY_LIMIT,   // array
-      MSGPACK_MAP_LIMIT,   // map
-      MSGPACK_STR_LIMIT,   // str
-      MSGPACK_BIN_LIMIT,   // bin
-      MSGPACK_EXT_LIMIT,   // ext
-      MSGPACK_DEPTH_LIMIT  // depth
-    );
-    msgpack::unpack(handle->oh,
-                    RSTRING_PTR(data),
-                    RSTRING_LEN(data),
-                    handle->off, nullptr, nullptr, limit);
+  mrb_value pointers;
+  mrb_get_args(mrb, "A", &pointers);
+
+  msgpack_object_handle *handle = mrb_msgpack_object_handle_get(mrb, self);
+  mrb_int count = RARRAY_LEN(pointers);
+  /* to_str may run Ruby code, a copy keeps the pointers the trie refers to alive */
+  pointers = mrb_ary_new_from_values(mrb, count, RARRAY_PTR(pointers));
+
+  struct node {
+    size_t off;
+    std::unordered_map<std::string_view, size_t> children;
+  };
+  std::vector<node> trie;
+  trie.push_back(node{ handle->root, {} });
+
+  /* parsed String pointers, their tokens are referenced by the trie */
+  std::vector<std::unique_ptr<mrb_msgpack_pointer>> parsed;
+  std::vector<size_t> targets;
+  targets.reserve(count);
+
+  for (mrb_int i = 0; i < count; ++i) {
+    mrb_value arg = RARRAY_PTR(pointers)[i];
+    const mrb_msgpack_pointer *pointer = mrb_cpp_get<mrb_msgpack_pointer>(mrb, arg);
+    if (!pointer) {
+      parsed.emplace_back(new mrb_msgpack_pointer());
+      pointer = mrb_msgpack_pointer_from(mrb, arg, *parsed.back());
+    }
 
-    return object_handle;
+    size_t n = 0;
+    for (const auto &tok : pointer->tokens) {
+      auto it = trie[n].children.find(tok.key);
+      if (it != trie[n].children.end()) {
+        n = it->second;
+        continue;
+      }
+      size_t next = mrb_msgpack_object_handle_step(mrb, handle, trie[n].off, tok);
+      trie.push_back(node{ next, {} });
+      trie[n].children.emplace(tok.key, trie.size() - 1);
+      n = trie.size() - 1;
+    }
+    targets.push_back(trie[n].off);
   }
-  catch (const std::exception &e) {
-    mrb_raisef(mrb, E_MSGPACK_ERROR,
-               "Can't unpack: %S", mrb_str_new_cstr(mrb, e.what()));
+
+  mrb_msgpack_unpack_opts opts{ MRB_MSGPACK_CONTEXT(mrb), nullptr, nullptr };
+  mrb_value result = mrb_ary_new_capa(mrb, count);
+  int arena_index = mrb_gc_arena_save(mrb);
+  for (size_t target : targets) {
+    mrb_ary_push(mrb, result, mrb_msgpack_object_handle_unpack(mrb, handle, opts, target));
+    mrb_gc_arena_restore(mrb, arena_index);
   }
 
-  return mrb_undef_value();
+  return result;
 }
 
 /* ------------------------------------------------------------------------
- * JSON Pointer navigation on ObjectHandle
+ * Child handles and iteration, nothing gets unpacked until asked for
  * ------------------------------------------------------------------------ */
 
-static std::string_view
-unescape_json_pointer_sv(std::string_view in, std::string &scratch)
+/* a handle of the same class rooted at off, sharing bytes and index with handle */
+static mrb_value
+mrb_msgpack_object_handle_derive(mrb_state *mrb, mrb_value self, msgpack_object_handle *handle, size_t off)
 {
-  scratch.clear();
-  scratch.reserve(in.size());
+  mrb_value child = mrb_obj_value(mrb_data_object_alloc(mrb, mrb_obj_class(mrb, self), NULL, NULL));
+  mrb_iv_set(mrb, child, MRB_SYM(data), mrb_iv_get(mrb, self, MRB_SYM(data)));
 
-  for (size_t i = 0; i < in.size(); ++i) {
-    char c = in[i];
-    if (c == '~' && i + 1 < in.size()) {
-      char n = in[i + 1];
-      if (n == '0') { scratch.push_back('~'); ++i; continue; }
-      if (n == '1') { scratch.push_back('/'); ++i; continue; }
-    }
-    scratch.push_back(c);
-  }
+  auto *derived = mrb_cpp_new<msgpack_object_handle>(mrb, child);
+  derived->index = handle->index;
+  derived->root = off;
 
-  return std::string_view(scratch.data(), scratch.size());
+  return child;
 }
 
-static bool
-parse_array_index(std::string_view token, size_t &out_idx, std::string &errmsg)
+static mrb_msgpack_raw_container*
+mrb_msgpack_object_handle_container(mrb_state *mrb, msgpack_object_handle *handle)
 {
-  if (unlikely(token.empty())) {
-    errmsg = "Empty array index";
-    return false;
+  mrb_msgpack_raw_container *c = handle->index->container(mrb, handle->root);
+  if (unlikely(!c)) {
+    mrb_raise(mrb, E_TYPE_ERROR, "Cannot navigate into non-container");
   }
+  return c;
+}
 
-  if (unlikely(token[0] == '-' || token[0] == '+')) {
-    errmsg = "Invalid array index: " + std::string(token);
-    return false;
-  }
+static mrb_value
+mrb_msgpack_object_handle_child(mrb_state *mrb, mrb_value self)
+{
+  mrb_value arg;
+  mrb_get_args(mrb, "o", &arg);
 
-  size_t idx = 0;
-  for (char c : token) {
-    if (unlikely(c < '0' || c > '9')) {
-      errmsg = "Invalid array index: " + std::string(token);
-      return false;
-    }
-    size_t digit = static_cast<size_t>(c - '0');
+  msgpack_object_handle *handle = mrb_msgpack_object_handle_get(mrb, self);
 
-    if (unlikely(idx > (std::numeric_limits<size_t>::max() - digit) / 10)) {
-      errmsg = "Array index overflow: " + std::string(token);
-      return false;
-    }
+  mrb_msgpack_pointer scratch;
+  const mrb_msgpack_pointer *pointer = mrb_msgpack_pointer_from(mrb, arg, scratch);
 
-    idx = idx * 10 + digit;
+  size_t current = handle->root;
+  for (const auto &tok : pointer->tokens) {
+    current = mrb_msgpack_object_handle_step(mrb, handle, current, tok);
   }
 
-  out_idx = idx;
-  return true;
+  return mrb_msgpack_object_handle_derive(mrb, self, handle, current);
 }
 
+/* yields a handle for every element of an Array or every value of a Map */
 static mrb_value
-mrb_msgpack_object_handle_at_pointer(mrb_state *mrb, mrb_value self)
+mrb_msgpack_object_handle_each_child(mrb_state *mrb, mrb_value self)
 {
-  mrb_value str;
-  mrb_get_args(mrb, "S", &str);
-
-  std::string_view pointer(RSTRING_PTR(str), RSTRING_LEN(str));
-
-  auto *handle = mrb_cpp_get<msgpack_object_handle>(mrb, self);
-  if (unlikely(!handle)) {
-    mrb_raise(mrb, E_MSGPACK_ERROR, "ObjectHandle is not initialized");
-    return mrb_undef_value();
+  mrb_value block;
+  mrb_get_args(mrb, "&!", &block);
+
+  msgpack_object_handle *handle = mrb_msgpack_object_handle_get(mrb, self);
+  mrb_msgpack_raw_container *c = mrb_msgpack_object_handle_container(mrb, handle);
+  const size_t first = c->is_map ? 1 : 0;
+  const size_t step = c->is_map ? 2 : 1;
+  const size_t n = c->size();
+
+  int arena_index = mrb_gc_arena_save(mrb);
+  for (size_t i = first; i < n; i += step) {
+    size_t off = handle->index->element(mrb, *c, i);
+    mrb_yield(mrb, block, mrb_msgpack_object_handle_derive(mrb, self, handle, off));
+    mrb_gc_arena_restore(mrb, arena_index);
   }
 
-  const msgpack::object *current = &handle->oh.get();
+  return self;
+}
+
+/* yields every key of a Map unpacked, together with a handle for its value */
+static mrb_value
+mrb_msgpack_object_handle_each_pair(mrb_state *mrb, mrb_value self)
+{
+  mrb_value block;
+  mrb_get_args(mrb, "&!", &block);
 
-  if (pointer.empty() || pointer == "/") {
-    return mrb_unpack_msgpack_obj(mrb, *current);
+  msgpack_object_handle *handle = mrb_msgpack_object_handle_get(mrb, self);
+  mrb_msgpack_raw_container *c = mrb_msgpack_object_handle_container(mrb, handle);
+  if (unlikely(!c->is_map)) {
+    mrb_raise(mrb, E_TYPE_ERROR, "each_pair needs a map");
   }
 
-  if (unlikely(pointer.front() != '/')) {
-    mrb_raise(mrb, E_ARGUMENT_ERROR, "JSON Pointer must start with '/'");
-    return mrb_undef_value();
+  mrb_msgpack_unpack_opts opts{ MRB_MSGPACK_CONTEXT(mrb), nullptr, nullptr };
+  const size_t n = c->size();
+
+  int arena_index = mrb_gc_arena_save(mrb);
+  for (size_t i = 0; i < n; i += 2) {
+    size_t key_off = handle->index->element(mrb, *c, i);
+    size_t val_off = handle->index->element(mrb, *c, i + 1);
+    mrb_value pair[2] = {
+      mrb_msgpack_object_handle_unpack(mrb, handle, opts, key_off),
+      mrb_msgpack_object_handle_derive(mrb, self, handle, val_off)
+    };
+    mrb_yield_argv(mrb, block, 2, pair);
+    mrb_gc_arena_restore(mrb, arena_index);
   }
-  pointer.remove_prefix(1);
 
-  std::string scratch;
-  std::string errmsg;
+  return self;
+}
 
-  while (!pointer.empty()) {
-    size_t pos = pointer.find('/');
-    std::string_view raw_token =
-      (pos == std::string_view::npos) ? pointer : pointer.substr(0, pos);
+/* elements of an Array, pairs of a Map */
+static mrb_value
+mrb_msgpack_object_handle_size(mrb_state *mrb, mrb_value self)
+{
+  msgpack_object_handle *handle = mrb_msgpack_object_handle_get(mrb, self);
+  return mrb_int_value(mrb, static_cast<mrb_int>(mrb_msgpack_object_handle_container(mrb, handle)->count));
+}
 
-    std::string_view token_view = unescape_json_pointer_sv(raw_token, scratch);
+static mrb_value
+mrb_msgpack_object_handle_type(mrb_state *mrb, mrb_value self)
+{
+  msgpack_object_handle *handle = mrb_msgpack_object_handle_get(mrb, self);
 
-    if (current->type == msgpack::type::MAP) {
-      bool found = false;
+  switch (handle->index->header(mrb, handle->root).type) {
+    case msgpack::type::NIL:              return mrb_symbol_value(MRB_SYM(nil));
+    case msgpack::type::BOOLEAN:          return mrb_symbol_value(MRB_SYM(boolean));
+    case msgpack::type::POSITIVE_INTEGER:
+    case msgpack::type::NEGATIVE_INTEGER: return mrb_symbol_value(MRB_SYM(integer));
+    case msgpack::type::FLOAT32:
+    case msgpack::type::FLOAT64:          return mrb_symbol_value(MRB_SYM(float));
+    case msgpack::type::STR:              return mrb_symbol_value(MRB_SYM(string));
+    case msgpack::type::BIN:              return mrb_symbol_value(MRB_SYM(binary));
+    case msgpack::type::ARRAY:            return mrb_symbol_value(MRB_SYM(array));
+    case msgpack::type::MAP:              return mrb_symbol_value(MRB_SYM(map));
+    default:                              return mrb_symbol_value(MRB_SYM(ext));
+  }
+}
 
-      for (uint32_t i = 0; i < current->via.map.size; ++i) {
-        const auto &kv = current->via.map.ptr[i];
+/* ------------------------------------------------------------------------
+ * Packable classes: unpacking reads the headers of the ext body and decodes
+ * the fields one by one, without building a Hash or Array for them
+ * ------------------------------------------------------------------------ */
 
-        if (kv.key.type == msgpack::type::STR) {
-          std::string_view key_view(kv.key.via.str.ptr,
-                                    kv.key.via.str.size);
-          if (token_view == key_view) {
-            current = &kv.val;
-            found = true;
-            break;
-          }
-        }
-      }
+/* index of the field named by the map key at h, the fields are usually
+ * in the order they were packed in, so next is tried first */
+static size_t
+mrb_msgpack_packable_field(const mrb_msgpack_packable *p, const char *buf, const mrb_msgpack_raw_header& h, size_t next)
+{
+  const size_t n = p->names.size();
+  if (h.type != msgpack::type::STR) return n;
+
+  const char *key = buf + h.body;
+  const size_t len = h.end - h.body;
+  for (size_t k = 0; k < n; ++k) {
+    size_t i = (next + k) % n;
+    if (p->names[i].size() == len && std::memcmp(p->names[i].data(), key, len) == 0) return i;
+  }
+  return n;
+}
 
-      if (unlikely(!found)) {
-        std::string msg = "Key not found: ";
-        msg.append(token_view.data(), token_view.size());
-        mrb_raise(mrb, E_KEY_ERROR, msg.c_str());
-        return mrb_undef_value();
-      }
+/* Decodes the fields straight into the ivars of obj, others are skipped
+ * without building them. Returns why it couldn't or nullptr. */
+static const char*
+mrb_msgpack_unpack_packable_fields(mrb_state *mrb, mrb_msgpack_decoder& decoder, const mrb_msgpack_packable *p,
+                                   mrb_value obj, const char *body, uint32_t size, const mrb_msgpack_raw_header& h)
+{
+  const size_t n = p->ivars.size();
+  size_t off = h.body;
+  size_t next = 0;
+
+  for (uint32_t i = 0; i < h.count; ++i) {
+    size_t field = i;
+    if (h.type == msgpack::type::MAP) {
+      mrb_msgpack_raw_header key;
+      if (const char *error = mrb_msgpack_raw_header_at(body, size, off, key)) return error;
+      field = mrb_msgpack_packable_field(p, body, key, next);
+      if (const char *error = mrb_msgpack_raw_skip(body, size, off)) return error;
     }
-    else if (current->type == msgpack::type::ARRAY) {
-      size_t idx = 0;
-      errmsg.clear();
-
-      if (unlikely(!parse_array_index(token_view, idx, errmsg))) {
-        mrb_raise(mrb, E_INDEX_ERROR, errmsg.c_str());
-        return mrb_undef_value();
-      }
-
-      if (unlikely(idx >= current->via.array.size)) {
-        std::string msg = "Invalid array index: ";
-        msg.append(token_view.data(), token_view.size());
-        mrb_raise(mrb, E_INDEX_ERROR, msg.c_str());
-        return mrb_undef_value();
-      }
 
-      current = &current->via.array.ptr[idx];
+    if (field >= n) {
+      if (const char *error = mrb_msgpack_raw_skip(body, size, off)) return error;
+      continue;
     }
-    else {
-      mrb_raise(mrb, E_TYPE_ERROR, "Cannot navigate into non-container");
-      return mrb_undef_value();
+    switch (decoder.decode(body, size, off)) {
+      case mrb_msgpack_decoder::DECODED:      break;
+      case mrb_msgpack_decoder::INSUFFICIENT: return "insufficient bytes";
+      case mrb_msgpack_decoder::FAILED:       return decoder.error();
     }
+    mrb_iv_set(mrb, obj, p->ivars[field], decoder.value());
+    next = field + 1;
+  }
+  return nullptr;
+}
 
-    if (pos == std::string_view::npos) {
-      break;
-    }
-    pointer.remove_prefix(pos + 1);
+/* The object is allocated without calling initialize, like Marshal does.
+ * Map keys which aren't fields are skipped, fields without a key stay nil. */
+static mrb_value
+mrb_msgpack_unpack_packable(mrb_state *mrb, mrb_msgpack_ctx *ctx, const mrb_msgpack_packable *p, const char *body, uint32_t size)
+{
+  mrb_msgpack_raw_header h;
+  const char *error = mrb_msgpack_raw_header_at(body, size, 0, h);
+  if (!error && h.type != msgpack::type::ARRAY && h.type != msgpack::type::MAP) {
+    mrb_raisef(mrb, E_MSGPACK_ERROR, "Cannot unpack %!v from ext type %d",
+               mrb_obj_value(p->klass), (int)p->type);
   }
 
-  return mrb_unpack_msgpack_obj(mrb, *current);
-}
+  mrb_value obj = mrb_obj_value(mrb_obj_alloc(mrb, MRB_TT_OBJECT, p->klass));
+  if (likely(!error)) {
+    mrb_msgpack_unpack_opts opts{ ctx, nullptr, nullptr };
+    mrb_msgpack_decoder decoder(mrb, opts);
+    error = mrb_msgpack_unpack_packable_fields(mrb, decoder, p, obj, body, size, h);
+  }
 
+  if (unlikely(error)) {
+    mrb_raisef(mrb, E_MSGPACK_ERROR, "Can't unpack: %S", mrb_str_new_cstr(mrb, error));
+  }
+  return obj;
+}
 
 /* ------------------------------------------------------------------------
  * Ext unpacker registration
@@ -1293,58 +4876,57 @@ mrb_msgpack_register_unpack_type(mrb_state* mrb, mrb_value self)
 
   mrb_get_args(mrb, "i&", &type, &block);
 
-  if (type < 0 || type > 127) {
-    mrb_raise(mrb, E_RANGE_ERROR, "ext type must bet between 0 and 127");
-  }
-  if (mrb_nil_p(block)) {
-    mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
-  }
-  if (mrb_type(block) != MRB_TT_PROC) {
-    mrb_raise(mrb, E_TYPE_ERROR, "not a block");
-  }
+  mrb_msgpack_codec_register_unpack_type(mrb, mrb_msgpack_codec_get(mrb, ensure_msgpack_ctx(mrb)), type, block);
 
-  mrb_msgpack_ctx* ctx = MRB_MSGPACK_CONTEXT(mrb);
+  return mrb_nil_value();
+}
 
-  // If the user is using an ext-based symbol strategy,
-  // forbid overriding the symbol ext type.
-  if (ctx->sym_unpacker != nullptr && type == ctx->ext_type) {
-    mrb_raise(mrb, E_ARGUMENT_ERROR,
-      "cannot register ext unpacker for Symbols, use MessagePack.sym_strategy instead.");
-  }
+static mrb_value
+mrb_msgpack_codec_register_unpack_type_m(mrb_state* mrb, mrb_value self)
+{
+  mrb_int type;
+  mrb_value block = mrb_nil_value();
 
-  // Otherwise: safe to register
-  mrb_hash_set(mrb,
-               ext_unpackers_hash(mrb),
-               mrb_fixnum_value(type),
-               block);
+  mrb_get_args(mrb, "i&", &type, &block);
 
-  return mrb_nil_value();
-}
+  mrb_msgpack_codec_register_unpack_type(mrb, mrb_msgpack_codec_get(mrb, self), type, block);
 
+  return self;
+}
 
 static mrb_value
-mrb_msgpack_ext_unpacker_registered(mrb_state *mrb, mrb_value self)
+mrb_msgpack_ext_unpacker_registered_in(mrb_state *mrb, mrb_msgpack_ctx *ctx)
 {
   mrb_int type;
   mrb_get_args(mrb, "i", &type);
 
-  return mrb_bool_value(
-    !mrb_nil_p(
-      mrb_hash_get(mrb,
-                   ext_unpackers_hash(mrb),
-                   mrb_convert_number(mrb, type))
-    )
-  );
+  if (type < 0 || type > 127) return mrb_false_value();
+
+  return mrb_bool_value(ctx->ext_unpackers[type] != nullptr);
 }
 
-MRB_API void
-mrb_msgpack_set_symbol_strategy(mrb_state *mrb, mrb_sym which, int8_t ext_type)
+static mrb_value
+mrb_msgpack_ext_unpacker_registered(mrb_state *mrb, mrb_value self)
 {
-  if (unlikely(ext_type < 0)) {
+  return mrb_msgpack_ext_unpacker_registered_in(mrb, MRB_MSGPACK_CONTEXT(mrb));
+}
+
+static mrb_value
+mrb_msgpack_codec_ext_unpacker_registered(mrb_state *mrb, mrb_value self)
+{
+  return mrb_msgpack_ext_unpacker_registered_in(mrb, mrb_msgpack_codec_get(mrb, self));
+}
+
+static void
+mrb_msgpack_ctx_set_symbol_strategy(mrb_state *mrb, mrb_msgpack_ctx *ctx, mrb_sym which, mrb_int ext_type)
+{
+  if (unlikely(ext_type < 0 || ext_type > 127)) {
     mrb_raise(mrb, E_ARGUMENT_ERROR, "ext type must bet between 0 and 127");
   }
 
-  mrb_msgpack_ctx *ctx = MRB_MSGPACK_CONTEXT(mrb);
+  if (which != MRB_SYM(raw) && ctx->packable_types[ext_type]) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "ext type %d is used by MessagePack.packable", (int)ext_type);
+  }
 
   switch (which) {
     case MRB_SYM(raw):
@@ -1356,25 +4938,26 @@ mrb_msgpack_set_symbol_strategy(mrb_state *mrb, mrb_sym which, int8_t ext_type)
     case MRB_SYM(string):
       ctx->sym_packer   = mrb_msgpack_pack_symbol_value_as_string;
       ctx->sym_unpacker = mrb_msgpack_unpack_symbol_as_string;
-      ctx->ext_type     = ext_type;
+      ctx->ext_type     = (int8_t)ext_type;
       break;
 
     case MRB_SYM(int):
       ctx->sym_packer   = mrb_msgpack_pack_symbol_value_as_int;
       ctx->sym_unpacker = mrb_msgpack_unpack_symbol_as_int;
-      ctx->ext_type     = ext_type;
+      ctx->ext_type     = (int8_t)ext_type;
       break;
 
     default:
       mrb_raise(mrb, E_ARGUMENT_ERROR, "unknown symbol strategy");
   }
+
+  /* memoized bytes hold Symbols packed the old way */
+  if (ctx->memo) mrb_msgpack_ctx_set_memo(mrb, ctx, mrb_int_value(mrb, (mrb_int)ctx->memo->max_bytes));
 }
 
-MRB_API mrb_value
-mrb_msgpack_get_symbol_strategy(mrb_state *mrb)
+static mrb_value
+mrb_msgpack_ctx_get_symbol_strategy(mrb_state *mrb, mrb_msgpack_ctx *ctx)
 {
-  mrb_msgpack_ctx *ctx = MRB_MSGPACK_CONTEXT(mrb);
-
   if (ctx->sym_unpacker == NULL) {
     return mrb_symbol_value(MRB_SYM(raw));
   }
@@ -1397,6 +4980,18 @@ mrb_msgpack_get_symbol_strategy(mrb_state *mrb)
   return mrb_nil_value();
 }
 
+MRB_API void
+mrb_msgpack_set_symbol_strategy(mrb_state *mrb, mrb_sym which, int8_t ext_type)
+{
+  mrb_msgpack_ctx_set_symbol_strategy(mrb, MRB_MSGPACK_CONTEXT(mrb), which, ext_type);
+}
+
+MRB_API mrb_value
+mrb_msgpack_get_symbol_strategy(mrb_state *mrb)
+{
+  return mrb_msgpack_ctx_get_symbol_strategy(mrb, MRB_MSGPACK_CONTEXT(mrb));
+}
+
 /* ------------------------------------------------------------------------
  * Symbol strategy API (Ruby-visible)
  * ------------------------------------------------------------------------ */
@@ -1413,10 +5008,53 @@ mrb_msgpack_sym_strategy(mrb_state *mrb, mrb_value self)
     return mrb_msgpack_get_symbol_strategy(mrb);
   }
 
-  mrb_msgpack_set_symbol_strategy(mrb, which, ext_type);
+  mrb_msgpack_ctx_set_symbol_strategy(mrb, MRB_MSGPACK_CONTEXT(mrb), which, ext_type);
   return self;
 }
 
+static mrb_value
+mrb_msgpack_memoize_set(mrb_state *mrb, mrb_value self)
+{
+  mrb_value memoize;
+  mrb_get_args(mrb, "o", &memoize);
+  mrb_msgpack_ctx_set_memo(mrb, MRB_MSGPACK_CONTEXT(mrb), memoize);
+  return memoize;
+}
+
+static mrb_value
+mrb_msgpack_codec_sym_strategy(mrb_state *mrb, mrb_value self)
+{
+  return mrb_msgpack_ctx_get_symbol_strategy(mrb, mrb_msgpack_codec_get(mrb, self));
+}
+
+/* ------------------------------------------------------------------------
+ * Method hooks: defining a method can change which conversion a class
+ * packs with, so the per class caches are dropped.
+ * ------------------------------------------------------------------------ */
+
+/* method_added, method_removed and method_undefined: only the conversion
+ * methods matter, other definitions leave the caches alone */
+static mrb_value
+mrb_msgpack_mod_method_changed(mrb_state *mrb, mrb_value mod)
+{
+  mrb_sym method;
+  mrb_get_args(mrb, "n", &method);
+
+  switch (method) {
+    case MRB_SYM(to_hash):
+    case MRB_SYM(to_ary):
+    case MRB_SYM(to_int):
+    case MRB_SYM(to_str):
+    case MRB_SYM(to_s):
+      mrb_msgpack_class_cache_clear(mrb);
+      break;
+    default:
+      break;
+  }
+
+  return mrb_nil_value();
+}
+
 /* ------------------------------------------------------------------------
  * Gem init/final: hook into GV-backed ctx/registry (Ruby API + C API)
  * ------------------------------------------------------------------------ */
@@ -1424,7 +5062,7 @@ MRB_BEGIN_DECL
 void
 mrb_mruby_simplemsgpack_gem_init(mrb_state* mrb)
 {
-  struct RClass *msgpack_mod, *mrb_object_handle_class;
+  struct RClass *msgpack_mod, *mrb_object_handle_class, *mrb_packer_class, *mrb_unpacker_class, *mrb_pointer_class, *mrb_raw_value_class, *mrb_schema_class, *mrb_codec_class;
 
   /* to_msgpack methods */
   mrb_define_method_id(mrb, mrb->object_class,
@@ -1471,22 +5109,196 @@ mrb_mruby_simplemsgpack_gem_init(mrb_state* mrb)
                        MRB_SYM(initialize),  mrb_msgpack_object_handle_new,   MRB_ARGS_REQ(1));
 
   mrb_define_method_id(mrb, mrb_object_handle_class,
-                       MRB_SYM(value),       mrb_msgpack_object_handle_value, MRB_ARGS_NONE());
+                       MRB_SYM(value),       mrb_msgpack_object_handle_value, MRB_ARGS_KEY(2, 0));
 
   mrb_define_method_id(mrb, mrb_object_handle_class,
                        MRB_SYM(at_pointer),  mrb_msgpack_object_handle_at_pointer, MRB_ARGS_REQ(1));
 
+  mrb_define_method_id(mrb, mrb_object_handle_class,
+                       MRB_SYM(at_pointers), mrb_msgpack_object_handle_at_pointers, MRB_ARGS_REQ(1));
+
+  mrb_define_method_id(mrb, mrb_object_handle_class,
+                       MRB_SYM(pluck),       mrb_msgpack_object_handle_pluck,      MRB_ARGS_REQ(1));
+
+  mrb_define_method_id(mrb, mrb_object_handle_class,
+                       MRB_SYM(child),       mrb_msgpack_object_handle_child,      MRB_ARGS_REQ(1));
+
+  mrb_define_method_id(mrb, mrb_object_handle_class,
+                       MRB_SYM(each_child),  mrb_msgpack_object_handle_each_child, MRB_ARGS_BLOCK());
+
+  mrb_define_method_id(mrb, mrb_object_handle_class,
+                       MRB_SYM(each_pair),   mrb_msgpack_object_handle_each_pair,  MRB_ARGS_BLOCK());
+
+  mrb_define_method_id(mrb, mrb_object_handle_class,
+                       MRB_SYM(size),        mrb_msgpack_object_handle_size,       MRB_ARGS_NONE());
+
+  mrb_define_method_id(mrb, mrb_object_handle_class,
+                       MRB_SYM(type),        mrb_msgpack_object_handle_type,       MRB_ARGS_NONE());
+
+  mrb_raw_value_class =
+    mrb_define_class_under_id(mrb, msgpack_mod,
+                              MRB_SYM(RawValue), mrb->object_class);
+
+  MRB_SET_INSTANCE_TT(mrb_raw_value_class, MRB_TT_DATA);
+
+  mrb_define_method_id(mrb, mrb_raw_value_class,
+                       MRB_SYM(initialize),  mrb_msgpack_raw_value_initialize, MRB_ARGS_REQ(1) | MRB_ARGS_KEY(1, 0));
+
+  mrb_define_method_id(mrb, mrb_raw_value_class,
+                       MRB_SYM(to_s),        mrb_msgpack_raw_value_to_s,       MRB_ARGS_NONE());
+
+  mrb_define_method_id(mrb, mrb_raw_value_class,
+                       MRB_SYM(bytesize),    mrb_msgpack_raw_value_bytesize,   MRB_ARGS_NONE());
+
+  mrb_schema_class =
+    mrb_define_class_under_id(mrb, msgpack_mod,
+                              MRB_SYM(Schema), mrb->object_class);
+
+  MRB_SET_INSTANCE_TT(mrb_schema_class, MRB_TT_DATA);
+
+  mrb_define_method_id(mrb, mrb_schema_class,
+                       MRB_SYM(initialize),  mrb_msgpack_schema_initialize, MRB_ARGS_REQ(1) | MRB_ARGS_KEY(1, 0));
+
+  mrb_define_method_id(mrb, mrb_schema_class,
+                       MRB_SYM(pack),        mrb_msgpack_schema_pack,       MRB_ARGS_REQ(1));
+
+  mrb_define_method_id(mrb, mrb_schema_class,
+                       MRB_SYM(pack_array),  mrb_msgpack_schema_pack_array, MRB_ARGS_REQ(1));
+
+  mrb_define_method_id(mrb, mrb_schema_class,
+                       MRB_SYM(keys),        mrb_msgpack_schema_keys,       MRB_ARGS_NONE());
+
+  mrb_pointer_class =
+    mrb_define_class_under_id(mrb, msgpack_mod,
+                              MRB_SYM(Pointer), mrb->object_class);
+
+  MRB_SET_INSTANCE_TT(mrb_pointer_class, MRB_TT_DATA);
+
+  mrb_define_method_id(mrb, mrb_pointer_class,
+                       MRB_SYM(initialize),  mrb_msgpack_pointer_initialize, MRB_ARGS_REQ(1));
+
+  mrb_define_method_id(mrb, mrb_pointer_class,
+                       MRB_SYM(to_s),        mrb_msgpack_pointer_to_s,       MRB_ARGS_NONE());
+
+  mrb_packer_class =
+    mrb_define_class_under_id(mrb, msgpack_mod,
+                              MRB_SYM(Packer), mrb->object_class);
+
+  MRB_SET_INSTANCE_TT(mrb_packer_class, MRB_TT_DATA);
+
+  mrb_define_method_id(mrb, mrb_packer_class,
+                       MRB_SYM(initialize),  mrb_msgpack_packer_initialize, MRB_ARGS_OPT(1) | MRB_ARGS_KEY(3, 0));
+
+  mrb_define_method_id(mrb, mrb_packer_class,
+                       MRB_SYM(write),       mrb_msgpack_packer_write_m,    MRB_ARGS_REQ(1));
+
+  mrb_define_method_id(mrb, mrb_packer_class,
+                       MRB_OPSYM(lshift),    mrb_msgpack_packer_write_m,    MRB_ARGS_REQ(1));
+
+  mrb_define_method_id(mrb, mrb_packer_class,
+                       MRB_SYM(to_s),        mrb_msgpack_packer_to_s_m,     MRB_ARGS_NONE());
+
+  mrb_define_method_id(mrb, mrb_packer_class,
+                       MRB_SYM(reset),       mrb_msgpack_packer_reset_m,    MRB_ARGS_NONE());
+
+  mrb_define_method_id(mrb, mrb_packer_class,
+                       MRB_SYM(bytesize),    mrb_msgpack_packer_bytesize_m, MRB_ARGS_NONE());
+
+  mrb_define_method_id(mrb, mrb_packer_class,
+                       MRB_SYM(flush),       mrb_msgpack_packer_flush_m,    MRB_ARGS_NONE());
+
+  mrb_unpacker_class =
+    mrb_define_class_under_id(mrb, msgpack_mod,
+                              MRB_SYM(Unpacker), mrb->object_class);
+
+  MRB_SET_INSTANCE_TT(mrb_unpacker_class, MRB_TT_DATA);
+
+  mrb_define_method_id(mrb, mrb_unpacker_class,
+                       MRB_SYM(initialize),  mrb_msgpack_unpacker_initialize,    MRB_ARGS_KEY(3, 0));
+
+  mrb_define_method_id(mrb, mrb_unpacker_class,
+                       MRB_SYM(feed),        mrb_msgpack_unpacker_feed_m,        MRB_ARGS_REQ(1));
+
+  mrb_define_method_id(mrb, mrb_unpacker_class,
+                       MRB_OPSYM(lshift),    mrb_msgpack_unpacker_feed_m,        MRB_ARGS_REQ(1));
+
+  mrb_define_method_id(mrb, mrb_unpacker_class,
+                       MRB_SYM(each),        mrb_msgpack_unpacker_each_m,        MRB_ARGS_BLOCK());
+
+  mrb_define_method_id(mrb, mrb_unpacker_class,
+                       MRB_SYM(buffer_size), mrb_msgpack_unpacker_buffer_size_m, MRB_ARGS_NONE());
+
+  mrb_define_method_id(mrb, mrb_unpacker_class,
+                       MRB_SYM(reset),       mrb_msgpack_unpacker_reset_m,       MRB_ARGS_NONE());
+
+  /* Codec, defines the class and creates the default codec */
+  mrb_msgpack_ensure(mrb);
+
+  mrb_codec_class = mrb_class_get_under_id(mrb, msgpack_mod, MRB_SYM(Codec));
+
+  mrb_define_method_id(mrb, mrb_codec_class,
+                       MRB_SYM(pack),        mrb_msgpack_codec_pack_m,        MRB_ARGS_REQ(1) | MRB_ARGS_KEY(2, 0));
+
+  mrb_define_method_id(mrb, mrb_codec_class,
+                       MRB_SYM(packed_size), mrb_msgpack_codec_packed_size_m, MRB_ARGS_REQ(1));
+
+  mrb_define_method_id(mrb, mrb_codec_class,
+                       MRB_SYM(unpack),      mrb_msgpack_codec_unpack_m,      MRB_ARGS_REQ(1) | MRB_ARGS_KEY(5, 0) | MRB_ARGS_BLOCK());
+
+  mrb_define_method_id(mrb, mrb_codec_class,
+                       MRB_SYM(register_pack_type),   mrb_msgpack_codec_register_pack_type_m,   MRB_ARGS_REQ(2) | MRB_ARGS_BLOCK());
+
+  mrb_define_method_id(mrb, mrb_codec_class,
+                       MRB_SYM(register_unpack_type), mrb_msgpack_codec_register_unpack_type_m, MRB_ARGS_REQ(1) | MRB_ARGS_BLOCK());
+
+  mrb_define_method_id(mrb, mrb_codec_class,
+                       MRB_SYM_Q(ext_packer_registered),   mrb_msgpack_codec_ext_packer_registered,   MRB_ARGS_REQ(1));
+
+  mrb_define_method_id(mrb, mrb_codec_class,
+                       MRB_SYM_Q(ext_unpacker_registered), mrb_msgpack_codec_ext_unpacker_registered, MRB_ARGS_REQ(1));
+
+  mrb_define_method_id(mrb, mrb_codec_class,
+                       MRB_SYM(sym_strategy), mrb_msgpack_codec_sym_strategy, MRB_ARGS_NONE());
+
+  mrb_define_method_id(mrb, mrb_codec_class,
+                       MRB_SYM(packable), mrb_msgpack_codec_packable_m, MRB_ARGS_REQ(1) | MRB_ARGS_REST() | MRB_ARGS_KEY(2, 0));
+
   /* Constants */
   mrb_define_const_id(mrb, msgpack_mod,
                       MRB_SYM(LibMsgPackCVersion),
                       mrb_str_new_lit_frozen(mrb, MSGPACK_VERSION));
 
+  /* the algorithms pack(compress:) was built with */
+  mrb_value compressions = mrb_ary_new(mrb);
+#ifdef MRB_MSGPACK_USE_LZ4
+  mrb_ary_push(mrb, compressions, mrb_symbol_value(MRB_SYM(lz4)));
+#endif
+#ifdef MRB_MSGPACK_USE_ZSTD
+  mrb_ary_push(mrb, compressions, mrb_symbol_value(MRB_SYM(zstd)));
+#endif
+  mrb_define_const_id(mrb, msgpack_mod, MRB_SYM(COMPRESSIONS), mrb_obj_freeze(mrb, compressions));
+
   /* Module functions */
   mrb_define_module_function_id(mrb, msgpack_mod,
                                 MRB_SYM(pack),
                                 mrb_msgpack_pack_m,
+                                MRB_ARGS_REQ(1) | MRB_ARGS_KEY(2, 0));
+
+  mrb_define_module_function_id(mrb, msgpack_mod,
+                                MRB_SYM(packable),
+                                mrb_msgpack_packable_m,
+                                MRB_ARGS_REQ(1) | MRB_ARGS_REST() | MRB_ARGS_KEY(2, 0));
+
+  mrb_define_module_function_id(mrb, msgpack_mod,
+                                MRB_SYM(packed_size),
+                                mrb_msgpack_packed_size_m,
                                 MRB_ARGS_REQ(1));
 
+  mrb_define_module_function_id(mrb, msgpack_mod,
+                                MRB_SYM(pack_to),
+                                mrb_msgpack_pack_to_m,
+                                MRB_ARGS_REQ(2) | MRB_ARGS_KEY(2, 0));
+
   mrb_define_module_function_id(mrb, msgpack_mod,
                                 MRB_SYM(register_pack_type),
                                 mrb_msgpack_register_pack_type,
@@ -1500,7 +5312,7 @@ mrb_mruby_simplemsgpack_gem_init(mrb_state* mrb)
   mrb_define_module_function_id(mrb, msgpack_mod,
                                 MRB_SYM(unpack),
                                 mrb_msgpack_unpack_m,
-                                MRB_ARGS_REQ(1) | MRB_ARGS_BLOCK());
+                                MRB_ARGS_REQ(1) | MRB_ARGS_KEY(5, 0) | MRB_ARGS_BLOCK());
 
   mrb_define_module_function_id(mrb, msgpack_mod,
                                 MRB_SYM(unpack_lazy),
@@ -1522,14 +5334,26 @@ mrb_mruby_simplemsgpack_gem_init(mrb_state* mrb)
                                 mrb_msgpack_sym_strategy,
                                 MRB_ARGS_ARG(0,2));
 
+  mrb_define_module_function_id(mrb, msgpack_mod,
+                                MRB_SYM_E(memoize),
+                                mrb_msgpack_memoize_set,
+                                MRB_ARGS_REQ(1));
+
+  mrb_define_method_id(mrb, mrb->module_class,
+                       MRB_SYM(method_added),     mrb_msgpack_mod_method_changed,   MRB_ARGS_REQ(1));
+
+  mrb_define_method_id(mrb, mrb->module_class,
+                       MRB_SYM(method_removed),   mrb_msgpack_mod_method_changed,   MRB_ARGS_REQ(1));
+
+  mrb_define_method_id(mrb, mrb->module_class,
+                       MRB_SYM(method_undefined), mrb_msgpack_mod_method_changed,   MRB_ARGS_REQ(1));
+
   mrb_define_method_id(mrb,
                 mrb->string_class,
                 MRB_SYM(constantize),
                 mrb_str_constantize,
                 MRB_ARGS_NONE());
 
-  mrb_msgpack_ensure(mrb);
-
 }
 
 void
@@ -100,6 +100,22 @@ mrb_msgpack_test_sym_strategy_set(mrb_state *mrb, mrb_value self)
   return mrb_nil_value();
 }
 
+static mrb_value
+mrb_msgpack_test_packer(mrb_state *mrb, mrb_value self)
+{
+  mrb_value packer = mrb_msgpack_packer_new(mrb);
+
+  mrb_msgpack_packer_write(mrb, packer, mrb_str_new_lit(mrb, "hallo"));
+  mrb_msgpack_packer_reset(mrb, packer);
+  mrb_msgpack_packer_write(mrb, packer, mrb_fixnum_value(1));
+  mrb_msgpack_packer_write(mrb, packer, mrb_str_new_lit(mrb, "hallo"));
+
+  if (mrb_msgpack_packer_bytesize(mrb, packer) != 7) {
+    return mrb_nil_value();
+  }
+
+  return mrb_msgpack_packer_to_s(mrb, packer);
+}
 
 /* -------------------------------------------------------------
  * Test module initializer
@@ -132,6 +148,9 @@ mrb_define_module_function(mrb, msgpack_test,
                            MRB_ARGS_REQ(1));
 
 
+  mrb_define_module_function(mrb, msgpack_test, "test_packer",
+                             mrb_msgpack_test_packer, MRB_ARGS_NONE());
+
   mrb_define_module_function(mrb, msgpack_test, "sym_strategy_get",
                              mrb_msgpack_test_sym_strategy_get, MRB_ARGS_NONE());
 
@@ -722,3 +722,707 @@ assert("MessagePack::TimestampExt vectors from file") do
   assert_equal(-1, t96.to_i)
   assert_equal 999_999_000, t96.nsec
 end
+
+assert("MessagePack::Packer") do
+  packer = MessagePack::Packer.new
+  assert_equal 0, packer.bytesize
+
+  packer.write(1).write("two") << [3]
+  assert_equal(1.to_msgpack + "two".to_msgpack + [3].to_msgpack, packer.to_s)
+  assert_equal packer.to_s.bytesize, packer.bytesize
+
+  packer.reset
+  assert_equal 0, packer.bytesize
+  assert_equal "", packer.to_s
+
+  big = "x" * 100_000
+  3.times do
+    packer.reset
+    packer.write(big)
+    assert_equal big, MessagePack.unpack(packer.to_s)
+  end
+end
+
+assert("MessagePack::Packer drops output of a failed write") do
+  class PackerFails
+    def to_s
+      raise "no"
+    end
+  end
+
+  packer = MessagePack::Packer.new
+  packer.write("kept")
+  assert_raise(RuntimeError) { packer.write(["lost", PackerFails.new]) }
+  assert_equal "kept".to_msgpack, packer.to_s
+end
+
+assert("C API: Packer") do
+  assert_equal(1.to_msgpack + "hallo".to_msgpack, MessagePackTest.test_packer)
+end
+
+assert("MessagePack.pack_to") do
+  r, w = IO.pipe
+  obj = { "a" => [1, 2, "x" * 20_000], "b" => nil }
+  packed = MessagePack.pack(obj)
+
+  assert_equal packed.bytesize, MessagePack.pack_to(w, obj, high_water: 100)
+  assert_equal obj, MessagePack.unpack(r.read(packed.bytesize))
+
+  assert_equal packed.bytesize, MessagePack.pack_to(w.fileno, obj)
+  assert_equal obj, MessagePack.unpack(r.read(packed.bytesize))
+
+  r.close
+  w.close
+end
+
+assert("MessagePack::Packer streaming to an IO") do
+  r, w = IO.pipe
+  packer = MessagePack::Packer.new(w, high_water: 1024)
+
+  packer.write("x" * 3000)
+  assert_true packer.bytesize < 1024
+  packer.write(:done).flush
+  assert_equal 0, packer.bytesize
+  assert_raise(MessagePack::Error) { packer.to_s }
+
+  packed = MessagePack.pack("x" * 3000) + MessagePack.pack(:done)
+  assert_equal packed, r.read(packed.bytesize)
+
+  r.close
+  w.close
+end
+
+assert("MessagePack::Packer streaming drops output of a failed write") do
+  class StreamFails
+    def to_s
+      raise "no"
+    end
+  end
+
+  r, w = IO.pipe
+  packer = MessagePack::Packer.new(w, high_water: 1024)
+  packer.write("kept")
+  # the failing element comes after more than high_water bytes of the array
+  assert_raise(RuntimeError) { packer.write(["x" * 3000, StreamFails.new]) }
+  assert_equal "kept".to_msgpack.bytesize, packer.bytesize
+  packer.write("after").flush
+
+  packed = "kept".to_msgpack + "after".to_msgpack
+  assert_equal packed, r.read(packed.bytesize)
+  w.close
+  assert_equal nil, r.read(1)
+  r.close
+end
+
+assert("MessagePack.packed_size and pack(exact: true)") do
+  small = { "a" => [1, 2.5, nil, "b"] }
+  large = { "list" => (1..2000).map { |i| { "id" => i, "name" => "x" * (i % 17) } } }
+
+  [nil, 1, "x" * 70_000, small, large].each do |obj|
+    packed = MessagePack.pack(obj)
+    assert_equal packed.bytesize, MessagePack.packed_size(obj)
+    assert_equal packed, MessagePack.pack(obj, exact: true)
+  end
+
+  # conversion methods run once, whatever they return
+  calls = 0
+  counted = Class.new
+  counted.send(:define_method, :to_str) { calls += 1; "c" * calls }
+  obj = { "a" => [counted.new, 1] }
+  assert_equal({ "a" => ["c", 1] }, MessagePack.unpack(MessagePack.pack(obj, exact: true)))
+  assert_equal 1, calls
+  assert_equal MessagePack.pack({ "a" => ["cc", 1] }).bytesize, MessagePack.packed_size(obj)
+  assert_equal 2, calls
+end
+
+assert("Ext packer lookup cache follows registrations and includes") do
+  class CachedMiss; end
+  module CachedMod; end
+
+  miss = MessagePack.unpack(CachedMiss.new.to_msgpack)
+  assert_kind_of String, miss
+
+  MessagePack.register_pack_type(20, CachedMod) { |obj| "mod" }
+  assert_equal miss.class, MessagePack.unpack(CachedMiss.new.to_msgpack).class
+
+  class CachedMiss; include CachedMod; end
+  assert_equal "\xc7\x03\x14mod", CachedMiss.new.to_msgpack
+
+  # extending a single object must not leak into its class
+  other = Object.new
+  Object.new.extend(CachedMod).to_msgpack
+  assert_not_equal "\xc7\x03\x14mod", other.to_msgpack
+end
+
+assert("Re-registering an ext type replaces it in place") do
+  class RegistryBase; end
+  class RegistryChild < RegistryBase; end
+
+  MessagePack.register_pack_type(21, RegistryBase) { |obj| "base" }
+  MessagePack.register_pack_type(22, RegistryChild) { |obj| "child" }
+  assert_true MessagePack.ext_packer_registered?(RegistryChild)
+  assert_equal "\xc7\x05\x16child", RegistryChild.new.to_msgpack
+
+  MessagePack.register_pack_type(23, RegistryBase) { |obj| "again" }
+  assert_equal "\xc7\x05\x17again", RegistryBase.new.to_msgpack
+  assert_equal "\xc7\x05\x16child", RegistryChild.new.to_msgpack
+
+  MessagePack.register_unpack_type(23) { |data| data.upcase }
+  assert_true MessagePack.ext_unpacker_registered?(23)
+  assert_false MessagePack.ext_unpacker_registered?(200)
+  assert_equal "AGAIN", MessagePack.unpack(RegistryBase.new.to_msgpack)
+end
+
+assert("MessagePack::TimestampExt keeps microseconds across a roundtrip") do
+  sec  = 1_700_000_000
+  stamp = lambda do |nsec|
+    v = (nsec << 34) | sec
+    [0xD7, 0xFF].pack("C*") + (0..7).map { |i| (v >> (56 - 8 * i)) & 0xFF }.pack("C*")
+  end
+
+  time = MessagePack.unpack(stamp.call(123_456_789))
+  assert_equal sec, time.to_i
+  assert_equal 123_456, time.usec
+  assert_equal stamp.call(123_456_000), MessagePack.pack(time)
+  assert_equal stamp.call(123_456_000), MessagePack.pack([time])[1..-1]
+  assert_equal stamp.call(123_456_000), MessagePack.pack(time.dup)
+
+  class TimeSub < Time; end
+  sub = TimeSub.at(sec, 5)
+  assert_equal MessagePack.pack(Time.at(sec, 5)), MessagePack.pack(sub)
+end
+
+assert("MessagePack::Codec") do
+  class CodecPoint
+    attr_reader :x
+    def initialize(x); @x = x; end
+  end
+
+  ints = MessagePack::Codec.new(sym_strategy: [:int, 5])
+  strs = MessagePack::Codec.new(sym_strategy: [:string, 6],
+                                ext_types: { 7 => { class: CodecPoint,
+                                                    pack: ->(p) { p.x.to_s },
+                                                    unpack: ->(d) { CodecPoint.new(d.to_i) } } })
+
+  assert_equal [:int, 5], ints.sym_strategy
+  assert_equal [:string, 6], strs.sym_strategy
+  assert_equal :raw, MessagePack.sym_strategy
+
+  assert_equal :sym, ints.unpack(ints.pack(:sym))
+  assert_equal :sym, strs.unpack(strs.pack(:sym))
+  assert_equal "sym", MessagePack.unpack(MessagePack.pack(:sym))
+  assert_equal "\xd4\x06s", strs.pack(:s)
+
+  assert_true strs.ext_packer_registered?(CodecPoint)
+  assert_false ints.ext_packer_registered?(CodecPoint)
+  assert_false MessagePack.ext_packer_registered?(CodecPoint)
+  assert_equal 42, strs.unpack(strs.pack(CodecPoint.new(42))).x
+  assert_equal strs.pack(CodecPoint.new(1)).bytesize, strs.packed_size(CodecPoint.new(1))
+
+  assert_raise(MessagePack::Error) { ints.unpack(strs.pack(CodecPoint.new(1))) }
+
+  packer = MessagePack::Packer.new(codec: ints)
+  packer.write(:sym)
+  assert_equal ints.pack(:sym), packer.to_s
+end
+
+assert("MessagePack.unpack(symbolize_keys: true)") do
+  long_key = "k" * 40
+  records = (1..50).map { |i| { "id" => i, "name" => "n#{i}", long_key => true, 1 => "int key" } }
+  packed = MessagePack.pack(records)
+
+  unpacked = MessagePack.unpack(packed, symbolize_keys: true)
+  assert_equal 50, unpacked.size
+  assert_equal({ id: 7, name: "n7", long_key.to_sym => true, 1 => "int key" }, unpacked[6])
+  assert_equal records, MessagePack.unpack(packed)
+
+  nested = MessagePack.pack({ "a" => { "b" => ["c", { "d" => 1 }] } })
+  assert_equal({ a: { b: ["c", { d: 1 }] } }, MessagePack.unpack(nested, symbolize_keys: true))
+  assert_equal({ a: { b: ["c", { d: 1 }] } }, MessagePack.unpack_lazy(nested).value(symbolize_keys: true))
+  assert_equal({ "a" => { "b" => ["c", { "d" => 1 }] } }, MessagePack.unpack_lazy(nested).value)
+
+  streamed = []
+  MessagePack.unpack(nested + nested, symbolize_keys: true) { |obj| streamed << obj }
+  assert_equal [{ a: { b: ["c", { d: 1 }] } }] * 2, streamed
+end
+
+assert("MessagePack.unpack(dedup_keys: true)") do
+  records = (1..100).map { |i| { "id" => i, "name" => "n#{i}", "tags" => [{ "id" => -i }] } }
+  packed = MessagePack.pack(records)
+
+  unpacked = MessagePack.unpack(packed, dedup_keys: true)
+  assert_equal records, unpacked
+
+  keys = unpacked.map { |r| r.keys.first }
+  assert_true keys.all? { |k| k.frozen? }
+  assert_true keys.all? { |k| k.equal?(keys.first) }
+  assert_true unpacked[3]["tags"][0].keys.first.equal?(keys.first)
+
+  lazy = MessagePack.unpack_lazy(packed).value(dedup_keys: true)
+  assert_true lazy[0].keys[1].equal?(lazy[99].keys[1])
+
+  # symbolize_keys wins when both are given
+  assert_equal({ id: 1 }, MessagePack.unpack(MessagePack.pack({ "id" => 1 }), symbolize_keys: true, dedup_keys: true))
+end
+
+assert("MessagePack.unpack(zero_copy: true)") do
+  blob = "b" * 100_000
+  small = "s" * 10
+  data = MessagePack.pack({ "blob" => blob, "small" => small, "list" => [blob, 1] })
+
+  unpacked = MessagePack.unpack(data, zero_copy: true)
+  assert_equal blob, unpacked["blob"]
+  assert_equal small, unpacked["small"]
+  assert_equal blob, unpacked["list"][0]
+
+  # shared substrings are copy on write in both directions
+  unpacked["blob"][0] = "X"
+  assert_equal "X", unpacked["blob"][0]
+  assert_equal "b", unpacked["list"][0][0]
+  data.replace("")
+  assert_equal blob, unpacked["list"][0]
+
+  data = MessagePack.pack(small) + MessagePack.pack(blob)
+  streamed = []
+  MessagePack.unpack(data, zero_copy: 8) { |obj| streamed << obj }
+  assert_equal [small, blob], streamed
+
+  assert_raise(ArgumentError) { MessagePack.unpack(data, zero_copy: 0) }
+end
+
+assert("MessagePack.unpack decodes nested data and enforces limits") do
+  time = Time.at(1_700_000_000, 123_456)
+  data = { "a" => [1, -2, 1.5, nil, true, { [1, 2] => "k" }], "t" => [time], "m" => {} }
+  assert_equal data, MessagePack.unpack(MessagePack.pack(data))
+
+  nested = []
+  130.times { nested = [nested] }
+  assert_raise(MessagePack::Error) { MessagePack.unpack(MessagePack.pack(nested)) }
+  assert_raise(MessagePack::Error) { MessagePack.unpack("\x92\x01") }
+  assert_raise(MessagePack::Error) { MessagePack.unpack("\xC1") }
+
+  unpacker_called = 0
+  codec = MessagePack::Codec.new
+  codec.register_unpack_type(5) { |d| unpacker_called += 1; d }
+  packed = MessagePack.pack([1]) + "\x92\xD4\x05x"
+  streamed = []
+  assert_equal 2, codec.unpack(packed) { |obj| streamed << obj }
+  assert_equal [[1]], streamed
+  assert_equal 0, unpacker_called
+end
+
+assert("MessagePack::Unpacker") do
+  packed = MessagePack.pack({ "a" => [1, "two"] }) + MessagePack.pack("x" * 300) + MessagePack.pack(3)
+  unpacker = MessagePack::Unpacker.new
+  unpacked = []
+  packed.each_char { |c| unpacker.feed(c).each { |obj| unpacked << obj } }
+  assert_equal [{ "a" => [1, "two"] }, "x" * 300, 3], unpacked
+  assert_equal 0, unpacker.buffer_size
+
+  unpacker << MessagePack.pack([1, 2])[0, 2]
+  unpacker.each { |obj| unpacked << obj }
+  assert_equal 3, unpacked.size
+  assert_equal 2, unpacker.buffer_size
+  unpacker.reset
+  assert_equal 0, unpacker.buffer_size
+  unpacker << MessagePack.pack(:b)
+  unpacker.each { |obj| unpacked << obj }
+  assert_equal "b", unpacked.last
+
+  unpacker = MessagePack::Unpacker.new(symbolize_keys: true)
+  unpacker.feed(MessagePack.pack({ "k" => 1 }))
+  result = nil
+  unpacker.each { |obj| result = obj }
+  assert_equal({ k: 1 }, result)
+
+  assert_raise(MessagePack::Error) { MessagePack::Unpacker.new.feed("\xC1").each {} }
+  assert_raise(ArgumentError) { MessagePack::Unpacker.new.each }
+end
+
+assert("MessagePack.unpack_lazy at_pointer into large maps") do
+  table = {}
+  200.times { |i| table["key#{i}"] = { "n" => i } }
+  lazy = MessagePack.unpack_lazy(MessagePack.pack({ "table" => table, "small" => { "a" => 1 } }))
+  assert_equal 0, lazy.at_pointer("/table/key0/n")
+  assert_equal 199, lazy.at_pointer("/table/key199/n")
+  assert_equal 57, lazy.at_pointer("/table/key57/n")
+  assert_equal 1, lazy.at_pointer("/small/a")
+  assert_raise(KeyError) { lazy.at_pointer("/table/key200") }
+end
+
+assert("MessagePack::Pointer and ObjectHandle#at_pointers") do
+  data = { "user" => { "name" => "Alpha", "tags" => ["a", "b"], "a/b" => 1 }, "id" => 7 }
+  lazy = MessagePack.unpack_lazy(MessagePack.pack(data))
+
+  name = MessagePack::Pointer.new("/user/name")
+  assert_equal "/user/name", name.to_s
+  assert_equal "Alpha", lazy.at_pointer(name)
+  assert_equal data, lazy.at_pointer(MessagePack::Pointer.new(""))
+  assert_raise(ArgumentError) { MessagePack::Pointer.new("user") }
+
+  assert_equal ["Alpha", "b", 1, 7, "Alpha"],
+               lazy.at_pointers([name, "/user/tags/1", MessagePack::Pointer.new("/user/a~1b"), "/id", "/user/name"])
+  assert_equal [], lazy.at_pointers([])
+  assert_raise(KeyError) { lazy.at_pointers(["/id", "/nope"]) }
+  assert_raise(IndexError) { lazy.at_pointers(["/user/tags/x"]) }
+end
+
+assert("MessagePack.unpack_lazy only reads what it navigates to") do
+  packed = MessagePack.pack({ "a" => [1, 2, { "b" => "c" }], "big" => "x" * 1000 })
+  truncated = packed[0, packed.bytesize - 10]
+
+  lazy = MessagePack.unpack_lazy(truncated)
+  assert_equal "c", lazy.at_pointer("/a/2/b")
+  assert_equal [1, 2, { "b" => "c" }], lazy.at_pointer("/a")
+  assert_raise(MessagePack::Error) { lazy.at_pointer("/big") }
+  assert_raise(MessagePack::Error) { lazy.value }
+  assert_raise(MessagePack::Error) { MessagePack.unpack_lazy("") }
+
+  source = packed.dup
+  lazy = MessagePack.unpack_lazy(source)
+  source.replace(MessagePack.pack(nil))
+  assert_equal "c", lazy.at_pointer("/a/2/b")
+  assert_equal 1000, lazy.at_pointer("/big").bytesize
+end
+
+assert("MessagePack ObjectHandle#child, each_child, each_pair, size and type") do
+  data = { "items" => [{ "id" => 1, "ok" => true }, { "id" => 2, "ok" => false }, { "id" => 3, "ok" => true }], "n" => 1.5 }
+  lazy = MessagePack.unpack_lazy(MessagePack.pack(data))
+
+  items = lazy.child("/items")
+  assert_equal :array, items.type
+  assert_equal 3, items.size
+  assert_equal :map, lazy.type
+  assert_equal 2, lazy.size
+  assert_equal :float, lazy.child("/n").type
+  assert_equal :boolean, items.child("/0/ok").type
+  assert_equal 2, items.child("/1").at_pointer("/id")
+
+  ids = []
+  items.each_child { |item| ids << item.at_pointer("/id") if item.at_pointer("/ok") }
+  assert_equal [1, 3], ids
+
+  pairs = []
+  items.child("/0").each_pair { |key, value| pairs << [key, value.value] }
+  assert_equal [["id", 1], ["ok", true]], pairs
+
+  values = []
+  lazy.each_child { |value| values << value.type }
+  assert_equal [:array, :float], values
+
+  assert_raise(TypeError) { items.each_pair {} }
+  assert_raise(TypeError) { lazy.child("/n").size }
+end
+
+assert("MessagePack ObjectHandle#pluck and '*' in pointers") do
+  data = {
+    "items" => [{ "id" => 1, "tags" => ["a"] }, { "id" => 2, "tags" => ["b", "c"] }],
+    "by_name" => { "x" => { "id" => 10 }, "y" => { "id" => 20 } }
+  }
+  lazy = MessagePack.unpack_lazy(MessagePack.pack(data))
+
+  assert_equal [1, 2], lazy.pluck("/items/*/id")
+  assert_equal [10, 20], lazy.pluck(MessagePack::Pointer.new("/by_name/*/id"))
+  assert_equal ["a", "b", "c"], lazy.pluck("/items/*/tags/*")
+  assert_equal [1], lazy.pluck("/items/0/id")
+  assert_equal [1, 2], lazy.child("/items").pluck("/*/id")
+
+  assert_raise(KeyError) { lazy.pluck("/items/*/nope") }
+  assert_raise(TypeError) { lazy.pluck("/items/0/id/*") }
+
+  # only pluck knows wildcards, elsewhere "*" is a key like any other
+  assert_raise(IndexError) { lazy.at_pointer("/items/*/id") }
+  starred = MessagePack.unpack_lazy(MessagePack.pack({ "*" => { "a" => 1 }, "b" => { "a" => 2 } }))
+  assert_equal 1, starred.at_pointer("/*/a")
+  assert_equal [1, 1], starred.at_pointers(["/*/a", "/*/a"])
+  assert_equal({ "a" => 1 }, starred.child("/*").value)
+  assert_equal [1, 2], starred.pluck("/*/a")
+end
+
+assert("MessagePack numeric Arrays") do
+  mixed = [1, 200, -1, -200, 70000, 2**40, 1.5, "a", 2]
+  assert_equal "\x99\x01\xCC\xC8\xFF\xD1\xFF\x38\xCE\x00\x01\x11\x70\xCF\x00\x00\x01\x00\x00\x00\x00\x00\xCB\x3F\xF8\x00\x00\x00\x00\x00\x00\xA1a\x02",
+               MessagePack.pack(mixed)
+  assert_equal mixed, MessagePack.unpack(MessagePack.pack(mixed))
+
+  ints = (0...5000).map { |i| i * 7919 - 1_000_000 }
+  floats = (0...5000).map { |i| i * 0.25 }
+  assert_equal ints, MessagePack.unpack(MessagePack.pack(ints))
+  assert_equal floats, MessagePack.unpack(MessagePack.pack(floats))
+  assert_equal MessagePack.pack(ints).bytesize, MessagePack.packed_size(ints)
+
+  unpacker = MessagePack::Unpacker.new
+  unpacker.feed(MessagePack.pack(ints))
+  unpacker.each { |obj| assert_equal ints, obj }
+
+  # MessagePack.unpack stores immediates directly, Bignums and boxed Floats
+  # in between, nested Arrays and numbers in Hashes go the usual way
+  big = (0...3000).map { |i| i.even? ? i * 31 - 40_000 : [2**62, 1.0 / (i + 1), -(2**40)][i % 3] }
+  nested = [ints.first(100), [floats.first(100), { "n" => 5, 6 => 7.5 }], big]
+  assert_equal big, MessagePack.unpack(MessagePack.pack(big))
+  assert_equal nested, MessagePack.unpack(MessagePack.pack(nested))
+  assert_equal [[1, 2], 3], MessagePack.unpack("\x92\x92\x01\x02\x03")
+end
+
+assert("MessagePack.unpack(threads:)") do
+  docs = (0...3000).map { |i| { "i" => i, "s" => "x" * (i % 50), "a" => [i, i.to_f] } }
+  packed = docs.map { |d| MessagePack.pack(d) }.join
+  tail = MessagePack.pack([1, 2, 3])
+
+  unpacked = []
+  assert_equal packed.bytesize, MessagePack.unpack(packed + tail[0, 2], threads: 4) { |obj| unpacked << obj }
+  assert_equal docs, unpacked
+
+  unpacked = []
+  MessagePack.unpack(packed, threads: true, symbolize_keys: true) { |obj| unpacked << obj }
+  assert_equal 3000, unpacked.size
+  assert_equal({ i: 2999, s: "x" * 49, a: [2999, 2999.0] }, unpacked.last)
+
+  seen = 0
+  assert_raise(MessagePack::Error) { MessagePack.unpack(packed + "\xC1", threads: 2) { seen += 1 } }
+  assert_equal 3000, seen
+
+  nested = []
+  130.times { nested = [nested] }
+  assert_raise(MessagePack::Error) { MessagePack.unpack(MessagePack.pack(nested), threads: 2) {} }
+  assert_raise(ArgumentError) { MessagePack.unpack(packed, threads: 2) }
+  assert_raise(ArgumentError) { MessagePack.unpack(packed, threads: 0) {} }
+
+  # a block leaving early stops the workers
+  count = 0
+  MessagePack.unpack(packed, threads: 4) { |obj| count += 1; break if count == 10 }
+  assert_equal 10, count
+end
+
+assert("MessagePack.pack(compress:)") do
+  snapshot = (0...20000).map { |i| { "id" => i, "name" => "user#{i % 100}", "tags" => ["a", "b"] } }
+  plain = MessagePack.pack(snapshot)
+
+  # a stored frame, the format every build can read
+  frame = "MZ\x00" + [plain.bytesize, plain.bytesize].pack("NN") + plain
+  assert_equal snapshot, MessagePack.unpack(frame, compressed: true)
+
+  unpacker = MessagePack::Unpacker.new(compressed: true)
+  objs = []
+  stream = frame + frame
+  0.step(stream.bytesize - 1, 4096) { |i| unpacker.feed(stream.byteslice(i, 4096)).each { |obj| objs << obj } }
+  assert_equal [snapshot, snapshot], objs
+  assert_equal 0, unpacker.buffer_size
+
+  MessagePack::COMPRESSIONS.each do |algorithm|
+    packed = MessagePack.pack(snapshot, compress: algorithm)
+    assert_true packed.bytesize < plain.bytesize
+    assert_equal snapshot, MessagePack.unpack(packed, compressed: true)
+
+    packer = MessagePack::Packer.new(compress: algorithm)
+    packer << 1 << "two" << snapshot
+    unpacker = MessagePack::Unpacker.new(compressed: true)
+    objs = []
+    stream = packer.to_s
+    0.step(stream.bytesize - 1, 1000) { |i| unpacker.feed(stream.byteslice(i, 1000)).each { |obj| objs << obj } }
+    assert_equal [1, "two", snapshot], objs
+
+    # incompressible bytes end up in stored frames
+    noise = (0...70000).map { rand(256).chr }.join
+    assert_equal noise, MessagePack.unpack(MessagePack.pack(noise, compress: algorithm), compressed: true)
+  end
+
+  ([:lz4, :zstd] - MessagePack::COMPRESSIONS).each do |algorithm|
+    assert_raise(NotImplementedError) { MessagePack.pack(1, compress: algorithm) }
+  end
+  assert_raise(ArgumentError) { MessagePack.pack(1, compress: :gzip) }
+  assert_raise(MessagePack::Error) { MessagePack.unpack(frame[0, 100], compressed: true) }
+  assert_raise(MessagePack::Error) { MessagePack.unpack(plain, compressed: true) }
+end
+
+assert("MessagePack::RawValue") do
+  upstream = MessagePack.pack({ "status" => 200, "items" => [1, 2, 3] })
+  raw = MessagePack::RawValue.new(upstream)
+  envelope = { "id" => 7, "body" => raw }
+
+  assert_equal MessagePack.pack({ "id" => 7, "body" => { "status" => 200, "items" => [1, 2, 3] } }), MessagePack.pack(envelope)
+  assert_equal({ "id" => 7, "body" => { "status" => 200, "items" => [1, 2, 3] } }, MessagePack.unpack(envelope.to_msgpack))
+  assert_equal MessagePack.pack(envelope).bytesize, MessagePack.packed_size(envelope)
+  assert_equal [upstream, upstream].join.bytesize + 1, MessagePack.pack([raw, raw]).bytesize
+
+  # keeps its own bytes
+  assert_true raw.to_s.frozen?
+  upstream << "x"
+  assert_equal upstream.bytesize - 1, raw.bytesize
+
+  assert_kind_of MessagePack::RawValue, MessagePack::RawValue.new(MessagePack.pack([1, { "a" => nil }]), validate: true)
+  assert_raise(MessagePack::Error) { MessagePack::RawValue.new("\x92\x01", validate: true) }
+  assert_raise(MessagePack::Error) { MessagePack::RawValue.new("\x01\x02", validate: true) }
+  assert_raise(MessagePack::Error) { MessagePack::RawValue.new("", validate: true) }
+end
+
+assert("MessagePack memoize") do
+  codec = MessagePack::Codec.new(memoize: true)
+  config = { "features" => ["a".freeze, "b".freeze].freeze, "limit" => 10, "blob" => ("x" * 2000).freeze }.freeze
+
+  packed = MessagePack.pack(config)
+  assert_equal packed, codec.pack(config)
+  assert_equal packed, codec.pack(config)
+  assert_equal MessagePack.pack([config, 1, config]), codec.pack([config, 1, config])
+  assert_equal packed.bytesize, codec.packed_size(config)
+
+  # freezing is shallow, what is mutable inside is packed as it is now
+  list = [1]
+  shallow = { "list" => list }.freeze
+  codec.pack(shallow)
+  list << 2
+  assert_equal({ "list" => [1, 2] }, MessagePack.unpack(codec.pack(shallow)))
+
+  3.times { GC.start }
+  assert_equal packed, codec.pack(config)
+
+  MessagePack.memoize = 1024
+  syms = [:a].freeze
+  raw = MessagePack.pack(syms)
+  assert_equal raw, MessagePack.pack(syms)
+  MessagePack.sym_strategy(:int)
+  assert_not_equal raw, MessagePack.pack(syms)
+  MessagePack.sym_strategy(:raw)
+  MessagePack.memoize = false
+  assert_equal raw, MessagePack.pack(syms)
+
+  assert_raise(ArgumentError) { MessagePack::Codec.new(memoize: 0) }
+end
+
+assert("MessagePack.compile") do
+  schema = MessagePack.compile({ "id" => :integer, "name" => :string, "score" => :float, "tags" => nil })
+  assert_equal ["id", "name", "score", "tags"], schema.keys
+
+  record = { "id" => 1, "name" => "ada", "score" => 0.5, "tags" => ["x"] }
+  assert_equal MessagePack.pack(record), schema.pack(record)
+
+  # other key orders come out in the schema's order, hints only pick the fast path
+  shuffled = { "tags" => [], "score" => "n/a", "id" => 2, "name" => nil }
+  assert_equal MessagePack.pack({ "id" => 2, "name" => nil, "score" => "n/a", "tags" => [] }), schema.pack(shuffled)
+
+  # anything else is packed as usual
+  assert_equal MessagePack.pack({ "id" => 1 }), schema.pack({ "id" => 1 })
+  other = { "id" => 1, "name" => "a", "score" => 1.0, "extra" => true }
+  assert_equal MessagePack.pack(other), schema.pack(other)
+  assert_equal MessagePack.pack([1, 2]), schema.pack([1, 2])
+
+  records = (0...1000).map { |i| { "id" => i, "name" => "n#{i}", "score" => i / 2.0, "tags" => [i] } }
+  assert_equal records, MessagePack.unpack(schema.pack_array(records))
+  assert_equal MessagePack.pack(records), schema.pack_array(records)
+
+  sym_schema = MessagePack.compile([:id, :name])
+  assert_equal({ "id" => 1, "name" => "x" }, MessagePack.unpack(sym_schema.pack({ id: 1, name: "x" })))
+  assert_equal({ "id" => 1, "name" => "x" }, MessagePack.unpack(MessagePack::Codec.new.compile([:id, :name]).pack({ id: 1, name: "x" })))
+
+  # Symbol keys follow the symbol strategy in effect when packing
+  MessagePack.sym_strategy(:string, 1)
+  assert_equal MessagePack.pack({ id: 1, name: "x" }), sym_schema.pack({ id: 1, name: "x" })
+  MessagePack.sym_strategy(:raw)
+  assert_equal MessagePack.pack({ id: 1, name: "x" }), sym_schema.pack({ id: 1, name: "x" })
+
+  # a value which shrinks the record still yields every declared pair
+  record = { "a" => nil, "b" => 2, "c" => 3 }
+  record["a"] = Class.new { define_method(:to_hash) { record.delete("b"); {} } }.new
+  assert_equal MessagePack.pack({ "a" => {}, "b" => nil, "c" => 3 }), MessagePack.compile(["a", "b", "c"]).pack(record)
+
+  assert_raise(ArgumentError) { MessagePack.compile([]) }
+  assert_raise(ArgumentError) { MessagePack.compile(["a", "a"]) }
+  assert_raise(ArgumentError) { MessagePack.compile({ "a" => :decimal }) }
+  assert_raise(TypeError) { MessagePack.compile([1.5]) }
+end
+
+assert("MessagePack.packable") do
+  point = Class.new do
+    attr_reader :x, :y
+    def initialize(x, y); @x = x; @y = y; end
+  end
+  sub = Class.new(point)
+
+  codec = MessagePack::Codec.new
+  codec.packable(point, :x, "@y")
+  assert_equal({ "x" => 1, "y" => [2] }, codec.unpack(codec.pack(point.new(1, [2]))))
+  assert_equal({ "x" => nil, "y" => 2 }, codec.unpack(codec.pack(point.new(nil, 2))))
+
+  codec.packable(point, :y, :x, as: :array)
+  assert_equal [[2, 1]], codec.unpack(codec.pack([point.new(1, 2)]))
+
+  codec.packable(point, :x, :y, as: :array, type: 20)
+  pt = codec.unpack(codec.pack({ "p" => point.new(1, "a") }))["p"]
+  assert_kind_of point, pt
+  assert_equal [1, "a"], [pt.x, pt.y]
+  assert_raise(MessagePack::Error) { MessagePack.unpack(codec.pack(point.new(1, 2))) }
+  assert_raise(ArgumentError) { codec.register_unpack_type(20) { |data| data } }
+
+  # map bodies unpack by name, whatever order they come in
+  codec.packable(point, :x, :y, type: 21)
+  pt = codec.unpack(codec.pack(point.new(3, 4)))
+  assert_equal [3, 4], [pt.x, pt.y]
+  body = MessagePack.pack({ "y" => 4, "x" => 3, "z" => 5 })
+  pt = codec.unpack("\xC7".b + body.bytesize.chr + "\x15".b + body)
+  assert_equal [3, 4], [pt.x, pt.y]
+  assert_raise(MessagePack::Error) { codec.unpack(codec.pack(point.new(1, 2)).sub("\x15".b, "\x14".b)) }
+  # other keys are skipped whatever they hold, missing fields stay nil
+  body = MessagePack.pack({ 1 => [1, { "a" => 2 }], "y" => { "deep" => [1] }, "skip" => { "x" => 9 } })
+  pt = codec.unpack("\xC7".b + body.bytesize.chr + "\x15".b + body)
+  assert_equal [nil, { "deep" => [1] }], [pt.x, pt.y]
+  assert_raise(MessagePack::Error) { codec.unpack("\xC7".b + (body.bytesize - 1).chr + "\x15".b + body[0..-2]) }
+
+  # fields running Ruby code when packed come out the same as plain ones
+  conv = Class.new { def to_ary; [7]; end }
+  assert_equal codec.pack(point.new([7], 2)), codec.pack(point.new(conv.new, 2))
+  nested = codec.unpack(codec.pack(point.new(point.new(5, 6), "z")))
+  assert_equal [5, 6, "z"], [nested.x.x, nested.x.y, nested.y]
+
+  # subclasses and other codecs are left alone
+  assert_kind_of String, codec.unpack(codec.pack(sub.new(1, 2)))
+  assert_kind_of String, MessagePack::Codec.new.unpack(MessagePack::Codec.new.pack(point.new(1, 2)))
+
+  assert_raise(ArgumentError) { codec.packable(point) }
+  assert_raise(ArgumentError) { codec.packable(point, :x, :@x) }
+  assert_raise(ArgumentError) { codec.packable(point, :x, as: :list) }
+  assert_raise(RangeError) { codec.packable(point, :x, type: 128) }
+  assert_raise(TypeError) { codec.packable(point, 1) }
+  assert_raise(TypeError) { codec.packable(String, :x, type: 22) }
+  assert_raise(TypeError) { codec.packable(Comparable, :x) }
+  codec.register_unpack_type(23) { |data| data }
+  assert_raise(ArgumentError) { codec.packable(point, :x, type: 23) }
+end
+
+assert("MessagePack conversion methods") do
+  klass = Class.new do
+    def initialize(v); @v = v; end
+    def to_ary; [@v]; end
+  end
+  objs = (0...100).map { |i| klass.new(i) }
+  assert_equal objs.map { |o| [o.to_ary[0]] }, MessagePack.unpack(MessagePack.pack(objs))
+
+  # defining a conversion later is picked up by the next pack
+  klass.class_eval { def to_hash; @v.nil? ? nil : { "v" => @v }; end }
+  assert_equal({ "v" => 1 }, MessagePack.unpack(MessagePack.pack(klass.new(1))))
+  # nil moves on to the next conversion
+  assert_equal [nil], MessagePack.unpack(MessagePack.pack(klass.new(nil)))
+
+  klass.class_eval { remove_method :to_hash }
+  assert_equal [1], MessagePack.unpack(MessagePack.pack(klass.new(1)))
+  # and one that comes in through an include
+  klass.include(Module.new { def to_hash; { "m" => @v }; end })
+  assert_equal({ "m" => 1 }, MessagePack.unpack(MessagePack.pack(klass.new(1))))
+
+  # a class first packed as its to_s
+  plain = Class.new
+  assert_kind_of String, MessagePack.unpack(MessagePack.pack(plain.new))
+  plain.class_eval { def to_hash; { "late" => true }; end }
+  assert_equal({ "late" => true }, MessagePack.unpack(MessagePack.pack(plain.new)))
+
+  # singleton methods aren't cached for the class
+  o = klass.new(2)
+  def o.to_int; 3; end
+  assert_equal({ "m" => 2 }, MessagePack.unpack(MessagePack.pack(o)))
+  s = Object.new
+  def s.to_str; "s"; end
+  assert_equal "s", MessagePack.unpack(MessagePack.pack(s))
+  assert_kind_of String, MessagePack.unpack(MessagePack.pack(Object.new))
+
+  bad = Class.new { def to_hash; 1; end }
+  assert_raise(TypeError) { MessagePack.pack(bad.new) }
+end